@@ -1,901 +1,902 @@
-#include <Eigen/Dense>
-#include <Eigen/Sparse>
+#include "ConvDiffCore.h"
 #include <iostream>
-#include <vector>
-#include <cmath>
 #include <memory>
 #include <Eigen/IterativeLinearSolvers>
-#include <stdio.h>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
 #include <emscripten/html5.h>
 #include <SDL/SDL.h>
-#include <queue>
-#include <unsupported/Eigen/FFT>
-
-const double PI = 3.141592653589793238462;
-
-typedef Eigen::SparseMatrix<double> SpMat;
-typedef Eigen::VectorXd Vec;
-typedef Eigen::Triplet<double> Trip;
-typedef Eigen::MatrixXd Mat;
-
-// precomputable quantities
-const int POLYMAX = 10;
-double weights[22];
-double coords[22];
-double normLegendreDerivProducts[POLYMAX+1][POLYMAX+1];
-double normLegendreAltProducts[POLYMAX+1][POLYMAX+1];
-double normLegendreLeftVals[POLYMAX+1];
-double normLegendreRightVals[POLYMAX+1];
-double normLegendreDerivLeftVals[POLYMAX+1];
-double normLegendreDerivRightVals[POLYMAX+1];
-
-class ConvDiff
+#endif
+#include <map>
+#include <algorithm>
+#ifdef CONVDIFF_MPI
+#include <mpi.h>
+#include <Eigen/SparseLU>
+#endif
+#include <stdint.h>
+#include <chrono>
+#include <random>
+#ifdef CONVDIFF_THREADS
+#include <thread>
+#include <condition_variable>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONVDIFF_AVX2
+#include <immintrin.h>
+#endif
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+// Band-limited upsampling of an n by n periodic grid of samples (n odd) to
+// m by m pixels. The result equals zero-padding the 2d DFT of the samples to
+// m by m and inverse transforming, then rolling the output by shift pixels,
+// but only the n*n nonzero coefficients are ever formed: the forward DFT is
+// a direct real-input sum over precomputed twiddles, and the inverse is
+// evaluated in separable form, first along columns for the n/2+1
+// non-negative row frequencies and then along rows using conjugate symmetry.
+// All tables and work buffers are allocated once, in the constructor.
+class SpectralUpsampler
 {
 private:
-	int N;
-	int K;
-	int dof;
-	double L;
-	double epsilon = -1.0;
-	double diffconst = 1.0;
-	double sigma0;
-	double beta0 = 1.0;
-	SpMat A;
-	SpMat UXP;
-	SpMat UXM;
-	SpMat UYP;
-	SpMat UYM;
-	Vec rhs;
-	double ux = 0.0;
-	double uy = 0.0;
-	Eigen::BiCGSTAB<SpMat,Eigen::IncompleteLUT<double>> solver;
-	Vec phi;
-	void BuildMatA();
-	void BuildMatUXP();
-	void BuildMatUXM();
-	void BuildMatUYP();
-	void BuildMatUYM();
-	void BuildRHS();
+	int n;
+	int m;
+	int nh;
+	Mat cosN;
+	Mat sinN;
+	Mat cosM;
+	Mat sinM;
+	Mat rowRe;
+	Mat rowIm;
+	Mat coefRe;
+	Mat coefIm;
+	Mat tRe;
+	Mat tIm;
+	Vec row;
 public:
-	ConvDiff(int N,int K,double L) : N(N), K(K), L(L), dof(((N*N*(K+1)*(K+2))/2)), sigma0((K+1)*(K+2)*4+1)
-	{}
-	void init()
-	{
-		A.resize(dof,dof);
-		UXP.resize(dof,dof);
-		UXM.resize(dof,dof);
-		UYP.resize(dof,dof);
-		UYM.resize(dof,dof);
-		rhs.resize(dof);
-		phi.resize(dof);
-		BuildMatA();
-		BuildMatUXP();
-		BuildMatUXM();
-		BuildMatUYP();
-		BuildMatUYM();
-		BuildRHS();
-	}
-	void reinit(int N, int K, double L)
-	{
-		this->N = N;
-		this->K = K;
-		this->L = L;
-		dof = ((N*N*(K+1)*(K+2))/2);
-		sigma0 = (K+1)*(K+2)*4+1;
-		init();
-	}
-	inline int idx(int ix, int iy, int px, int py) { return (((K+1)*(K+2)*(N*((ix+N)%N)+(iy+N)%N))/2 + ((px+py)*(px+py+1))/2 + px); }
-	double Eval(double x, double y);
-	void SetU(double ux, double uy) { this->ux = ux; this->uy = uy; }
-	double SolResid();
-	double Solve()
-	{
-		SpMat U = (ux>0.0?ux:0.0)*UXP + (ux<0.0?ux:0.0)*UXM + (uy>0.0?uy:0.0)*UYP + (uy<0.0?uy:0.0)*UYM;
-		SpMat R = A+U;
-		R.makeCompressed();
-		solver.compute(R);
-		phi = solver.solve(rhs);
-		return (R*phi-rhs).norm();
-	}
+	SpectralUpsampler(int n, int m, int shift);
+	void Upsample(const Mat& samples, float *out);
 };
 
-
-void MakeWeights()
+SpectralUpsampler::SpectralUpsampler(int n, int m, int shift)
+	: n(n), m(m), nh(n/2), cosN(n,n), sinN(n,n), cosM(m,n/2+1), sinM(m,n/2+1),
+	rowRe(n,n), rowIm(n,n), coefRe(n/2+1,n), coefIm(n/2+1,n), tRe(m,n/2+1), tIm(m,n/2+1), row(m)
 {
-	weights[0] = 0.1392518728556320;
-	coords[0] = -0.0697392733197222;
-	weights[1] = 0.1392518728556320;
-	coords[1] = 0.0697392733197222;
-	weights[2] = 0.1365414983460152;
-	coords[2] = -0.2078604266882213;
-	weights[3] = 0.1365414983460152;
-	coords[3] = 0.2078604266882213;
-	weights[4] = 0.1311735047870624;
-	coords[4] = -0.3419358208920842;
-	weights[5] = 0.1311735047870624;
-	coords[5] = 0.3419358208920842;
-	weights[6] = 0.1232523768105124;
-	coords[6] = -0.4693558379867570;
-	weights[7] = 0.1232523768105124;
-	coords[7] = 0.4693558379867570;
-	weights[8] = 0.1129322960805392;
-	coords[8] = -0.5876404035069116;
-	weights[9] = 0.1129322960805392;
-	coords[9] = 0.5876404035069116;
-	weights[10] = 0.1004141444428810;
-	coords[10] = -0.6944872631866827;
-	weights[11] = 0.1004141444428810;
-	coords[11] = 0.6944872631866827;
-	weights[12] = 0.0859416062170677;
-	coords[12] = -0.7878168059792081;
-	weights[13] = 0.0859416062170677;
-	coords[13] = 0.7878168059792081;
-	weights[14] = 0.0697964684245205;
-	coords[14] = -0.8658125777203002;
-	weights[15] = 0.0697964684245205;
-	coords[15] = 0.8658125777203002;
-	weights[16] = 0.0522933351526833;
-	coords[16] = -0.9269567721871740;
-	weights[17] = 0.0522933351526833;
-	coords[17] = 0.9269567721871740;
-	weights[18] = 0.0337749015848142;
-	coords[18] = -0.9700604978354287;
-	weights[19] = 0.0337749015848142;
-	coords[19] = 0.9700604978354287;
-	weights[20] = 0.0146279952982722;
-	coords[20] = -0.9942945854823992;
-	weights[21] = 0.0146279952982722;
-	coords[21] = 0.9942945854823992;
+	for(int j = 0; j < n; j++)
+	{
+		for(int l = 0; l < n; l++)
+		{
+			cosN(j,l) = std::cos(2.0*PI*((j*l)%n)/n);
+			sinN(j,l) = std::sin(2.0*PI*((j*l)%n)/n);
+		}
+	}
+	for(int a = 0; a < m; a++)
+	{
+		int as = ((a-shift)%m+m)%m;
+		for(int k = 0; k < nh+1; k++)
+		{
+			cosM(a,k) = std::cos(2.0*PI*((1L*k*as)%m)/m);
+			sinM(a,k) = std::sin(2.0*PI*((1L*k*as)%m)/m);
+		}
+	}
 }
 
-double LegendreEval(int p, double y)
+// out[a*m+b] = (1/m^2) sum_{|k|,|l| <= n/2} F(k,l) exp(2 pi i (k a' + l b')/m),
+// with a' = a-shift, b' = b-shift and F the DFT of samples (rows <-> k).
+// The output is row-major single precision, ready for the colormap.
+void SpectralUpsampler::Upsample(const Mat& samples, float *out)
 {
-	if(p == 0) return 1.0;
-	if(p == 1) return y;
-	double prev = 1.0;
-	double cur = y;
-	for(int n = 1; n < p; n++)
+	// DFT along rows: rowRe/rowIm(i,l), l = 0..n-1
+	for(int i = 0; i < n; i++)
 	{
-		double next = ((2.0*n+1.0)*y*cur - n*prev)/(n+1.0);
-		prev = cur;
-		cur = next;
+		for(int l = 0; l < n; l++)
+		{
+			double re = 0.0, im = 0.0;
+			for(int j = 0; j < n; j++)
+			{
+				re += samples(i,j) * cosN(j,l);
+				im -= samples(i,j) * sinN(j,l);
+			}
+			rowRe(i,l) = re;
+			rowIm(i,l) = im;
+		}
 	}
-	return cur;
-}
 
-double LegendreDerivEval(int p, double y)
-{
-	double val = 0.0;
-	for(int n = 0; n < p; n++)
+	// DFT along columns, non-negative row frequencies only
+	for(int k = 0; k < nh+1; k++)
 	{
-		val = (n+1.0)*LegendreEval(n,y) + y*val;
+		for(int l = 0; l < n; l++)
+		{
+			double re = 0.0, im = 0.0;
+			for(int i = 0; i < n; i++)
+			{
+				re += rowRe(i,l) * cosN(i,k) + rowIm(i,l) * sinN(i,k);
+				im += rowIm(i,l) * cosN(i,k) - rowRe(i,l) * sinN(i,k);
+			}
+			coefRe(k,l) = re;
+			coefIm(k,l) = im;
+		}
 	}
-	return val;
-}
 
-double LegendreL2Norm(int p)
-{
-	return std::pow(2.0/(2.0*p+1.0),0.5);
-}
+	// inverse along b for each k: t(b,k) = sum_l F(k,l) exp(2 pi i l b'/m)
+	tRe.setZero();
+	tIm.setZero();
+	for(int l = -nh; l <= nh; l++)
+	{
+		int lc = (l+n)%n;
+		int la = l < 0 ? -l : l;
+		double sgn = l < 0 ? -1.0 : 1.0;
+		for(int k = 0; k < nh+1; k++)
+		{
+			double fr = coefRe(k,lc);
+			double fi = coefIm(k,lc);
+			tRe.col(k) += fr*cosM.col(la) - (sgn*fi)*sinM.col(la);
+			tIm.col(k) += fi*cosM.col(la) + (sgn*fr)*sinM.col(la);
+		}
+	}
 
+	// inverse along a, one output row at a time; the -k terms are the
+	// conjugates of the +k terms
+	double scale = 1.0/(1.0*m*m);
+	for(int a = 0; a < m; a++)
+	{
+		row = (scale*cosM(a,0))*tRe.col(0);
+		for(int k = 1; k < nh+1; k++)
+		{
+			row += (2.0*scale*cosM(a,k))*tRe.col(k) - (2.0*scale*sinM(a,k))*tIm.col(k);
+		}
+		Eigen::Map<Eigen::VectorXf>(out+a*m,m) = row.cast<float>();
+	}
+}
 
+// Contour-band colormap of the display: the normalized range [0,1] of a
+// frame is split into LEVELS-1 bands with a line through the middle of
+// each. Packed pixels are tabulated at SIZE points across the range, so
+// coloring a pixel is a multiply-add, a clamp and a table load. Map() runs
+// over a float buffer eight pixels at a time with AVX2 (when the CPU has
+// it) or four at a time with wasm SIMD128 (when built with -msimd128).
+class Colormap
+{
+private:
+	std::vector<uint32_t> table;
+	bool simd;
+#ifdef CONVDIFF_AVX2
+	int MapAVX2(const float *phi, int n, float scale, float offset, uint32_t *out) const;
+#endif
+public:
+	static const int SIZE = 4096;
+	static const int LEVELS = 13;
+	typedef uint32_t (*PackFunc)(uint8_t r, uint8_t g, uint8_t b);
+	Colormap();
+	void Build(double high, PackFunc pack);
+	void SetSIMD(bool on);
+	bool SIMD() const { return simd; }
+	void Map(const float *phi, int n, double minphi, double maxphi, uint32_t *out) const;
+};
 
-double LegendreEvalNorm(int p, double y)
+Colormap::Colormap() : table(SIZE,0), simd(false)
 {
-	return LegendreEval(p,y) / LegendreL2Norm(p);
+	SetSIMD(true);
 }
 
-double LegendreDerivEvalNorm(int p, double y)
+// Enable the vector path if this build and CPU support one.
+void Colormap::SetSIMD(bool on)
 {
-	return LegendreDerivEval(p,y) / LegendreL2Norm(p);
+#if defined(CONVDIFF_AVX2)
+	simd = on && __builtin_cpu_supports("avx2");
+#elif defined(__wasm_simd128__)
+	simd = on;
+#else
+	simd = false;
+	(void)on;
+#endif
 }
 
-void MakeLegendreEndpointVals()
+// Lines are drawn with shade high and the background with shade 1. Channel
+// values are shade*255 wrapped to 8 bits, which is what passing them to the
+// Uint8 parameters of SDL_MapRGBA has always produced.
+void Colormap::Build(double high, PackFunc pack)
 {
-	for(int p = 0; p < POLYMAX+1; p++)
+	for(int i = 0; i < SIZE; i++)
 	{
-		normLegendreLeftVals[p] = LegendreEvalNorm(p,-1.0);
-		normLegendreRightVals[p] = LegendreEvalNorm(p,1.0);
-		normLegendreDerivLeftVals[p] = LegendreDerivEvalNorm(p,-1.0);
-		normLegendreDerivRightVals[p] = LegendreDerivEvalNorm(p,1.0);
+		double val = i/(SIZE-1.0);
+		val = 0.97*(val-0.5)+0.5;
+		int colorIndex = std::floor((LEVELS-1)*((val+0.0001)/1.0002));
+		double lambda = (val-colorIndex/(LEVELS-1.0))*(LEVELS-1.0);
+		double shade = 0.47 < lambda && lambda < 0.53 ? high : 1.0;
+		uint8_t c = (uint8_t)(int)(shade*255.0);
+		table[i] = pack(c,c,c);
 	}
 }
 
-void MakeLegendreDerivProducts()
+#ifdef CONVDIFF_AVX2
+__attribute__((target("avx2")))
+int Colormap::MapAVX2(const float *phi, int n, float scale, float offset, uint32_t *out) const
 {
-	for(int p = 0; p < POLYMAX+1; p++)
+	const __m256 vscale = _mm256_set1_ps(scale);
+	const __m256 voffset = _mm256_set1_ps(offset);
+	const __m256 vzero = _mm256_setzero_ps();
+	const __m256 vlast = _mm256_set1_ps(SIZE-1);
+	int k = 0;
+	for(; k+8 <= n; k += 8)
 	{
-		for(int q = 0; q < POLYMAX+1; q++)
-		{
-			double res = 0.0;
-			for(int k = 0; k < 22; k++)
-			{
-				res += weights[k] * LegendreDerivEvalNorm(p,coords[k]) * LegendreDerivEvalNorm(q,coords[k]);
-			}
-			normLegendreDerivProducts[p][q] = res;
-		}
+		__m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(phi+k),vscale),voffset);
+		x = _mm256_min_ps(_mm256_max_ps(x,vzero),vlast);
+		__m256i i = _mm256_cvttps_epi32(x);
+		_mm256_storeu_si256((__m256i*)(out+k),_mm256_i32gather_epi32((const int*)table.data(),i,4));
 	}
+	return k;
 }
+#endif
 
-void MakeLegendreAltProducts()
+void Colormap::Map(const float *phi, int n, double minphi, double maxphi, uint32_t *out) const
 {
-	for(int p = 0; p < POLYMAX+1; p++)
+	float scale = maxphi > minphi ? (SIZE-1)/(maxphi-minphi) : 0.0f;
+	// +0.5 so that truncation rounds to the nearest table entry
+	float offset = 0.5f-minphi*scale;
+	int k = 0;
+#if defined(CONVDIFF_AVX2)
+	if(simd) k = MapAVX2(phi,n,scale,offset,out);
+#elif defined(__wasm_simd128__)
+	if(simd)
 	{
-		for(int q = 0; q < POLYMAX+1; q++)
+		const v128_t vscale = wasm_f32x4_splat(scale);
+		const v128_t voffset = wasm_f32x4_splat(offset);
+		const v128_t vzero = wasm_f32x4_splat(0.0f);
+		const v128_t vlast = wasm_f32x4_splat(SIZE-1);
+		const uint32_t *t = table.data();
+		for(; k+4 <= n; k += 4)
 		{
-			double res = 0.0;
-			for(int k = 0; k < 22; k++)
-			{
-				res += weights[k] * LegendreEvalNorm(p,coords[k]) * LegendreDerivEvalNorm(q,coords[k]);
-			}
-			normLegendreAltProducts[p][q] = res;
+			v128_t x = wasm_f32x4_add(wasm_f32x4_mul(wasm_v128_load(phi+k),vscale),voffset);
+			x = wasm_f32x4_pmin(wasm_f32x4_pmax(x,vzero),vlast);
+			v128_t i = wasm_i32x4_trunc_sat_f32x4(x);
+			wasm_v128_store(out+k,wasm_u32x4_make(t[wasm_i32x4_extract_lane(i,0)],t[wasm_i32x4_extract_lane(i,1)],
+				t[wasm_i32x4_extract_lane(i,2)],t[wasm_i32x4_extract_lane(i,3)]));
 		}
 	}
+#endif
+	for(; k < n; k++)
+	{
+		float x = phi[k]*scale+offset;
+		x = x > 0.0f ? x : 0.0f;
+		x = x < SIZE-1 ? x : SIZE-1;
+		out[k] = table[(int)x];
+	}
 }
 
-void ConvDiff::BuildMatA()
+#ifdef CONVDIFF_MPI
+// Distributed-memory solve of the same system. The N by N periodic element
+// grid is split into blocks on a 2d process grid; each rank assembles only the
+// rows of R=A+U for the elements it owns and keeps ghost copies of the
+// face-neighbour dofs those rows couple to, refreshed by a halo exchange
+// before every matvec. The Krylov solver is BiCGSTAB with global reductions,
+// preconditioned by non-overlapping additive Schwarz (block Jacobi) where each
+// rank solves with its own diagonal block.
+class DistConvDiff
 {
-	double h = L/N;
-	double hbeta0 = std::pow(h,beta0);
-	std::vector<Trip> elems;
+private:
+	MPI_Comm comm;
+	int rank;
+	int size;
+	int dims[2];
+	int coords[2];
+	int nOwned;
+	int nGhost;
+	bool exactBlocks;
+	ConvDiff conv;
+	SpMat Aloc;
+	SpMat Ablock;
+	Vec bloc;
+	std::vector<int> ownedGlobal;
+	std::vector<int> nbrRanks;
+	std::vector<int> sendOffsets;
+	std::vector<int> sendIdx;
+	std::vector<int> recvOffsets;
+	std::vector<double> sendBuf;
+	std::vector<MPI_Request> requests;
+	Eigen::SparseLU<SpMat> blockLU;
+	Eigen::IncompleteLUT<double> blockILU;
+	Vec xg;
+	static int BlockStart(int p, int P, int N) { return (p*N)/P; }
+	int Owner(int ix, int iy);
+	void HaloExchange(const Vec& x);
+	void MatVec(const Vec& x, Vec& y);
+	void Precond(const Vec& x, Vec& y);
+	double Dot(const Vec& a, const Vec& b);
+public:
+	int iterations = 0;
+	double relResid = 0.0;
+	Vec x;
+	// comm must pass FitsGrid(comm,N)
+	DistConvDiff(MPI_Comm comm, int N, int K, double L, bool exactBlocks, DofOrdering ordering = ORDER_ELEMENT);
+	static bool FitsGrid(MPI_Comm comm, int N);
+	void SetU(double ux, double uy) { conv.SetU(ux,uy); }
+	// reassembles the local rows with the given penalty
+	void SetPenalty(double sigma0, double beta0, double epsilon) { conv.SetPenalty(sigma0,beta0,epsilon); conv.init(); }
+	void Setup();
+	bool Solve(double tol, int maxIter);
+	void Gather(ConvDiff& into);
+};
+
+DistConvDiff::DistConvDiff(MPI_Comm comm, int N, int K, double L, bool exactBlocks, DofOrdering ordering)
+	: comm(comm), nOwned(0), nGhost(0), exactBlocks(exactBlocks), conv(N,K,L)
+{
+	conv.SetOrdering(ordering);
+	MPI_Comm_rank(comm,&rank);
+	MPI_Comm_size(comm,&size);
+	dims[0] = dims[1] = 0;
+	MPI_Dims_create(size,2,dims);
+	coords[0] = rank / dims[1];
+	coords[1] = rank % dims[1];
+	conv.SetElementRange(BlockStart(coords[0],dims[0],N),BlockStart(coords[0]+1,dims[0],N),
+		BlockStart(coords[1],dims[1],N),BlockStart(coords[1]+1,dims[1],N));
+	conv.init();
+}
+
+// Whether the process grid of comm gives every rank at least one element;
+// a rank without any would factor an empty block.
+bool DistConvDiff::FitsGrid(MPI_Comm comm, int N)
+{
+	int size;
+	MPI_Comm_size(comm,&size);
+	int dims[2] = { 0, 0 };
+	MPI_Dims_create(size,2,dims);
+	return dims[0] <= N && dims[1] <= N;
+}
+
+int DistConvDiff::Owner(int ix, int iy)
+{
+	int N = conv.GetN();
+	int pxr = 0;
+	while(BlockStart(pxr+1,dims[0],N) <= ix) pxr++;
+	int pyr = 0;
+	while(BlockStart(pyr+1,dims[1],N) <= iy) pyr++;
+	return pxr*dims[1] + pyr;
+}
 
-	// Diagonal blocks
-	for(int px = 0; px < K+1; px++)
+// Assemble the local rows, number the ghost dofs by owning rank and agree with
+// the other ranks on who sends what during a halo exchange. Everything is in
+// conv's local numbering, so a rank stores only its rows and their halo.
+void DistConvDiff::Setup()
+{
+	int N = conv.GetN();
+	int K = conv.GetK();
+	int ex0 = BlockStart(coords[0],dims[0],N), ex1 = BlockStart(coords[0]+1,dims[0],N);
+	int ey0 = BlockStart(coords[1],dims[1],N), ey1 = BlockStart(coords[1]+1,dims[1],N);
+	nOwned = (ex1-ex0)*(ey1-ey0)*(((K+1)*(K+2))/2);
+
+	SpMat R;
+	conv.AssembleSystem(R);
+	RowSpMat Rrows = R;
+
+	// global numbers of the owned dofs and of those of the face neighbours
+	static const int shift[5][2] = { {0,0}, {-1,0}, {1,0}, {0,-1}, {0,1} };
+	std::vector<int> localGlobal(R.rows(),-1);
+	for(int ix = ex0; ix < ex1; ix++)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		for(int iy = ey0; iy < ey1; iy++)
 		{
-			for(int qx = 0; qx < K+1; qx++)
+			for(int s = 0; s < 5; s++)
 			{
-				for(int qy = 0; qy < K+1-qx; qy++)
+				for(int px = 0; px < K+1; px++)
 				{
-					double val = 0.0;
-					val += diffconst * std::pow(2.0/h,2) * normLegendreDerivProducts[px][qx] * (py == qy ? 1.0 : 0.0);
-					val += diffconst * std::pow(2.0/h,2) * (px == qx ? 1.0 : 0.0) * normLegendreDerivProducts[py][qy];
-					
-					// East
-					val += diffconst * (2.0/h) * (2.0/h) * (-0.5) * (py == qy ? 1.0 : 0.0)
-						* normLegendreRightVals[qx] * normLegendreDerivRightVals[px];
-					val -= (2.0/h) * (2.0/h) *(-1.0)* epsilon * 0.5 * (py == qy ? 1.0 : 0.0)
-						* normLegendreRightVals[px] * normLegendreDerivRightVals[qx];
-					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreRightVals[px]*normLegendreRightVals[qx] )
-						* (py == qy ? 1.0 : 0.0);
-					
-					// West
-					val += diffconst * (2.0/h) *(2.0/h) * (0.5) * (py == qy ? 1.0 : 0.0)
-						* normLegendreLeftVals[qx] * normLegendreDerivLeftVals[px];
-					val -= (2.0/h) *(2.0/h) * epsilon * 0.5 * (py == qy ? 1.0 : 0.0)
-						* normLegendreLeftVals[px] * normLegendreDerivLeftVals[qx];
-					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreLeftVals[qx]*normLegendreLeftVals[px] )
-						* (py == qy ? 1.0 : 0.0);
-					
-
-					// North
-					val += diffconst * (2.0/h) *(2.0/h) * (-0.5) * (px == qx ? 1.0 : 0.0)
-						* normLegendreRightVals[qy] * normLegendreDerivRightVals[py];
-					val -= (2.0/h) * (-1.0)*(2.0/h) * epsilon * 0.5 * (px == qx ? 1.0 : 0.0)
-						* normLegendreRightVals[py] * normLegendreDerivRightVals[qy];
-					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreRightVals[py]*normLegendreRightVals[qy] )
-						* (px == qx ? 1.0 : 0.0);
-					
-					// South
-					val += diffconst * (2.0/h) *(2.0/h) * (0.5) * (px == qx ? 1.0 : 0.0)
-						* normLegendreLeftVals[qy] * normLegendreDerivLeftVals[py];
-					val -= (2.0/h) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
-						* normLegendreLeftVals[py] * normLegendreDerivLeftVals[qy];
-					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreLeftVals[qy]*normLegendreLeftVals[py] )
-						* (px == qx ? 1.0 : 0.0);
-					
-					for(int ix = 0; ix < N; ix++)
+					for(int py = 0; py < K+1-px; py++)
 					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-							if(idxv == 0 && px == 0 && qx == 0)
-							{
-								Trip t1(idxv,idxphi,1.0);
-								elems.push_back(t1);
-							}
-						}
+						int g = conv.idx(ix+shift[s][0],iy+shift[s][1],px,py);
+						localGlobal[conv.LocalIndex(g)] = g;
 					}
 				}
 			}
 		}
 	}
+	ownedGlobal.assign(localGlobal.begin(),localGlobal.begin()+nOwned);
 
-	// East blocks
-	for(int px = 0; px < K+1; px++)
+	// ghosts, ordered by owner so each neighbour's values arrive contiguously
+	std::vector<std::pair<int,int>> ghosts;
+	for(int j = nOwned; j < (int)localGlobal.size(); j++)
 	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val += diffconst * (2.0/h) *(2.0/h) * (-0.5) * (py == qy ? 1.0 : 0.0)
-						* normLegendreRightVals[qx] * normLegendreDerivLeftVals[px];
-					val -= (2.0/h) * epsilon *(2.0/h) * 0.5 * (py == qy ? 1.0 : 0.0)
-						* normLegendreLeftVals[px] * normLegendreDerivRightVals[qx];
-					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[px]*normLegendreRightVals[qx] )
-						* (py == qy ? 1.0 : 0.0);
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix+1,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
-		}
+		if(localGlobal[j] < 0) continue;
+		int ix, iy;
+		conv.dofElement(localGlobal[j],ix,iy);
+		ghosts.push_back(std::make_pair(Owner(ix,iy),j));
 	}
+	std::sort(ghosts.begin(),ghosts.end());
+	nGhost = ghosts.size();
+	std::vector<int> column(R.rows(),-1);
+	for(int i = 0; i < nOwned; i++) column[i] = i;
+	for(int k = 0; k < nGhost; k++) column[ghosts[k].second] = nOwned+k;
 
-	// West blocks
-	for(int px = 0; px < K+1; px++)
+	std::vector<Trip> elems;
+	std::vector<Trip> blockElems;
+	bloc = conv.GetRHS().head(nOwned);
+	for(int i = 0; i < nOwned; i++)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		for(RowSpMat::InnerIterator it(Rrows,i); it; ++it)
 		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val += diffconst * (2.0/h) * (0.5) *(2.0/h) * (py == qy ? 1.0 : 0.0)
-						* normLegendreLeftVals[qx] * normLegendreDerivRightVals[px];
-					val -= (2.0/h) * (-1.0) * epsilon * 0.5 *(2.0/h) * (py == qy ? 1.0 : 0.0)
-						* normLegendreRightVals[px] * normLegendreDerivLeftVals[qx];
-					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[qx]*normLegendreRightVals[px] )
-						* (py == qy ? 1.0 : 0.0);
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix-1,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
+			int j = column[it.col()];
+			elems.push_back(Trip(i,j,it.value()));
+			if(j < nOwned) blockElems.push_back(Trip(i,j,it.value()));
 		}
 	}
-
-	// North blocks
-	for(int px = 0; px < K+1; px++)
+	Aloc.resize(nOwned,nOwned+nGhost);
+	Aloc.setFromTriplets(elems.begin(),elems.end());
+	Aloc.makeCompressed();
+	Ablock.resize(nOwned,nOwned);
+	Ablock.setFromTriplets(blockElems.begin(),blockElems.end());
+	Ablock.makeCompressed();
+	if(exactBlocks) blockLU.compute(Ablock);
+	else blockILU.compute(Ablock);
+
+	// tell every owner which of its dofs we need
+	std::vector<int> recvCounts(size,0);
+	for(int k = 0; k < nGhost; k++) recvCounts[ghosts[k].first]++;
+	std::vector<int> sendCounts(size,0);
+	MPI_Alltoall(recvCounts.data(),1,MPI_INT,sendCounts.data(),1,MPI_INT,comm);
+	std::vector<int> rdispl(size+1,0), sdispl(size+1,0);
+	for(int r = 0; r < size; r++)
 	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val += diffconst * (2.0/h) * (-0.5) *(2.0/h) * (px == qx ? 1.0 : 0.0)
-						* normLegendreRightVals[qy] * normLegendreDerivLeftVals[py];
-					val -= (2.0/h) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
-						* normLegendreLeftVals[py] * normLegendreDerivRightVals[qy];
-					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[py]*normLegendreRightVals[qy] )
-						* (px == qx ? 1.0 : 0.0);
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy+1,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
-		}
+		rdispl[r+1] = rdispl[r] + recvCounts[r];
+		sdispl[r+1] = sdispl[r] + sendCounts[r];
 	}
-
-	// South blocks
-	for(int px = 0; px < K+1; px++)
+	std::vector<int> wanted(nGhost);
+	for(int k = 0; k < nGhost; k++) wanted[k] = localGlobal[ghosts[k].second];
+	std::vector<int> requested(sdispl[size]);
+	MPI_Alltoallv(wanted.data(),recvCounts.data(),rdispl.data(),MPI_INT,
+		requested.data(),sendCounts.data(),sdispl.data(),MPI_INT,comm);
+
+	nbrRanks.clear();
+	sendOffsets.assign(1,0);
+	recvOffsets.assign(1,0);
+	sendIdx.clear();
+	for(int r = 0; r < size; r++)
 	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val += diffconst * (2.0/h) * (0.5) *(2.0/h) * (px == qx ? 1.0 : 0.0)
-						* normLegendreLeftVals[qy] * normLegendreDerivRightVals[py];
-					val -= (2.0/h) * (-1.0) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
-						* normLegendreRightVals[py] * normLegendreDerivLeftVals[qy];
-					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[qy]*normLegendreRightVals[py] )
-						* (px == qx ? 1.0 : 0.0);
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy-1,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
-		}
+		if(sendCounts[r] == 0 && recvCounts[r] == 0) continue;
+		nbrRanks.push_back(r);
+		for(int k = sdispl[r]; k < sdispl[r+1]; k++) sendIdx.push_back(conv.LocalIndex(requested[k]));
+		sendOffsets.push_back(sendIdx.size());
+		recvOffsets.push_back(rdispl[r+1]);
 	}
-
-	A.setFromTriplets(elems.begin(),elems.end());
+	sendBuf.resize(sendIdx.size());
+	requests.resize(2*nbrRanks.size());
+	xg.resize(nOwned+nGhost);
+	x = Vec::Zero(nOwned);
 }
 
-
-
-void ConvDiff::BuildMatUXP()
+void DistConvDiff::HaloExchange(const Vec& v)
 {
-	double h = L/N;
-	std::vector<Trip> elems;
-
-	// Diagonal blocks
-	for(int px = 0; px < K+1; px++)
+	xg.head(nOwned) = v;
+	for(size_t k = 0; k < sendIdx.size(); k++) sendBuf[k] = v(sendIdx[k]);
+	int nreq = 0;
+	for(size_t n = 0; n < nbrRanks.size(); n++)
 	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) *normLegendreAltProducts[px][qx] * (py == qy ? 1.0 : 0.0);
-					
-					val -= (2.0/h) * (-1.0) * normLegendreRightVals[px]*normLegendreRightVals[qx]
-						 * ( py == qy ? 1.0 : 0.0 );
-
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
-		}
+		int count = recvOffsets[n+1]-recvOffsets[n];
+		if(count > 0) MPI_Irecv(xg.data()+nOwned+recvOffsets[n],count,MPI_DOUBLE,nbrRanks[n],0,comm,&requests[nreq++]);
 	}
-
-	// West blocks
-	for(int px = 0; px < K+1; px++)
+	for(size_t n = 0; n < nbrRanks.size(); n++)
 	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) * normLegendreLeftVals[qx]*normLegendreRightVals[px]
-						 * ( py == qy ? 1.0 : 0.0 );
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix-1,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
-		}
+		int count = sendOffsets[n+1]-sendOffsets[n];
+		if(count > 0) MPI_Isend(sendBuf.data()+sendOffsets[n],count,MPI_DOUBLE,nbrRanks[n],0,comm,&requests[nreq++]);
 	}
+	MPI_Waitall(nreq,requests.data(),MPI_STATUSES_IGNORE);
+}
 
-	UXP.setFromTriplets(elems.begin(),elems.end());
+void DistConvDiff::MatVec(const Vec& v, Vec& y)
+{
+	HaloExchange(v);
+	y.noalias() = Aloc*xg;
 }
 
+void DistConvDiff::Precond(const Vec& v, Vec& y)
+{
+	if(exactBlocks) y = blockLU.solve(v);
+	else y = blockILU.solve(v);
+}
 
-void ConvDiff::BuildMatUXM()
+double DistConvDiff::Dot(const Vec& a, const Vec& b)
 {
-	double h = L/N;
-	std::vector<Trip> elems;
+	double local = a.dot(b);
+	double global = 0.0;
+	MPI_Allreduce(&local,&global,1,MPI_DOUBLE,MPI_SUM,comm);
+	return global;
+}
 
-	// Diagonal blocks
-	for(int px = 0; px < K+1; px++)
+// Right-preconditioned BiCGSTAB on the distributed system, starting from x,
+// with the breakdown handling of ConvDiff::BiCGSTAB(). The reductions make
+// every rank take the same branch.
+bool DistConvDiff::Solve(double tol, int maxIter)
+{
+	Vec r(nOwned), r0(nOwned), p(nOwned), v(nOwned), s(nOwned), t(nOwned), y(nOwned), z(nOwned);
+	MatVec(x,r);
+	r = bloc - r;
+	r0 = r;
+	double bnorm = std::sqrt(Dot(bloc,bloc));
+	if(bnorm == 0.0) bnorm = 1.0;
+	double rho = 1.0, alpha = 1.0, w = 1.0;
+	p.setZero();
+	v.setZero();
+	iterations = 0;
+	relResid = std::sqrt(Dot(r,r))/bnorm;
+	bool restart = false;
+	while(relResid > tol && iterations < maxIter)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		double rhoNew = Dot(r0,r);
+		bool fresh = (iterations == 0);
+		if(restart || std::abs(rhoNew) < 1e-30*bnorm*bnorm)
 		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) *normLegendreAltProducts[px][qx] * (py == qy ? 1.0 : 0.0);
-					val -= (2.0/h) * normLegendreLeftVals[qx]*normLegendreLeftVals[px]
-						 * ( py == qy ? 1.0 : 0.0 );
-
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
+			// r0 became orthogonal to r, or the last step broke down:
+			// restart the shadow residual
+			r0 = r;
+			rhoNew = Dot(r0,r);
+			p.setZero();
+			v.setZero();
+			rho = alpha = w = 1.0;
+			fresh = true;
+			restart = false;
 		}
-	}
-
-	// East blocks
-	for(int px = 0; px < K+1; px++)
-	{
-		for(int py = 0; py < K+1-px; py++)
+		double beta = (rhoNew/rho)*(alpha/w);
+		rho = rhoNew;
+		p = r + beta*(p - w*v);
+		Precond(p,y);
+		MatVec(y,v);
+		double r0v = Dot(r0,v);
+		if(r0v == 0.0)
 		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) * (-1.0) * normLegendreLeftVals[px]*normLegendreRightVals[qx]
-						 * ( py == qy ? 1.0 : 0.0 );
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix+1,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
+			if(fresh) break;
+			restart = true;
+			continue;
 		}
+		alpha = rho/r0v;
+		s = r - alpha*v;
+		Precond(s,z);
+		MatVec(z,t);
+		double tt = Dot(t,t);
+		w = tt > 0.0 ? Dot(t,s)/tt : 0.0;
+		x += alpha*y + w*z;
+		r = s - w*t;
+		restart = (w == 0.0);
+		iterations++;
+		relResid = std::sqrt(Dot(r,r))/bnorm;
 	}
-
-	UXM.setFromTriplets(elems.begin(),elems.end());
+	return relResid <= tol;
 }
 
-
-
-void ConvDiff::BuildMatUYP()
+// Collect the distributed solution into a full ConvDiff on rank 0, which
+// takes the distributed numbering; into is not assembled.
+void DistConvDiff::Gather(ConvDiff& into)
 {
-	double h = L/N;
-	std::vector<Trip> elems;
+	std::vector<int> counts(size), displs(size+1,0);
+	MPI_Gather(&nOwned,1,MPI_INT,counts.data(),1,MPI_INT,0,comm);
+	for(int r = 0; r < size; r++) displs[r+1] = displs[r] + counts[r];
+	std::vector<int> allIdx(rank == 0 ? displs[size] : 0);
+	std::vector<double> allVals(rank == 0 ? displs[size] : 0);
+	MPI_Gatherv(ownedGlobal.data(),nOwned,MPI_INT,allIdx.data(),counts.data(),displs.data(),MPI_INT,0,comm);
+	MPI_Gatherv(x.data(),nOwned,MPI_DOUBLE,allVals.data(),counts.data(),displs.data(),MPI_DOUBLE,0,comm);
+	if(rank != 0) return;
+	into.SetOrdering(conv.GetOrdering());
+	into.ApplyOrdering();
+	Vec full(into.GetDof());
+	for(size_t k = 0; k < allIdx.size(); k++) full(allIdx[k]) = allVals[k];
+	into.SetPhi(full);
+}
 
-	// Diagonal blocks
-	for(int px = 0; px < K+1; px++)
+// -check of the MPI build: the gathered distributed solution against a
+// direct solve on rank 0, in every ordering, compared through Eval() on a
+// grid of points so the numbering cannot hide a mismatch. Returns the
+// number of failures on rank 0.
+static int CheckDistributed(MPI_Comm comm)
+{
+	static const struct { int N, K; double ux, uy; } cases[] = { {8,2,5.0,3.0}, {7,3,-4.0,6.0} };
+	int rank, size;
+	MPI_Comm_rank(comm,&rank);
+	MPI_Comm_size(comm,&size);
+	int failures = 0;
+	for(size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); c++)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		if(!DistConvDiff::FitsGrid(comm,cases[c].N))
 		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -=(2.0/h) * (px == qx ? 1.0 : 0.0) * normLegendreAltProducts[py][qy];
-					val -= (2.0/h) * (-1.0) * normLegendreRightVals[py]*normLegendreRightVals[qy]
-						 * ( px == qx ? 1.0 : 0.0 );
-
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
+			if(rank == 0) printf("distributed N=%d on %d ranks: skipped, a rank would have no elements\n",cases[c].N,size);
+			continue;
 		}
-	}
-
-	// South blocks
-	for(int px = 0; px < K+1; px++)
-	{
-		for(int py = 0; py < K+1-px; py++)
+		for(int o = ORDER_ELEMENT; o <= ORDER_HILBERT; o++)
 		{
-			for(int qx = 0; qx < K+1; qx++)
+			ConvDiff got(cases[c].N,cases[c].K,1.0);
+			DistConvDiff dist(comm,cases[c].N,cases[c].K,1.0,true,(DofOrdering)o);
+			dist.SetU(cases[c].ux,cases[c].uy);
+			dist.Setup();
+			bool converged = dist.Solve(1e-10,2000);
+			dist.Gather(got);
+			if(rank != 0) continue;
+			ConvDiff ref(cases[c].N,cases[c].K,1.0);
+			ref.SetOrdering((DofOrdering)o);
+			ref.init();
+			ref.SetU(cases[c].ux,cases[c].uy);
+			ref.SetSolver(SOLVER_DIRECT);
+			ref.Solve();
+			const int pts = 17;
+			double diff = 0.0, mag = 0.0;
+			for(int i = 0; i < pts; i++)
 			{
-				for(int qy = 0; qy < K+1-qx; qy++)
+				for(int j = 0; j < pts; j++)
 				{
-					double val = 0.0;
-					val -= (2.0/h) * normLegendreLeftVals[qy]*normLegendreRightVals[py]
-						 * ( px == qx ? 1.0 : 0.0 );
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy-1,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
+					double x = (i+0.3)/pts, y = (j+0.6)/pts;
+					double val = ref.Eval(x,y);
+					diff = std::max(diff,std::abs(got.Eval(x,y)-val));
+					mag = std::max(mag,std::abs(val));
 				}
 			}
+			bool ok = converged && diff <= 1e-6*mag;
+			printf("distributed N=%d K=%d u=(%g,%g) %s on %d ranks: %d iterations, difference %.1e %s\n",cases[c].N,cases[c].K,
+				cases[c].ux,cases[c].uy,OrderingName((DofOrdering)o),size,dist.iterations,diff/mag,ok ? "ok" : "FAILED");
+			failures += !ok;
 		}
 	}
-
-	UYP.setFromTriplets(elems.begin(),elems.end());
+	return failures;
 }
-
-
-void ConvDiff::BuildMatUYM()
+#endif
+
+// Pending interactive work for the main loop. Rather than a FIFO of every
+// input event, at most one low-res preview (level 0) and one high-res
+// refinement (level 1) are pending. Repeated previews coalesce into one that
+// solves at whatever the velocity is when it runs, previews are handed out
+// before refinements, and a queued refinement is preempted (dropped) once the
+// velocity it was requested for has changed.
+struct SchedulerStats
 {
-	double h = L/N;
-	std::vector<Trip> elems;
+	int submitted;
+	int coalesced;
+	int preempted;
+	int run;
+	int maxDepth;
+};
 
-	// Diagonal blocks
-	for(int px = 0; px < K+1; px++)
+class WorkScheduler
+{
+private:
+	bool pending[2];
+	unsigned long highGen;
+	SchedulerStats stats;
+public:
+	WorkScheduler() : highGen(0)
+	{
+		pending[0] = pending[1] = false;
+		memset(&stats,0,sizeof(stats));
+	}
+	int Depth() { return (pending[0] ? 1 : 0) + (pending[1] ? 1 : 0); }
+	bool Pending(int level) { return pending[level]; }
+	void NotePreempted() { stats.preempted++; }
+	int Dropped() { return stats.coalesced + stats.preempted; }
+	const SchedulerStats& Stats() { return stats; }
+	void Push(int level, unsigned long velocityGen)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		if(level < 0 || level > 1) return;
+		stats.submitted++;
+		if(pending[1] && highGen != velocityGen)
 		{
-			for(int qx = 0; qx < K+1; qx++)
-			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) *(px == qx ? 1.0 : 0.0) * normLegendreAltProducts[py][qy];
-					val -= (2.0/h) * normLegendreLeftVals[qy]*normLegendreLeftVals[py]
-						 * ( px == qx ? 1.0 : 0.0 );
-
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
-			}
+			pending[1] = false;
+			stats.preempted++;
 		}
+		if(pending[level]) stats.coalesced++;
+		pending[level] = true;
+		if(level == 1) highGen = velocityGen;
+		if(Depth() > stats.maxDepth) stats.maxDepth = Depth();
 	}
-
-	// North blocks
-	for(int px = 0; px < K+1; px++)
+	bool Pop(int& level)
 	{
-		for(int py = 0; py < K+1-px; py++)
+		for(level = 0; level < 2; level++)
 		{
-			for(int qx = 0; qx < K+1; qx++)
+			if(pending[level])
 			{
-				for(int qy = 0; qy < K+1-qx; qy++)
-				{
-					double val = 0.0;
-					val -= (2.0/h) * (-1.0) * normLegendreLeftVals[py]*normLegendreRightVals[qy]
-						 * ( px == qx ? 1.0 : 0.0 );
-					for(int ix = 0; ix < N; ix++)
-					{
-						for(int iy = 0; iy < N; iy++)
-						{
-							int idxv = idx(ix,iy,qx,qy);
-							int idxphi = idx(ix,iy+1,px,py);
-							Trip t(idxv,idxphi,val);
-							if(idxv != 0) elems.push_back(t);
-						}
-					}
-				}
+				pending[level] = false;
+				stats.run++;
+				return true;
 			}
 		}
+		return false;
 	}
+};
 
-	UYM.setFromTriplets(elems.begin(),elems.end());
-}
-
-
-
+#ifdef CONVDIFF_THREADS
+// A request for a SolveWorker: solve at velocity (ux,uy) and render a frame.
+// velocityGen is the value of the shared velocity generation counter when the
+// request was made; once the counter moves on, the request is stale.
+struct SolveRequest
+{
+	double ux;
+	double uy;
+	unsigned long velocityGen;
+	int rebuildN;
+	int rebuildK;
+};
 
-double PeriodicGaussian(double x, double y, double r)
+// Rasterizes cd into pixels; returns false if it gave up part way because
+// velocityGen moved past requestGen.
+typedef bool (*RenderFunc)(ConvDiff& cd, uint32_t *pixels, const std::atomic<unsigned long> *velocityGen, unsigned long requestGen);
+
+// Solves and renders one ConvDiff off the main thread. At most one request
+// is pending; a newer submission replaces it, and requests that go stale
+// before the solve, after it, or during rendering are dropped. Finished frames
+// are double-buffered: the worker renders into its back buffer and swaps it
+// into the ready slot under the lock, so the main thread only ever sees
+// complete frames.
+class SolveWorker
 {
-	double val = 0.0;
-	for(int i = -2; i <= 2; i++)
+private:
+	ConvDiff& cd;
+	RenderFunc render;
+	const std::atomic<unsigned long>& velocityGen;
+	bool verbose;
+	bool inited;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool hasPending;
+	bool stopping;
+	bool frameReady;
+	SolveRequest pending;
+	std::vector<uint32_t> backPixels;
+	std::vector<uint32_t> readyPixels;
+	unsigned long readyGen;
+	std::thread thread;
+	void Run();
+public:
+	std::atomic<int> dropped;
+	SolveWorker(ConvDiff& cd, RenderFunc render, const std::atomic<unsigned long>& velocityGen, int numPixels, bool verbose)
+		: cd(cd), render(render), velocityGen(velocityGen), verbose(verbose), inited(false),
+		hasPending(false), stopping(false), frameReady(false),
+		backPixels(numPixels), readyPixels(numPixels), readyGen(0), dropped(0)
+	{
+		thread = std::thread(&SolveWorker::Run,this);
+	}
+	~SolveWorker()
 	{
-		for(int j = -2; j <= 2; j++)
 		{
-			val += std::exp(-0.5*std::pow((x-1.0*i)/r,2)-0.5*std::pow((y-1.0*j)/r,2));
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
 		}
+		wake.notify_one();
+		thread.join();
 	}
-	return val;
-}
-
-double EvalRHS(double x, double y)
-{ 
-	return PeriodicGaussian(x-0.2,y-0.8,0.15) - PeriodicGaussian(x-0.8,y-0.2,0.15);
-}
+	void Submit(const SolveRequest& req);
+	bool TakeFrame(std::vector<uint32_t>& pixels, unsigned long& gen);
+};
 
-void ConvDiff::BuildRHS()
+void SolveWorker::Submit(const SolveRequest& req)
 {
-	double h = L/N;
-	for(int ix = 0; ix < N; ix++)
 	{
-		for(int iy = 0; iy < N; iy++)
+		std::lock_guard<std::mutex> guard(lock);
+		if(hasPending)
 		{
-			double xc = (ix+0.5)*h;
-			double yc = (iy+0.5)*h;
-			for(int px = 0; px < K+1; px++)
+			dropped++;
+			// a pending rebuild must survive being superseded
+			if(pending.rebuildN > 0 && req.rebuildN <= 0)
 			{
-				for(int py = 0; py < K+1-px; py++)
-				{
-					double val = 0.0;
-					for(int j = 0; j < 22; j++)
-					{
-						for(int k = 0; k < 22; k++)
-						{
-							val += weights[j]*weights[k]
-								* LegendreEvalNorm(px,coords[j])
-								* LegendreEvalNorm(py,coords[k])
-								* EvalRHS((xc+coords[j]*(h/2.0))/L, (yc+coords[k]*(h/2.0))/L);
-						}
-					}
-					rhs(idx(ix,iy,px,py)) = val;
-				}
+				int rebuildN = pending.rebuildN;
+				int rebuildK = pending.rebuildK;
+				pending = req;
+				pending.rebuildN = rebuildN;
+				pending.rebuildK = rebuildK;
 			}
+			else pending = req;
 		}
+		else pending = req;
+		hasPending = true;
 	}
-	rhs(0) = 0.0;
+	wake.notify_one();
 }
 
-double ConvDiff::Eval(double x, double y)
+// Swap the most recent finished frame into pixels. Returns false if no frame
+// has finished since the last call.
+bool SolveWorker::TakeFrame(std::vector<uint32_t>& pixels, unsigned long& gen)
 {
-	if(x < 0.0) return Eval(x+L,y);
-	if(x>L) return Eval(x-L,y);
-	if(y<0.0) return Eval(x,y+L);
-	if(y > L) return Eval(x,y-L);
-	double h = L/N;
-	int ix = x/h;
-	int iy = y/h;
-	double val = 0.0;
-	double xc = (ix+0.5)*h;
-	double yc = (iy+0.5)*h;
-	for(int px = 0; px < K+1; px++)
-	{
-		for(int py = 0; py < K+1-px; py++)
-		{
-			val += phi(idx(ix,iy,px,py)) * LegendreEvalNorm(px,(x-xc)*(2.0/h)) * LegendreEvalNorm(py,(y-yc)*(2.0/h));
-		}
-	}
-	return val;
+	std::lock_guard<std::mutex> guard(lock);
+	if(!frameReady) return false;
+	std::swap(pixels,readyPixels);
+	gen = readyGen;
+	frameReady = false;
+	return true;
 }
 
-double ConvDiff::SolResid()
+void SolveWorker::Run()
 {
-	int sp = 21;
-	int numpts = sp*sp;
-	double resid = 0.0;
-	double sizeRHS = 0.0;
-	double h = L/sp;
-	for(int i = 0; i < sp; i++)
+	for(;;)
 	{
-		for(int j = 0; j < sp; j++)
+		SolveRequest req;
 		{
-			double xx = (0.5+i)*h;
-			double yy = (0.5+j)*h;
-			double val = 0.0;
-			val -= diffconst*( -Eval(xx+4.0*h,yy)/560.0 + Eval(xx+3.0*h,yy)*8.0/315.0  -Eval(xx+2.0*h,yy)/5.0+Eval(xx+h,yy)*8.0/5.0+Eval(xx-h,yy)*8.0/5.0-Eval(xx-2.0*h,yy)/5.0 + Eval(xx-3.0*h,yy)*8.0/315.0 - Eval(xx-4.0*h,yy)/560.0 - Eval(xx,yy+4.0*h)/560.0+Eval(xx,yy+3.0*h)*8.0/315.0 -Eval(xx,yy+2.0*h)/5.0+Eval(xx,yy+h)*8.0/5.0+Eval(xx,yy-h)*8.0/5.0-Eval(xx,yy-2.0*h)/5.0 + Eval(xx,yy-3.0*h)*8.0/315.0 - Eval(xx,yy-4.0*h)/560.0 - Eval(xx,yy)*2.0*205.0/72.0 )/(h*h);
-			val += ux * (-Eval(xx+4.0*h,yy)/280.0+Eval(xx+3.0*h,yy)*4.0/105.0-Eval(xx+2.0*h,yy)/5.0+Eval(xx+h,yy)*4.0/5.0-Eval(xx-h,yy)*4.0/5.0+Eval(xx-2.0*h,yy)/5.0-Eval(xx-3.0*h,yy)*4.0/105.0+Eval(xx-4.0*h,yy)/280.0)/(h);
-			val += uy * (-Eval(xx,yy+4.0*h)/280.0+Eval(xx,yy+3.0*h)*4.0/105.0-Eval(xx,yy+2.0*h)/5.0+Eval(xx,yy+h)*4.0/5.0-Eval(xx,yy-h)*4.0/5.0+Eval(xx,yy-2.0*h)/5.0-Eval(xx,yy-3.0*h)*4.0/105.0+Eval(xx,yy-4.0*h)/280.0)/(h);
-			val -= EvalRHS(xx/L,yy/L);
-			resid += std::pow(val,2);
-			sizeRHS += std::pow(EvalRHS(xx/L,yy/L),2);
+			std::unique_lock<std::mutex> guard(lock);
+			while(!hasPending && !stopping) wake.wait(guard);
+			if(stopping) return;
+			req = pending;
+			hasPending = false;
 		}
-	}
-	resid = std::pow(resid/numpts,0.5);
-	sizeRHS = std::pow(sizeRHS/numpts,0.5);
-	return resid/sizeRHS;
-}
-
-void FFT2D(Mat& input,Mat& outputRe,Mat& outputIm)
-{
-	Eigen::FFT<double> fft;
-	int rows = input.rows();
-	int cols = input.cols();
-	for(int i = 0; i < rows; i++)
-	{
-		std::vector<double> row;
-		for(int j = 0; j < cols; j++) row.push_back(input(i,j));
-		std::vector<std::complex<double>> freqs;
-		fft.fwd(freqs,row);
-		for(int j = 0; j < cols; j++)
+		if(req.rebuildN > 0)
 		{
-			outputRe(i,j) = freqs[j].real();
-			outputIm(i,j) = freqs[j].imag();
+			cd.reinit(req.rebuildN,req.rebuildK,cd.GetL());
+			inited = true;
 		}
-	}
-	for(int j = 0; j < cols; j++)
-	{
-		std::vector<double> colRe;
-		std::vector<double> colIm;
-		for(int i = 0; i < rows; i++)
+		if(req.velocityGen != velocityGen)
 		{
-			colRe.push_back(outputRe(i,j));
-			colIm.push_back(outputIm(i,j));
+			dropped++;
+			continue;
 		}
-		std::vector<std::complex<double>> freqsRe;
-		std::vector<std::complex<double>> freqsIm;
-		fft.fwd(freqsRe,colRe);
-		fft.fwd(freqsIm,colIm);
-		for(int i = 0; i < rows; i++)
+		if(!inited)
 		{
-			outputRe(i,j) = freqsRe[i].real() - freqsIm[i].imag();
-			outputIm(i,j) = freqsRe[i].imag() + freqsIm[i].real();
+			cd.init();
+			inited = true;
 		}
-	}
-}
-
-void IFFT2D(Mat& inputRe, Mat& inputIm,Mat& outputRe,Mat& outputIm)
-{
-	Eigen::FFT<double> fft;
-	int rows = inputRe.rows();
-	int cols = inputRe.cols();
-	for(int i = 0; i < rows; i++)
-	{
-		std::vector<std::complex<double>> row;
-		for(int j = 0; j < cols; j++)
+		cd.SetU(req.ux,req.uy);
+		ContinuationStats cont;
+		double matResid = cd.SolveContinuation(&cont);
+		if(req.velocityGen != velocityGen)
 		{
-			std::complex<double> elem(inputRe(i,j),inputIm(i,j));
-			row.push_back(elem);
+			dropped++;
+			continue;
 		}
-		std::vector<std::complex<double>> res;
-		fft.inv(res,row);
-		for(int j = 0; j < cols; j++)
+		if(verbose)
 		{
-			outputRe(i,j) = res[j].real();
-			outputIm(i,j) = res[j].imag();
+			double solResid = cd.SolResid();
+			if(cont.reuses > 0 || cont.steps > 1 || cont.fallback)
+			{
+				printf("continuation: %d steps, preconditioner reused %d times%s\n",
+					cont.steps,cont.reuses,cont.fallback ? ", finished by the direct solver" : "");
+			}
+			printf("matrix residual %3.2e, spatial residual %3.2e\n", matResid, solResid);
 		}
-	}
-	for(int j = 0; j < cols; j++)
-	{
-		std::vector<std::complex<double>> col;
-		for(int i = 0; i < rows; i++)
+		if(!render(cd,backPixels.data(),&velocityGen,req.velocityGen))
 		{
-			std::complex<double> elem(outputRe(i,j),outputIm(i,j));
-			col.push_back(elem);
+			dropped++;
+			continue;
 		}
-		std::vector<std::complex<double>> res;
-		fft.inv(res,col);
-		for(int i = 0; i < rows; i++)
 		{
-			outputRe(i,j) = res[i].real();
-			outputIm(i,j) = res[i].imag();
+			std::lock_guard<std::mutex> guard(lock);
+			std::swap(backPixels,readyPixels);
+			readyGen = req.velocityGen;
+			frameReady = true;
 		}
 	}
 }
+#endif
 
+#ifdef __EMSCRIPTEN__
 extern "C" {
 
 const int NUMPIXELS = 693;
 
-Mat dispRe(NUMPIXELS,NUMPIXELS);
-Mat dispIm(NUMPIXELS,NUMPIXELS);
+std::vector<float> lowField(NUMPIXELS*NUMPIXELS);
 Mat dispTemp(11,11);
-Mat dispTempFFTRe(11,11);
-Mat dispTempFFTIm(11,11);
-Mat dispFFTRe(NUMPIXELS,NUMPIXELS);
-Mat dispFFTIm(NUMPIXELS,NUMPIXELS);
+SpectralUpsampler upsampler(11,NUMPIXELS,32);
 
 double len = 1.0;
 SDL_Surface *screen;
 ConvDiff convDiff(11,1,len);
 ConvDiff convDiffHigh(3,10,len);
-std::queue<int> workQueue;
+WorkScheduler workQueue;
 bool convDiffInited(false);
 bool convDiffHighInited(false);
 bool mouseIsDown(false);
 bool touchIsStarted(false);
+double velX = 0.0;
+double velY = 0.0;
+std::atomic<unsigned long> velocityGen(0);
+#ifdef CONVDIFF_THREADS
+SolveWorker *lowWorker;
+SolveWorker *highWorker;
+std::vector<uint32_t> framePixels(NUMPIXELS*NUMPIXELS);
+unsigned long shownGen = 0;
+int shownLevel = -1;
+#else
+// lower-degree solvers on the high-res grid for the first passes of a
+// progressive refinement
+ConvDiff convDiffCoarse(3,2,len);
+ConvDiff convDiffMid(3,6,len);
+bool convDiffCoarseInited(false);
+bool convDiffMidInited(false);
+double highResid = 0.0;
+#endif
+// a grid change for convDiffHigh, applied before its next solve
+int rebuildN = 0;
+int rebuildK = 0;
 
 double getVelocityX(long targetX)
 {
@@ -908,12 +909,24 @@ double getVelocityY(long targetY)
 	return (targetY-350.0)/2;
 }
 
+// Record a new velocity. Any solve requested at an older velocity becomes
+// stale once velocityGen moves on.
+void setVelocity(double ux, double uy)
+{
+	if(ux != velX || uy != velY) velocityGen++;
+	velX = ux;
+	velY = uy;
+#ifndef CONVDIFF_THREADS
+	convDiff.SetU(ux,uy);
+	convDiffHigh.SetU(ux,uy);
+#endif
+}
+
 void mouse_update(const EmscriptenMouseEvent *e)
 {
 	double ux = getVelocityX(e->targetX);
 	double uy = getVelocityY(e->targetY);
-	convDiff.SetU(ux,uy);
-	convDiffHigh.SetU(ux,uy);
+	setVelocity(ux,uy);
 }
 
 void touch_update(const EmscriptenTouchEvent *e)
@@ -931,149 +944,257 @@ void touch_update(const EmscriptenTouchEvent *e)
 		targetY /= e->numTouches;
 		double ux = getVelocityX(targetX);
 		double uy = getVelocityY(targetY);
-		convDiff.SetU(ux,uy);
-		convDiffHigh.SetU(ux,uy);
+		setVelocity(ux,uy);
 	}
 }
 
-const int NUMLEVELS = 13;
-
-int getColorIndex(double val)
-{
-	return std::floor( (NUMLEVELS-1) * ((val+0.0001)/1.0002) );
-}
-
-double getLambda(double val, int colorIndex)
-{
-	return (val-colorIndex/(1.0*NUMLEVELS-1.0))*(1.0*NUMLEVELS-1.0);
-}
+Colormap highColors;
+Colormap lowColors;
 
-double red(double lambda, int colorIndex, double low = 1.0, double high = 254.0)
+uint32_t packPixel(uint8_t r, uint8_t g, uint8_t b)
 {
-	return 0.47<lambda && lambda<0.53 ? high : low;
+	return SDL_MapRGBA(screen->format, r, g, b, 255);
 }
 
-double green(double lambda, int colorIndex, double low = 1.0, double high = 254.0)
+// True if the render for requestGen has been overtaken by a newer velocity.
+// Rendering on the main thread passes no counter and is never cancelled.
+bool renderStale(const std::atomic<unsigned long> *velocityGen, unsigned long requestGen)
 {
-	return 0.47<lambda && lambda<0.53 ? high : low;
+	return velocityGen && *velocityGen != requestGen;
 }
 
-double blue(double lambda, int colorIndex, double low = 1.0, double high = 254.0)
+// Points of a sampling grid, row-major, and the values there; filled on
+// first use and evaluated in one batch per frame.
+struct SampleGrid
 {
-	return 0.47<lambda && lambda<0.53 ? high : low;
+	std::vector<double> x, y, vals;
+	void Build(int n, double offset)
+	{
+		for(int i = 0; i < n; i++)
+		{
+			for(int j = 0; j < n; j++)
+			{
+				x.push_back(len*(j+offset)/n);
+				y.push_back(len*(i+offset)/n);
+			}
+		}
+		vals.resize(n*n);
+	}
+	void Eval(ConvDiff& cd) { cd.EvalPoints((int)vals.size(),x.data(),y.data(),vals.data()); }
+};
+
+SampleGrid rangeGrid, lowGrid;
+
+// Range of the high-res solution used to normalize the colormap, sampled
+// on a 100 by 100 grid.
+void highRange(ConvDiff& cd, double& minphi, double& maxphi)
+{
+	TRACE_SCOPE(TRACE_EVAL);
+	if(rangeGrid.vals.empty()) rangeGrid.Build(100,0.0);
+	rangeGrid.Eval(cd);
+	Eigen::Map<const Vec> vals(rangeGrid.vals.data(),rangeGrid.vals.size());
+	minphi = vals.minCoeff();
+	maxphi = vals.maxCoeff();
+}
+
+const int STRIPROWS = 32;
+std::vector<float> highStrip(STRIPROWS*NUMPIXELS);
+
+bool renderHigh(ConvDiff& cd, uint32_t *pixels, const std::atomic<unsigned long> *velocityGen, unsigned long requestGen)
+{
+	double minphi, maxphi;
+	highRange(cd,minphi,maxphi);
+
+	float *strip = highStrip.data();
+	for (int i0 = 0; i0 < NUMPIXELS; i0 += STRIPROWS) {
+		if(renderStale(velocityGen,requestGen)) return false;
+		int rows = std::min(STRIPROWS,NUMPIXELS-i0);
+		cd.EvalStrip(NUMPIXELS,i0,rows,strip);
+		TRACE_SCOPE(TRACE_RASTER);
+		highColors.Map(strip,rows*NUMPIXELS,minphi,maxphi,pixels+i0*NUMPIXELS);
+	}
+	return true;
 }
 
-void repaintHigh()
+
+bool renderLow(ConvDiff& cd, uint32_t *pixels, const std::atomic<unsigned long> *velocityGen, unsigned long requestGen)
 {
-	double maxphi = convDiffHigh.Eval(0.0, 0.0);
-	double minphi = convDiffHigh.Eval(0.0,0.0);
-	for(int i = 0; i < 100; i++)
 	{
-		for(int j = 0; j < 100; j++)
+		TRACE_SCOPE(TRACE_EVAL);
+		if(lowGrid.vals.empty()) lowGrid.Build(11,0.5);
+		lowGrid.Eval(cd);
+		for(int i = 0; i < 11; i++)
 		{
-			double val = convDiffHigh.Eval(len*(1.0*j)/100,len*(1.0*i)/100);
-			if(val > maxphi) maxphi = val;
-			if(val < minphi) minphi = val;
+			for(int j = 0; j < 11; j++) dispTemp(i,j) = lowGrid.vals[i*11+j];
 		}
+
+		upsampler.Upsample(dispTemp,lowField.data());
 	}
 
+	if(renderStale(velocityGen,requestGen)) return false;
+
+	TRACE_SCOPE(TRACE_RASTER);
+	Eigen::Map<const Eigen::VectorXf> field(lowField.data(),lowField.size());
+	lowColors.Map(lowField.data(),NUMPIXELS*NUMPIXELS,field.minCoeff(),field.maxCoeff(),pixels);
+	return true;
+}
+
+void present(const uint32_t *pixels)
+{
 	if (SDL_MUSTLOCK(screen)) SDL_LockSurface(screen);
-	for (int i = 0; i < NUMPIXELS; i++) {
-		for (int j = 0; j < NUMPIXELS; j++) {
-			double val = (convDiffHigh.Eval(len*(1.0*j)/NUMPIXELS,len*(1.0*i)/NUMPIXELS)-minphi)/(maxphi-minphi);
-			val = 0.97*(val-0.5)+0.5;
-			int colorIndex = getColorIndex(val);
-			double lambda = getLambda(val,colorIndex);
-			double valr = red(lambda,colorIndex)*255.0;
-			double valg = green(lambda,colorIndex)*255.0;
-			double valb = blue(lambda,colorIndex)*255.0;
-			*((Uint32*)screen->pixels + i * NUMPIXELS + j) = SDL_MapRGBA(screen->format, (int)valr, (int)valg, (int)valb, 255);
-		}
-	}
+	memcpy(screen->pixels,pixels,sizeof(uint32_t)*NUMPIXELS*NUMPIXELS);
 	if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
 	SDL_Flip(screen); 
 }
 
-
-void repaintLow()
+#ifndef CONVDIFF_THREADS
+// Progressive refinement of the high-res frame on the main thread, by
+// degree and by rows. The high-res grid is first solved at degree 2 and
+// about half the full degree, each drawn with every PROGRESSIVESTEP-th row
+// stretched to cover the rows below it; then at the full degree, drawn the
+// same way and then with the rows in between. A frame does at most one
+// solve or assembly and draws strips until FRAMEBUDGETMS is spent, so a
+// large K or N costs more frames, not longer ones; only the full-degree
+// solve itself cannot be split, and the threaded build moves it off the
+// main thread instead.
+const int PROGRESSIVESTEP = 4;
+const double FRAMEBUDGETMS = 10.0;
+const int MAXRUNGS = 3;
+
+struct ProgressiveRender
 {
+	bool active;
+	int numRungs;
+	int rung;
+	bool solved;
+	int pass;
+	int nextRow;
+	double minphi;
+	double maxphi;
+	int N;
+	ConvDiff *cd[MAXRUNGS];
+	bool *inited[MAXRUNGS];
+	int K[MAXRUNGS];
+	std::vector<float> rows;
+};
+
+ProgressiveRender progressive = { false, 0, 0, false, 0, 0, 0.0, 0.0, 0, {}, {}, {}, std::vector<float>(PROGRESSIVESTEP*NUMPIXELS) };
 
-	for(int i = 0; i < 11; i++)
+void startProgressive()
+{
+	progressive.N = rebuildN > 0 ? rebuildN : convDiffHigh.GetN();
+	int K = rebuildN > 0 ? rebuildK : convDiffHigh.GetK();
+	int n = 0;
+#ifndef CONVDIFF_THREADS
+	ConvDiff *lower[2] = { &convDiffCoarse, &convDiffMid };
+	bool *lowerInited[2] = { &convDiffCoarseInited, &convDiffMidInited };
+	int lowerK[2] = { 2, (K+2)/2 };
+	for(int r = 0; r < 2; r++)
 	{
-		for(int j = 0; j < 11; j++)
-		{
-			dispTemp(i,j) = (convDiff.Eval(len*(1.0*(j+0.5))/11,len*(1.0*(i+0.5))/11));
-		}
+		if(lowerK[r] >= K || (n > 0 && lowerK[r] <= progressive.K[n-1])) continue;
+		progressive.cd[n] = lower[r];
+		progressive.inited[n] = lowerInited[r];
+		progressive.K[n++] = lowerK[r];
 	}
+#endif
+	progressive.cd[n] = &convDiffHigh;
+	progressive.inited[n] = &convDiffHighInited;
+	progressive.K[n++] = K;
+	progressive.numRungs = n;
+	progressive.rung = 0;
+	progressive.solved = false;
+	progressive.active = true;
+}
 
-	FFT2D(dispTemp,dispTempFFTRe,dispTempFFTIm);
-
-	for(int i = 0; i < 6; i++)
+// Bring the current rung's solver to the grid and velocity and solve.
+// Returns false if it only (re)assembled, which takes the frame.
+bool solveRung()
+{
+	ConvDiff& cd = *progressive.cd[progressive.rung];
+	bool& inited = *progressive.inited[progressive.rung];
+	int N = progressive.N, K = progressive.K[progressive.rung];
+	// a pending grid change is taken up by the full-degree rung
+	if(&cd == &convDiffHigh) rebuildN = 0;
+	if(!inited || cd.GetN() != N || cd.GetK() != K)
 	{
-		for(int j = 0; j < 6; j++)
-		{
-			dispFFTRe(i,j) = dispTempFFTRe(i,j);
-			dispFFTIm(i,j) = dispTempFFTIm(i,j);
-		}
+		cd.reinit(N,K,len);
+		inited = true;
+		return false;
 	}
+	cd.SetU(velX,velY);
+	double resid = cd.Solve();
+	if(&cd == &convDiffHigh) highResid = resid;
+	highRange(cd,progressive.minphi,progressive.maxphi);
+	progressive.solved = true;
+	progressive.pass = 0;
+	progressive.nextRow = 0;
+	return true;
+}
 
-	for(int i = 1; i < 6; i++)
+// Advance the refinement until the budget measured from frameStart runs
+// out; at least one solve, assembly or strip is done per call.
+void stepProgressive(double frameStart)
+{
+	if(!progressive.solved && !solveRung()) return;
+	if (SDL_MUSTLOCK(screen)) SDL_LockSurface(screen);
+	uint32_t *pixels = (uint32_t*)screen->pixels;
+	float *rows = progressive.rows.data();
+	bool first = true;
+	while(progressive.solved && (first || emscripten_get_now()-frameStart < FRAMEBUDGETMS))
 	{
-		for(int j = 0; j < 6; j++)
+		first = false;
+		ConvDiff& cd = *progressive.cd[progressive.rung];
+		int i = progressive.nextRow;
+		if(progressive.pass == 0)
 		{
-			dispFFTRe(NUMPIXELS-i,j) = dispTempFFTRe(11-i,j);
-			dispFFTIm(NUMPIXELS-i,j) = dispTempFFTIm(11-i,j);
+			cd.EvalStrip(NUMPIXELS,i,1,rows);
+			TRACE_SCOPE(TRACE_RASTER);
+			int last = std::min(i+PROGRESSIVESTEP,NUMPIXELS);
+			highColors.Map(rows,NUMPIXELS,progressive.minphi,progressive.maxphi,pixels+i*NUMPIXELS);
+			for(int k = i+1; k < last; k++) memcpy(pixels+k*NUMPIXELS,pixels+i*NUMPIXELS,sizeof(uint32_t)*NUMPIXELS);
 		}
-	}
-
-	for(int i = 0; i < 6; i++)
-	{
-		for(int j = 1; j < 6; j++)
+		else
 		{
-			dispFFTRe(i,NUMPIXELS-j) = dispTempFFTRe(i,11-j);
-			dispFFTIm(i,NUMPIXELS-j) = dispTempFFTIm(i,11-j);
+			int count = std::min(PROGRESSIVESTEP-1,NUMPIXELS-(i+1));
+			if(count > 0) cd.EvalStrip(NUMPIXELS,i+1,count,rows);
+			TRACE_SCOPE(TRACE_RASTER);
+			if(count > 0) highColors.Map(rows,count*NUMPIXELS,progressive.minphi,progressive.maxphi,pixels+(i+1)*NUMPIXELS);
 		}
-	}
-
-	for(int i = 1; i < 6; i++)
-	{
-		for(int j = 1; j < 6; j++)
+		progressive.nextRow += PROGRESSIVESTEP;
+		if(progressive.nextRow < NUMPIXELS) continue;
+		progressive.nextRow = 0;
+		progressive.pass++;
+		// the lower degrees only get the coarse pass
+		if(progressive.rung+1 < progressive.numRungs)
 		{
-			dispFFTRe(NUMPIXELS-i,NUMPIXELS-j) = dispTempFFTRe(11-i,11-j);
-			dispFFTIm(NUMPIXELS-i,NUMPIXELS-j) = dispTempFFTIm(11-i,11-j);
+			progressive.rung++;
+			progressive.solved = false;
+		}
+		else if(progressive.pass > 1)
+		{
+			progressive.solved = false;
+			progressive.active = false;
 		}
 	}
+	if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
+	SDL_Flip(screen); 
+}
 
-	IFFT2D(dispFFTRe,dispFFTIm,dispRe,dispIm);
-
-	double maxphi = dispRe.maxCoeff();
-	double minphi = dispRe.minCoeff();
-
-	
-
+void repaintLow()
+{
 	if (SDL_MUSTLOCK(screen)) SDL_LockSurface(screen);
-	for (int i = 0; i < NUMPIXELS; i++) {
-		for (int j = 0; j < NUMPIXELS; j++) {
-			double val = (dispRe((i+NUMPIXELS-32)%NUMPIXELS,(j+NUMPIXELS-32)%NUMPIXELS)-minphi)/(maxphi-minphi);
-			val = 0.97*(val-0.5)+0.5;
-			int colorIndex = getColorIndex(val);
-			double lambda = getLambda(val,colorIndex);
-			double valr = red(lambda,colorIndex,1.0,175.0)*255.0;
-			double valg = green(lambda,colorIndex,1.0,175.0)*255.0;
-			double valb = blue(lambda,colorIndex,1.0,175.0)*255.0;
-			*((Uint32*)screen->pixels + i * NUMPIXELS + j) = SDL_MapRGBA(screen->format, (int)valr, (int)valg, (int)valb, 255);
-		}
-	}
+	renderLow(convDiff,(uint32_t*)screen->pixels,0,0);
 	if (SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
 	SDL_Flip(screen); 
 }
+#endif
 
 
 EM_BOOL mouseclick_callback(int eventType, const EmscriptenMouseEvent *e, void *userData)
 {
 	mouse_update(e);
-	workQueue.push(0);
-	workQueue.push(1);
+	workQueue.Push(0,velocityGen);
+	workQueue.Push(1,velocityGen);
 	mouseIsDown = false;
 	return 1;
 }
@@ -1094,7 +1215,7 @@ EM_BOOL mousedown_callback(int eventType, const EmscriptenMouseEvent *e, void *u
 {
 	mouseIsDown = true;
 	mouse_update(e);
-	workQueue.push(0);
+	workQueue.Push(0,velocityGen);
 	return 1;
 }
 
@@ -1103,7 +1224,7 @@ EM_BOOL mousemove_callback(int eventType, const EmscriptenMouseEvent *e, void *u
 	if(mouseIsDown)
 	{
 		mouse_update(e);
-		workQueue.push(0);
+		workQueue.Push(0,velocityGen);
 	}
 	return 1;
 }
@@ -1113,7 +1234,7 @@ EM_BOOL touchmove_callback(int eventType, const EmscriptenTouchEvent *e, void *u
 	if(touchIsStarted)
 	{
 		touch_update(e);
-		workQueue.push(0);
+		workQueue.Push(0,velocityGen);
 	}
 	return 1;
 }
@@ -1122,7 +1243,7 @@ EM_BOOL touchstart_callback(int eventType, const EmscriptenTouchEvent *e, void *
 {
 	touchIsStarted = true;
 	touch_update(e);
-	workQueue.push(0);
+	workQueue.Push(0,velocityGen);
 	return 1;
 }
 
@@ -1130,8 +1251,8 @@ EM_BOOL touchend_callback(int eventType, const EmscriptenTouchEvent *e, void *us
 {
 	touchIsStarted = false;
 	touch_update(e);
-	workQueue.push(0);
-	workQueue.push(1);
+	workQueue.Push(0,velocityGen);
+	workQueue.Push(1,velocityGen);
 	return 1;
 }
 
@@ -1143,24 +1264,116 @@ EM_BOOL touchcancel_callback(int eventType, const EmscriptenTouchEvent *e, void
 
 void EMSCRIPTEN_KEEPALIVE rebuild(int N, int K)
 {
-	convDiffHigh.reinit(N,K > POLYMAX ? POLYMAX : K,len);
-	workQueue.push(1);
+#ifdef CONVDIFF_THREADS
+	// the high-res worker owns convDiffHigh; reinit there
+	rebuildN = N;
+	rebuildK = K > POLYMAX ? POLYMAX : K;
+#else
+	// applied by the next refinement, a frame at a time
+	rebuildN = N;
+	rebuildK = K > POLYMAX ? POLYMAX : K;
+#endif
+	workQueue.Push(1,velocityGen);
+}
+
+int EMSCRIPTEN_KEEPALIVE getQueueDepth()
+{
+	return workQueue.Depth();
+}
+
+// Jobs that never ran: coalesced or preempted in the scheduler, plus those
+// superseded or cancelled inside the workers.
+int EMSCRIPTEN_KEEPALIVE getDroppedJobs()
+{
+	int dropped = workQueue.Dropped();
+#ifdef CONVDIFF_THREADS
+	dropped += lowWorker->dropped + highWorker->dropped;
+#endif
+	return dropped;
+}
+
+#ifndef CONVDIFF_THREADS
+// Residuals of the last full-degree high-res solve, on request: the spatial
+// one samples the solution at 10^4 points, too slow for every solve. (The
+// threaded build's worker prints them itself.)
+void EMSCRIPTEN_KEEPALIVE reportHighResidual()
+{
+	printf("matrix residual %3.2e, spatial residual %3.2e\n",highResid,convDiffHigh.SolResid());
+}
+#endif
+
+void EMSCRIPTEN_KEEPALIVE reportScheduler()
+{
+	const SchedulerStats& stats = workQueue.Stats();
+	printf("queue depth %d (max %d), submitted %d, run %d, coalesced %d, preempted %d, dropped total %d\n",
+		workQueue.Depth(), stats.maxDepth, stats.submitted, stats.run, stats.coalesced, stats.preempted, getDroppedJobs());
+}
+
+#ifdef CONVDIFF_THREADS
+// Hand queued work to the workers and show whichever finished frame is the
+// newest. The main loop never solves, so input stays responsive at any K.
+void dispatch()
+{
+	int workItem;
+	while(workQueue.Pop(workItem))
+	{
+
+		SolveRequest req = { velX, velY, velocityGen, 0, 0 };
+		if(workItem == 0) lowWorker->Submit(req);
+		else
+		{
+			req.rebuildN = rebuildN;
+			req.rebuildK = rebuildK;
+			rebuildN = 0;
+			highWorker->Submit(req);
+		}
+	}
+
+	// a frame is shown unless a newer velocity, or the high-res frame for
+	// the same velocity, is already on screen
+	unsigned long gen;
+	if(lowWorker->TakeFrame(framePixels,gen) && (gen > shownGen || (gen == shownGen && shownLevel < 1)))
+	{
+		present(framePixels.data());
+		shownGen = gen;
+		shownLevel = 0;
+	}
+	if(highWorker->TakeFrame(framePixels,gen) && gen >= shownGen)
+	{
+		present(framePixels.data());
+		shownGen = gen;
+		shownLevel = 1;
+	}
 }
+#endif
 
 int n = 0;
-void init()
+long frameAllocs = 0;
+void frame()
 {
 	if(n < 5)
 	{
 		n++;
 		return;
 	}
-	if(workQueue.empty()) return;
-
-	int workItem = workQueue.front();
-	workQueue.pop();
+#ifdef CONVDIFF_THREADS
+	dispatch();
+#else
+	double frameStart = emscripten_get_now();
+	if(progressive.active)
+	{
+		// a new preview preempts the refinement in progress
+		if(!workQueue.Pending(0))
+		{
+			stepProgressive(frameStart);
+			return;
+		}
+		progressive.active = false;
+		workQueue.NotePreempted();
+	}
 
-	if(workItem < 0) return;
+	int workItem;
+	if(!workQueue.Pop(workItem)) return;
 
 	if(workItem == 0)
 	{
@@ -1169,37 +1382,77 @@ void init()
 			convDiff.init();
 			convDiffInited = true;
 		}
-		convDiff.Solve();
+		convDiff.SolveContinuation();
 		repaintLow();
 	}
 	else
 	{
-		if(!convDiffHighInited)
-		{
-			convDiffHigh.init();
-			convDiffHighInited = true;
-		}
-		
-		double matResid = convDiffHigh.Solve();
-		double solResid = convDiffHigh.SolResid();
-		printf("matrix residual %3.2e, spatial residual %3.2e\n", matResid, solResid);
-		repaintHigh();
+		startProgressive();
+		stepProgressive(frameStart);
 	}
+#endif
 }
 
 
-int main(int argc, char ** argv)
+// Heap allocations made during the last main-loop frame, or -1 if the build
+// does not count them (CONVDIFF_COUNT_ALLOCS).
+long EMSCRIPTEN_KEEPALIVE getFrameAllocations()
 {
-	MakeWeights();
-	MakeLegendreDerivProducts();
-	MakeLegendreAltProducts();
-	MakeLegendreEndpointVals();
+	return frameAllocs;
+}
 
-	workQueue.push(0);
-	workQueue.push(1);
+// Tracing controls for the page, e.g.
+//   Module.ccall('setTracing','null',['number'],[1]);
+//   JSON.parse(Module.ccall('getStats','string',[],[]));
+void EMSCRIPTEN_KEEPALIVE setTracing(int on)
+{
+	Tracer::Get().SetEnabled(on != 0);
+}
+
+void EMSCRIPTEN_KEEPALIVE resetStats()
+{
+	Tracer::Get().Reset();
+}
+
+const char * EMSCRIPTEN_KEEPALIVE getStats()
+{
+	return Tracer::Get().StatsJSON();
+}
+
+void init()
+{
+	long before = AllocationCount();
+	TRACE_SCOPE(TRACE_FRAME);
+	TRACE_COUNT(COUNT_FRAMES,1);
+	frame();
+	frameAllocs = before < 0 ? -1 : AllocationCount()-before;
+}
+
+
+int main(int argc, char ** argv)
+{
+	// at the high-res default of K=10 the direct solver is about twice as
+	// fast as BiCGSTAB and its time hardly depends on the velocity, and the
+	// HDG trace system is about fifteen times smaller still
+	convDiffHigh.SetSolver(SOLVER_DIRECT);
+	convDiffHigh.SetDiscretization(DISCRETIZATION_HDG);
+#ifndef CONVDIFF_THREADS
+	convDiffCoarse.SetSolver(SOLVER_DIRECT);
+	convDiffCoarse.SetDiscretization(DISCRETIZATION_HDG);
+	convDiffMid.SetSolver(SOLVER_DIRECT);
+	convDiffMid.SetDiscretization(DISCRETIZATION_HDG);
+#endif
+	workQueue.Push(0,velocityGen);
+	workQueue.Push(1,velocityGen);
 	
 	SDL_Init(SDL_INIT_VIDEO);
 	screen = SDL_SetVideoMode(NUMPIXELS, NUMPIXELS, 32, SDL_SWSURFACE);
+	highColors.Build(254.0,packPixel);
+	lowColors.Build(175.0,packPixel);
+#ifdef CONVDIFF_THREADS
+	lowWorker = new SolveWorker(convDiff,renderLow,velocityGen,NUMPIXELS*NUMPIXELS,false);
+	highWorker = new SolveWorker(convDiffHigh,renderHigh,velocityGen,NUMPIXELS*NUMPIXELS,true);
+#endif
 
 	emscripten_set_click_callback("canvas", 0, 1, mouseclick_callback);
 	emscripten_set_mousedown_callback("canvas", 0, 1, mousedown_callback);
@@ -1215,4 +1468,1245 @@ int main(int argc, char ** argv)
 	emscripten_set_main_loop(init,0,0);
 }
 
-}
\ No newline at end of file
+}
+#else
+
+// Compare the solvers on a few grids over a sweep of velocities like those
+// produced by dragging in the UI. The sweep runs twice: the first pass, with
+// assembly, is reported as warm-up and includes the one-off costs (symbolic
+// analysis, auto's tuning for each Peclet range); the second gives the
+// steady-state times, which include the preconditioner setup or numeric
+// refactorization for each new velocity.
+static void Benchmark()
+{
+	static const int grids[][2] = { {11,1}, {20,2}, {8,4}, {3,10}, {6,8}, {16,3} };
+	static const SolverMethod methods[] = { SOLVER_BICGSTAB, SOLVER_GMRES, SOLVER_IDRS, SOLVER_DIRECT, SOLVER_AUTO };
+	const int numVel = 8;
+	printf("%4s %3s %6s %-9s %10s %9s %9s %7s\n","N","K","dof","solver","warmup ms","mean ms","max ms","iters");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		for(size_t m = 0; m < sizeof(methods)/sizeof(methods[0]); m++)
+		{
+			ConvDiff cd(grids[g][0],grids[g][1],1.0);
+			cd.SetSolver(methods[m]);
+			double warmup = Tracer::Now();
+			cd.init();
+			double total = 0.0, worst = 0.0;
+			long iters = 0;
+			for(int pass = 0; pass < 2; pass++)
+			{
+				if(pass == 1) warmup = Tracer::Now()-warmup;
+				for(int v = 0; v < numVel; v++)
+				{
+					double mag = 175.0*(v+1)/numVel;
+					cd.SetU(mag*std::cos(2.4*v),mag*std::sin(2.4*v));
+					double start = Tracer::Now();
+					cd.Solve();
+					double ms = Tracer::Now()-start;
+					if(pass == 0) continue;
+					total += ms;
+					if(ms > worst) worst = ms;
+					iters += cd.iterations;
+				}
+			}
+			printf("%4d %3d %6d %-9s %10.2f %9.2f %9.2f %7.1f\n",grids[g][0],grids[g][1],cd.GetDof(),
+				SolverName(methods[m]),warmup,total/numVel,worst,(double)iters/numVel);
+			fflush(stdout);
+		}
+	}
+}
+
+// Matrix bandwidth, matrix-vector product time and BiCGSTAB/ILU(0) solve
+// cost of each unknown ordering at one high-Peclet velocity; the mode-major
+// row's solve is direct, which RunSolver() substitutes for ILU(0) there.
+static void BenchmarkOrdering()
+{
+	static const int grids[][2] = { {32,1}, {20,2}, {16,3}, {8,6} };
+	printf("\n%4s %3s %6s %-8s %10s %10s %9s %9s %7s\n","N","K","dof","ordering","bandwidth","distance","matvec us","solve ms","iters");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		for(int o = ORDER_ELEMENT; o <= ORDER_HILBERT; o++)
+		{
+			ConvDiff cd(grids[g][0],grids[g][1],1.0);
+			cd.SetOrdering((DofOrdering)o);
+			cd.init();
+			cd.SetU(120.0,-70.0);
+			SpMat R;
+			cd.AssembleSystem(R);
+			RowSpMat rows = R;
+			// bandwidth, and the mean distance of an entry from the diagonal
+			long bandwidth = 0;
+			double distance = 0.0;
+			for(int i = 0; i < rows.rows(); i++)
+			{
+				for(RowSpMat::InnerIterator it(rows,i); it; ++it)
+				{
+					long d = std::abs(i-(int)it.col());
+					bandwidth = std::max(bandwidth,d);
+					distance += d;
+				}
+			}
+			Vec x = Vec::Ones(rows.rows()), y(rows.rows());
+			const int reps = 200;
+			double start = Tracer::Now();
+			for(int r = 0; r < reps; r++)
+			{
+				y.noalias() = rows*x;
+				x(r%x.size()) += 1e-3*y(0);
+			}
+			double matvec = 1000.0*(Tracer::Now()-start)/reps;
+			cd.Solve();
+			start = Tracer::Now();
+			cd.Solve();
+			double ms = Tracer::Now()-start;
+			printf("%4d %3d %6d %-8s %10ld %10.1f %9.1f %9.2f %7d\n",grids[g][0],grids[g][1],cd.GetDof(),
+				OrderingName((DofOrdering)o),bandwidth,distance/rows.nonZeros(),matvec,ms,cd.iterations);
+			fflush(stdout);
+		}
+	}
+}
+
+// Solve time of the IP-DG system with sparse LU against the HDG trace
+// system, over the same velocity sweep as Benchmark().
+static void BenchmarkHDG()
+{
+	static const int grids[][2] = { {16,2}, {16,3}, {8,6}, {6,8}, {3,10}, {4,14}, {2,20} };
+	const int numVel = 8;
+	printf("\n%4s %3s %-6s %8s %9s %9s %9s\n","N","K","system","unknowns","nonzeros","mean ms","worst ms");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		for(int d = DISCRETIZATION_IPDG; d <= DISCRETIZATION_HDG; d++)
+		{
+			ConvDiff cd(grids[g][0],grids[g][1],1.0);
+			cd.SetSolver(SOLVER_DIRECT);
+			cd.SetDiscretization((Discretization)d);
+			cd.init();
+			cd.Solve();
+			double total = 0.0, worst = 0.0;
+			for(int v = 0; v < numVel; v++)
+			{
+				double mag = 175.0*(v+1)/numVel;
+				cd.SetU(mag*std::cos(2.4*v),mag*std::sin(2.4*v));
+				double start = Tracer::Now();
+				cd.Solve();
+				double ms = Tracer::Now()-start;
+				total += ms;
+				if(ms > worst) worst = ms;
+			}
+			int N = grids[g][0], K = grids[g][1];
+			long unknowns = d == DISCRETIZATION_HDG ? 2L*N*N*(K+1) : cd.GetDof();
+			// each element block couples to itself and four neighbours; each face to seven
+			long nonzeros = d == DISCRETIZATION_HDG ? unknowns*7*(K+1) : (long)cd.GetDof()*5*((K+1)*(K+2)/2);
+			printf("%4d %3d %-6s %8ld %9ld %9.2f %9.2f\n",N,K,d == DISCRETIZATION_HDG ? "hdg" : "ip-dg",unknowns,nonzeros,total/numVel,worst);
+			fflush(stdout);
+		}
+	}
+}
+
+// Drag the velocity along a spiral out to |u| = 175, with one jump across
+// the range halfway, solving at each point from scratch and by continuation.
+static void BenchmarkContinuation()
+{
+	static const int grids[][2] = { {11,1}, {20,2}, {3,10} };
+	const int numVel = 60;
+	printf("\n%4s %3s %-12s %9s %9s %9s %7s %7s\n","N","K","mode","mean ms","worst ms","iters","reuses","direct");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		for(int mode = 0; mode < 2; mode++)
+		{
+			ConvDiff cd(grids[g][0],grids[g][1],1.0);
+			cd.init();
+			double total = 0.0, worst = 0.0;
+			long iters = 0;
+			int reuses = 0, fallbacks = 0;
+			for(int v = 0; v < numVel; v++)
+			{
+				double t = v/(numVel-1.0);
+				if(v == numVel/2) cd.SetU(-175.0,175.0);
+				else cd.SetU(175.0*t*std::cos(3.0*t),175.0*t*std::sin(3.0*t));
+				ContinuationStats stats;
+				double start = Tracer::Now();
+				if(mode == 0) cd.Solve();
+				else cd.SolveContinuation(&stats);
+				double ms = Tracer::Now()-start;
+				total += ms;
+				if(ms > worst) worst = ms;
+				iters += cd.iterations;
+				reuses += stats.reuses;
+				fallbacks += stats.fallback;
+			}
+			printf("%4d %3d %-12s %9.2f %9.2f %9.1f %7d %7d\n",grids[g][0],grids[g][1],mode == 0 ? "solve" : "continuation",
+				total/numVel,worst,(double)iters/numVel,reuses,fallbacks);
+			fflush(stdout);
+		}
+	}
+}
+
+// Solve along a drag path with cfg, whose GCRO-DR recycles its subspace from
+// one velocity to the next, and with GMRES of the same restart length from
+// scratch. Adds the matrix products and milliseconds of each to its totals.
+static void DragSolves(ConvDiff& rec, ConvDiff& ref, const std::vector<std::pair<double,double> >& path,
+	long iters[2], double ms[2], FILE *steps)
+{
+	for(size_t v = 0; v < path.size(); v++)
+	{
+		int it[2];
+		double t[2];
+		for(int k = 0; k < 2; k++)
+		{
+			ConvDiff& cd = (k == 0 ? rec : ref);
+			cd.SetU(path[v].first,path[v].second);
+			double start = Tracer::Now();
+			cd.Solve();
+			t[k] = Tracer::Now()-start;
+			it[k] = cd.iterations;
+			iters[k] += it[k];
+			ms[k] += t[k];
+		}
+		if(steps) fprintf(steps,"%5d %9.3f %9.3f %7d %7d %9.2f %9.2f\n",(int)v,path[v].first,path[v].second,it[0],it[1],t[0],t[1]);
+	}
+}
+
+// Replay a recorded drag, one "ux uy" pair per line, with the configured
+// solver against GMRES(m) from scratch, and report the iterations saved.
+static bool ReplayDrag(int N, int K, DofOrdering ordering, const SolverConfig& solver, const char *fname)
+{
+	FILE *f = fopen(fname,"r");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s\n",fname);
+		return false;
+	}
+	std::vector<std::pair<double,double> > path;
+	char line[256];
+	while(fgets(line,sizeof(line),f))
+	{
+		double ux, uy;
+		if(sscanf(line,"%lf %lf",&ux,&uy) == 2 && std::isfinite(ux) && std::isfinite(uy)) path.push_back(std::make_pair(ux,uy));
+	}
+	fclose(f);
+	if(path.empty())
+	{
+		fprintf(stderr,"no velocities in %s\n",fname);
+		return false;
+	}
+	ConvDiff rec(N,K,1.0), ref(N,K,1.0);
+	SolverConfig gmres = solver;
+	gmres.method = SOLVER_GMRES;
+	rec.SetOrdering(ordering);
+	ref.SetOrdering(ordering);
+	rec.SetSolverConfig(solver);
+	ref.SetSolverConfig(gmres);
+	rec.init();
+	ref.init();
+	long iters[2] = { 0, 0 };
+	double ms[2] = { 0.0, 0.0 };
+	printf("%5s %9s %9s %7s %7s %9s %9s\n","step","ux","uy",SolverName(solver.method),"gmres","ms","gmres ms");
+	DragSolves(rec,ref,path,iters,ms,stdout);
+	printf("%d solves: %ld against %ld iterations (%.1f%% saved), %.2f against %.2f ms\n",(int)path.size(),
+		iters[0],iters[1],100.0*(iters[1]-iters[0])/std::max(iters[1],1L),ms[0],ms[1]);
+	return true;
+}
+
+// GCRO-DR(m,k) against GMRES(m), both with ILU(0) to a relative residual of
+// 1e-10, along a smooth drag out to |u| = 175.
+static void BenchmarkRecycling()
+{
+	static const int grids[][2] = { {11,1}, {20,2}, {3,10} };
+	const int numVel = 60;
+	std::vector<std::pair<double,double> > path;
+	for(int v = 0; v < numVel; v++)
+	{
+		double t = v/(numVel-1.0);
+		path.push_back(std::make_pair(175.0*t*std::cos(3.0*t),175.0*t*std::sin(3.0*t)));
+	}
+	printf("\n%4s %3s %9s %9s %9s %9s %7s\n","N","K","gmres it","gcrodr it","gmres ms","gcrodr ms","saved");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		ConvDiff rec(grids[g][0],grids[g][1],1.0), ref(grids[g][0],grids[g][1],1.0);
+		SolverConfig cfg;
+		cfg.tol = 1e-10;
+		cfg.method = SOLVER_GCRODR;
+		rec.SetSolverConfig(cfg);
+		cfg.method = SOLVER_GMRES;
+		ref.SetSolverConfig(cfg);
+		rec.init();
+		ref.init();
+		long iters[2] = { 0, 0 };
+		double ms[2] = { 0.0, 0.0 };
+		DragSolves(rec,ref,path,iters,ms,NULL);
+		printf("%4d %3d %9.1f %9.1f %9.2f %9.2f %6.1f%%\n",grids[g][0],grids[g][1],(double)iters[1]/numVel,(double)iters[0]/numVel,
+			ms[1]/numVel,ms[0]/numVel,100.0*(iters[1]-iters[0])/std::max(iters[1],1L));
+		fflush(stdout);
+	}
+}
+
+// Time n point queries one Eval() at a time and batched, with and without
+// gradients, against the full raster they replace.
+static void BenchmarkProbes(int res)
+{
+	static const int grids[][2] = { {11,1}, {3,10} };
+	const int n = 5000;
+	std::mt19937 rng(1);
+	std::vector<double> x(n), y(n), val(n), dx(n), dy(n);
+	for(int k = 0; k < n; k++)
+	{
+		x[k] = rng()/4294967296.0;
+		y[k] = rng()/4294967296.0;
+	}
+	std::vector<float> raster(res*res);
+	printf("\n%4s %3s %10s %10s %10s %10s\n","N","K","eval ms","batch ms","grad ms","raster ms");
+	for(size_t g = 0; g < sizeof(grids)/sizeof(grids[0]); g++)
+	{
+		ConvDiff cd(grids[g][0],grids[g][1],1.0);
+		cd.init();
+		cd.SetU(60.0,-40.0);
+		cd.Solve();
+		cd.EvalPoints(n,x.data(),y.data(),val.data());
+		double start = Tracer::Now();
+		for(int k = 0; k < n; k++) val[k] = cd.Eval(x[k],y[k]);
+		double eval = Tracer::Now()-start;
+		start = Tracer::Now();
+		cd.EvalPoints(n,x.data(),y.data(),val.data());
+		double batch = Tracer::Now()-start;
+		start = Tracer::Now();
+		cd.EvalPoints(n,x.data(),y.data(),val.data(),dx.data(),dy.data());
+		double grad = Tracer::Now()-start;
+		start = Tracer::Now();
+		cd.EvalStrip(res,0,res,raster.data());
+		double full = Tracer::Now()-start;
+		printf("%4d %3d %10.3f %10.3f %10.3f %10.3f\n",grids[g][0],grids[g][1],eval,batch,grad,full);
+		fflush(stdout);
+	}
+}
+
+static uint32_t PackRGBA(uint8_t r, uint8_t g, uint8_t b)
+{
+	return r | (g << 8) | (b << 16) | 0xff000000u;
+}
+
+// Time the colormap stage on a frame-sized buffer, vector and scalar.
+static void BenchmarkColormap(int res)
+{
+	Colormap colors;
+	colors.Build(254.0,PackRGBA);
+	std::vector<float> field(res*res);
+	std::vector<uint32_t> pixels(res*res);
+	for(int k = 0; k < res*res; k++) field[k] = std::sin(0.001f*k);
+	const int reps = 50;
+	for(int pass = 0; pass < 2; pass++)
+	{
+		colors.SetSIMD(pass == 0);
+		if(pass == 0 && !colors.SIMD()) continue;
+		double start = Tracer::Now();
+		for(int r = 0; r < reps; r++) colors.Map(field.data(),res*res,-1.0,1.0,pixels.data());
+		double ms = (Tracer::Now()-start)/reps;
+		printf("colormap %s: %.3f ms per %dx%d frame\n",pass == 0 ? "simd" : "scalar",ms,res,res);
+	}
+}
+
+// Read points, an x y pair per line, from fname and print each with the
+// solution and its gradient there.
+static bool WriteProbes(ConvDiff& cd, const char *fname)
+{
+	FILE *f = fopen(fname,"r");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s\n",fname);
+		return false;
+	}
+	std::vector<double> x, y;
+	double px, py;
+	bool ok = true;
+	while(fscanf(f,"%lf %lf",&px,&py) == 2)
+	{
+		ok = ok && std::isfinite(px) && std::isfinite(py);
+		x.push_back(px);
+		y.push_back(py);
+	}
+	ok = ok && feof(f);
+	fclose(f);
+	if(!ok)
+	{
+		fprintf(stderr,"%s: expected finite x y pairs\n",fname);
+		return false;
+	}
+	int n = (int)x.size();
+	std::vector<double> val(n), dx(n), dy(n);
+	cd.EvalPoints(n,x.data(),y.data(),val.data(),dx.data(),dy.data());
+	printf("# x y phi dphi/dx dphi/dy\n");
+	for(int k = 0; k < n; k++) printf("%.17g %.17g %.17g %.17g %.17g\n",x[k],y[k],val[k],dx[k],dy[k]);
+	return true;
+}
+
+// Write the contour plot the high-res view shows as a binary PPM image.
+static bool WriteContourImage(ConvDiff& cd, const char *fname, int res)
+{
+	std::vector<float> field(res*res);
+	std::vector<uint32_t> pixels(res*res);
+	cd.EvalStrip(res,0,res,field.data());
+	Eigen::Map<const Eigen::VectorXf> values(field.data(),field.size());
+	Colormap colors;
+	colors.Build(254.0,PackRGBA);
+	colors.Map(field.data(),res*res,values.minCoeff(),values.maxCoeff(),pixels.data());
+	FILE *f = fopen(fname,"wb");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s for writing\n",fname);
+		return false;
+	}
+	fprintf(f,"P6\n%d %d\n255\n",res,res);
+	std::vector<uint8_t> rgb(3*res);
+	for(int i = 0; i < res; i++)
+	{
+		for(int j = 0; j < res; j++)
+		{
+			uint32_t p = pixels[i*res+j];
+			rgb[3*j] = p & 0xff;
+			rgb[3*j+1] = (p >> 8) & 0xff;
+			rgb[3*j+2] = (p >> 16) & 0xff;
+		}
+		fwrite(rgb.data(),1,rgb.size(),f);
+	}
+	bool ok = (fclose(f) == 0);
+	if(!ok) fprintf(stderr,"error writing %s\n",fname);
+	return ok;
+}
+
+#ifndef CONVDIFF_MPI
+// J = 1/2 of the integral of phi^2 over the domain; the basis is orthonormal
+// on the reference element, so this is a scaled sum of squared coefficients.
+static double Energy(ConvDiff& cd, Vec *dJdphi)
+{
+	double h = cd.GetL()/cd.GetN();
+	double scale = h*h/4.0;
+	const Vec& phi = cd.GetPhi();
+	if(dJdphi) *dJdphi = scale*phi;
+	return 0.5*scale*phi.squaredNorm();
+}
+
+// Compare the adjoint gradient of Energy() with finite differences in the
+// velocity and in each source parameter. At a parameter of exactly zero the
+// differences are one-sided, matching the derivative Gradient() returns.
+static void CheckGradient(ConvDiff& cd)
+{
+	static const char *names[] = { "ux", "uy", "x0", "y0", "x1", "y1", "width" };
+	Vec dJdphi;
+	cd.Solve();
+	Energy(cd,&dJdphi);
+	double grad[2+SOURCE_NUMPARAMS];
+	double start = Tracer::Now();
+	double resid;
+	if(!cd.Gradient(dJdphi,grad[0],grad[1],grad+2,&resid))
+	{
+		printf("adjoint: not available for HDG\n");
+		return;
+	}
+	printf("adjoint: %d iterations, residual %3.2e, %.2f ms\n",cd.adjointIterations,resid,Tracer::Now()-start);
+	double ux = cd.GetUx(), uy = cd.GetUy();
+	SourceParams source = cd.GetSource();
+	double *params[2+SOURCE_NUMPARAMS] = { &ux, &uy, &source.x0, &source.y0, &source.x1, &source.y1, &source.width };
+	printf("%-6s %14s %14s %10s\n","param","adjoint","difference","rel.err");
+	for(int k = 0; k < 2+SOURCE_NUMPARAMS; k++)
+	{
+		double base = *params[k];
+		double step = (k < 2 ? 1e-4*std::max(1.0,std::abs(base)) : 1e-5);
+		double lo = (base == 0.0 ? base : base-step);
+		double J[2];
+		for(int side = 0; side < 2; side++)
+		{
+			*params[k] = (side == 0 ? lo : base+step);
+			cd.SetU(ux,uy);
+			cd.SetSource(source);
+			cd.Solve();
+			J[side] = Energy(cd,NULL);
+		}
+		*params[k] = base;
+		double fd = (J[1]-J[0])/(base+step-lo);
+		printf("%-6s %14.6e %14.6e %10.2e\n",names[k],grad[k],fd,std::abs(grad[k]-fd)/std::max(std::abs(fd),1e-300));
+	}
+	cd.SetU(ux,uy);
+	cd.SetSource(source);
+	cd.Solve();
+}
+#endif
+
+// Manufactured periodic solution for -check, on the unit square, and the
+// source that produces it: -laplacian(phi) + u . grad(phi).
+static double ExactPhi(double x, double y)
+{
+	const double a = 2.0*PI;
+	return std::sin(a*x)*std::sin(a*y) + std::cos(a*(x-2.0*y));
+}
+
+static double ExactSource(double x, double y, double ux, double uy)
+{
+	const double a = 2.0*PI;
+	double t = std::sin(a*(x-2.0*y));
+	double dx = a*std::cos(a*x)*std::sin(a*y) - a*t;
+	double dy = a*std::sin(a*x)*std::cos(a*y) + 2.0*a*t;
+	return a*a*(2.0*std::sin(a*x)*std::sin(a*y) + 5.0*std::cos(a*(x-2.0*y))) + ux*dx + uy*dy;
+}
+
+// Give cd (with L = 1) the source of ExactPhi at its velocity, by the
+// quadrature BuildRHS uses.
+static void SetExactSource(ConvDiff& cd)
+{
+	int N = cd.GetN(), K = cd.GetK();
+	double h = cd.GetL()/N;
+	const std::vector<double>& w = LegendreTables::Get().weights[K];
+	const std::vector<double>& q = LegendreTables::Get().coords[K];
+	int n = (int)q.size();
+	std::vector<double> f(n*n);
+	Vec load(cd.GetDof());
+	for(int ix = 0; ix < N; ix++)
+	{
+		for(int iy = 0; iy < N; iy++)
+		{
+			for(int j = 0; j < n; j++)
+			{
+				for(int k = 0; k < n; k++) f[j*n+k] = w[j]*w[k]*ExactSource((ix+0.5+q[j]/2.0)*h,(iy+0.5+q[k]/2.0)*h,cd.GetUx(),cd.GetUy());
+			}
+			for(int px = 0; px < K+1; px++)
+			{
+				for(int py = 0; py < K+1-px; py++)
+				{
+					double val = 0.0;
+					for(int j = 0; j < n; j++)
+					{
+						for(int k = 0; k < n; k++) val += f[j*n+k]*LegendreEvalNorm(px,q[j])*LegendreEvalNorm(py,q[k]);
+					}
+					load(cd.idx(ix,iy,px,py)) = val;
+				}
+			}
+		}
+	}
+	cd.SetRHS(load);
+}
+
+// L2 error of cd's solution against ExactPhi, up to the constant the
+// pinning row leaves free.
+static double ExactError(ConvDiff& cd)
+{
+	int N = cd.GetN();
+	double h = cd.GetL()/N;
+	const std::vector<double>& w = LegendreTables::Get().weights[cd.GetK()];
+	const std::vector<double>& q = LegendreTables::Get().coords[cd.GetK()];
+	int n = (int)q.size();
+	std::vector<double> diff(N*N*n*n);
+	double mean = 0.0;
+	for(int e = 0; e < N*N; e++)
+	{
+		for(int j = 0; j < n; j++)
+		{
+			for(int k = 0; k < n; k++)
+			{
+				double x = (e/N+0.5+q[j]/2.0)*h, y = (e%N+0.5+q[k]/2.0)*h;
+				double d = cd.Eval(x,y)-ExactPhi(x,y);
+				diff[(e*n+j)*n+k] = d;
+				mean += w[j]*w[k]*d*h*h/4.0;
+			}
+		}
+	}
+	double err = 0.0;
+	for(int e = 0; e < N*N; e++)
+	{
+		for(int j = 0; j < n; j++)
+		{
+			for(int k = 0; k < n; k++) err += w[j]*w[k]*std::pow(diff[(e*n+j)*n+k]-mean,2)*h*h/4.0;
+		}
+	}
+	return std::sqrt(err);
+}
+
+// Observed h- and p-convergence against ExactPhi. Under h-refinement the
+// L2 error must fall like h^(K+1), the optimal rate for IP-DG and for
+// IP-H; the velocities exercise A alone and each of the four upwind
+// convection operators. Under p-refinement on a fixed grid it must fall
+// geometrically, by at least ten for every two degrees. Returns the number
+// of failures.
+static int CheckConvergence()
+{
+	static const double vel[][2] = { {0.0,0.0}, {3.0,-2.0}, {-3.0,2.0} };
+	const int numVel = sizeof(vel)/sizeof(vel[0]);
+	static const char *names[] = { "ip-dg", "hdg" };
+	int failures = 0;
+	for(int K = 1; K <= 3; K++)
+	{
+		// the penalty keeps K=1 pre-asymptotic on coarser grids
+		int N0 = (K == 1 ? 12 : 4);
+		double err[2][numVel][3];
+		for(int r = 0; r < 3; r++)
+		{
+			ConvDiff cd(N0 << r,K,1.0);
+			cd.SetSolver(SOLVER_DIRECT);
+			cd.init();
+			for(int d = DISCRETIZATION_IPDG; d <= DISCRETIZATION_HDG; d++)
+			{
+				cd.SetDiscretization((Discretization)d);
+				for(int v = 0; v < numVel; v++)
+				{
+					cd.SetU(vel[v][0],vel[v][1]);
+					SetExactSource(cd);
+					cd.Solve();
+					err[d][v][r] = ExactError(cd);
+				}
+			}
+		}
+		for(int d = DISCRETIZATION_IPDG; d <= DISCRETIZATION_HDG; d++)
+		{
+			for(int v = 0; v < numVel; v++)
+			{
+				const double *e = err[d][v];
+				double rate = std::log2(e[1]/e[2]);
+				bool ok = rate > K+0.5;
+				printf("%-5s h-convergence K=%d N=%d..%d u=(%g,%g): errors %.2e %.2e %.2e, rate %.2f %s\n",names[d],K,N0,4*N0,
+					vel[v][0],vel[v][1],e[0],e[1],e[2],rate,ok ? "ok" : "FAILED");
+				failures += !ok;
+			}
+		}
+	}
+	for(int d = DISCRETIZATION_IPDG; d <= DISCRETIZATION_HDG; d++)
+	{
+		double prev = HUGE_VAL;
+		bool ok = true;
+		printf("%-5s p-convergence N=4 u=(3,-2): errors",names[d]);
+		for(int K = 2; K <= 14; K += 2)
+		{
+			ConvDiff cd(4,K,1.0);
+			cd.SetSolver(SOLVER_DIRECT);
+			cd.SetDiscretization((Discretization)d);
+			cd.init();
+			cd.SetU(3.0,-2.0);
+			SetExactSource(cd);
+			cd.Solve();
+			double err = ExactError(cd);
+			printf(" %.1e",err);
+			if(!(err < 0.1*prev)) ok = false;
+			prev = err;
+		}
+		if(!(prev < 1e-10)) ok = false;
+		printf(" %s\n",ok ? "ok" : "FAILED");
+		failures += !ok;
+	}
+	return failures;
+}
+
+// Largest coefficient difference of a's solution from phi, a solution in
+// b's ordering, relative to phi's largest coefficient.
+static double CoeffDiff(ConvDiff& a, ConvDiff& b, const Vec& phi)
+{
+	int N = b.GetN(), K = b.GetK();
+	double diff = 0.0, size = 0.0;
+	for(int ix = 0; ix < N; ix++)
+	{
+		for(int iy = 0; iy < N; iy++)
+		{
+			for(int px = 0; px < K+1; px++)
+			{
+				for(int py = 0; py < K+1-px; py++)
+				{
+					double ref = phi(b.idx(ix,iy,px,py));
+					diff = std::max(diff,std::abs(a.GetPhi()(a.idx(ix,iy,px,py))-ref));
+					size = std::max(size,std::abs(ref));
+				}
+			}
+		}
+	}
+	return size > 0.0 ? diff/size : diff;
+}
+
+// The default problem at two velocities, sampled at a few points, against
+// recorded values. Solver changes must leave them alone; a deliberate change
+// to the discretization or the source has to update them.
+static int CheckRegression()
+{
+	static const double pts[][2] = { {0.1,0.2}, {0.37,0.71}, {0.5,0.5}, {0.93,0.05} };
+	static const double vel[][2] = { {0.0,0.0}, {120.0,-80.0} };
+	static const double expected[][4] = {
+		{ -0.0021623060219018559, 0.014701139072513296, 0.0015339929670950478, -0.0063423849768313592 },
+		{ -0.00035680886929469413, 0.00092484470502860719, 0.0012057560668128683, -0.0013376058672781928 } };
+	int failures = 0;
+	for(int v = 0; v < 2; v++)
+	{
+		ConvDiff cd(3,10,1.0);
+		cd.SetSolver(SOLVER_DIRECT);
+		cd.init();
+		cd.SetU(vel[v][0],vel[v][1]);
+		cd.Solve();
+		double diff = 0.0;
+		for(int k = 0; k < 4; k++)
+		{
+			double val = cd.Eval(pts[k][0],pts[k][1]);
+			diff = std::max(diff,std::abs(val-expected[v][k])/std::abs(expected[v][k]));
+		}
+		bool ok = diff < 1e-9;
+		printf("regression N=3 K=10 u=(%g,%g): relative difference %.1e %s\n",vel[v][0],vel[v][1],diff,ok ? "ok" : "FAILED");
+		failures += !ok;
+	}
+	return failures;
+}
+
+// Random grids and velocities. Against a direct solve of the same system:
+// the direct solver in every ordering, HDG in every ordering against HDG,
+// and continuation must agree to round-off; each iterative solver and
+// preconditioner, in a random element-major ordering, and GCRO-DR with a
+// recycled subspace must converge and agree to the accuracy its residual
+// allows. Only the weak preconditioners (Jacobi, and none) may stall at high
+// Peclet numbers; that is counted per configuration. The residual Solve()
+// reports from its preassembled system must match one recomputed from
+// AssembleSystem(), as must GatherMatVec()'s product, and EvalStrip() and
+// EvalPoints() must match Eval(). Returns the number of failures.
+static int FuzzSolvers(unsigned seed, int cases)
+{
+	static const SolverConfig configs[] = {
+		{ SOLVER_BICGSTAB, PRECOND_ILU0 }, { SOLVER_BICGSTAB, PRECOND_JACOBI },
+		{ SOLVER_GMRES, PRECOND_ILU0 }, { SOLVER_GMRES, PRECOND_NONE },
+		{ SOLVER_IDRS, PRECOND_ILU0 }, { SOLVER_IDRS, PRECOND_JACOBI }, { SOLVER_AUTO },
+		{ SOLVER_GCRODR, PRECOND_ILU0 }, { SOLVER_GCRODR, PRECOND_JACOBI } };
+	static const DofOrdering elementMajor[] = { ORDER_ELEMENT, ORDER_MORTON, ORDER_HILBERT };
+	const int numConfigs = sizeof(configs)/sizeof(configs[0]);
+	std::mt19937 rng(seed);
+	int failures = 0;
+	// per configuration, then the recycled GCRO-DR case
+	int unconverged[numConfigs+1] = {};
+	for(int c = 0; c < cases; c++)
+	{
+		int N = 1+rng()%8;
+		int K = rng()%9;
+		while(N*N*(K+1)*(K+2)/2 > 1000) K--;
+		double mag = (rng()%4 == 0 ? 0.0 : std::pow(10.0,2.3*rng()/4294967296.0));
+		double angle = 2.0*PI*rng()/4294967296.0;
+		double ux = mag*std::cos(angle), uy = (rng()%4 == 0 ? 0.0 : mag*std::sin(angle));
+		std::vector<const char *> failed;
+
+		// one solver per ordering, assembled once
+		std::vector<std::unique_ptr<ConvDiff> > cds;
+		for(int o = ORDER_ELEMENT; o <= ORDER_HILBERT; o++)
+		{
+			cds.emplace_back(new ConvDiff(N,K,1.0));
+			cds[o]->SetOrdering((DofOrdering)o);
+			cds[o]->init();
+			cds[o]->SetU(ux,uy);
+		}
+		ConvDiff& base = *cds[ORDER_ELEMENT];
+		double rhsNorm = base.GetRHS().norm();
+		base.SetDiscretization(DISCRETIZATION_HDG);
+		base.Solve();
+		Vec hdgPhi = base.GetPhi();
+		base.SetDiscretization(DISCRETIZATION_IPDG);
+		base.SetSolver(SOLVER_DIRECT);
+		base.Solve();
+		Vec phi = base.GetPhi();
+		for(int o = ORDER_MODE; o <= ORDER_HILBERT; o++)
+		{
+			ConvDiff& cd = *cds[o];
+			cd.SetSolver(SOLVER_DIRECT);
+			cd.Solve();
+			if(!(CoeffDiff(cd,base,phi) < 1e-9)) failed.push_back(OrderingName((DofOrdering)o));
+			cd.SetDiscretization(DISCRETIZATION_HDG);
+			cd.Solve();
+			if(!(CoeffDiff(cd,base,hdgPhi) < 1e-9)) failed.push_back("hdg");
+			cd.SetDiscretization(DISCRETIZATION_IPDG);
+		}
+
+		// the wasm SIMD build's gathered product against the assembled R, in
+		// every ordering
+		for(int o = ORDER_ELEMENT; o <= ORDER_HILBERT; o++)
+		{
+			ConvDiff& cd = *cds[o];
+			SpMat R;
+			cd.AssembleSystem(R);
+			Vec x(cd.GetDof()), y(cd.GetDof());
+			for(int i = 0; i < x.size(); i++) x(i) = rng()/4294967296.0-0.5;
+			cd.GatherMatVec(x,y);
+			Vec ref = R*x;
+			if(!((y-ref).norm() <= 1e-12*ref.norm())) failed.push_back("gather");
+		}
+
+		// EvalStrip() against Eval(), on the direct solution
+		const int res = 29;
+		std::vector<float> strip(res*res);
+		base.EvalStrip(res,0,res,strip.data());
+		double diff = 0.0, size = 0.0;
+		for(int i = 0; i < res; i++)
+		{
+			for(int j = 0; j < res; j++)
+			{
+				double val = base.Eval((1.0*j)/res,(1.0*i)/res);
+				diff = std::max(diff,std::abs(strip[i*res+j]-val));
+				size = std::max(size,std::abs(val));
+			}
+		}
+		if(!(diff <= 1e-6*size)) failed.push_back("evalstrip");
+
+		// EvalPoints() against Eval() at points up to a few periods out, and
+		// its gradient against central differences inside the elements
+		const int numProbes = 64;
+		double px[numProbes], py[numProbes], pv[numProbes], pdx[numProbes], pdy[numProbes];
+		for(int k = 0; k < numProbes; k++)
+		{
+			px[k] = 8.0*rng()/4294967296.0-4.0;
+			py[k] = 8.0*rng()/4294967296.0-4.0;
+		}
+		base.EvalPoints(numProbes,px,py,pv,pdx,pdy);
+		double gdiff = 0.0, gsize = 0.0, step = 1e-6/N;
+		diff = 0.0;
+		for(int k = 0; k < numProbes; k++)
+		{
+			diff = std::max(diff,std::abs(pv[k]-base.Eval(px[k],py[k])));
+			double xr = px[k]*N-std::floor(px[k]*N), yr = py[k]*N-std::floor(py[k]*N);
+			if(std::min(std::min(xr,1.0-xr),std::min(yr,1.0-yr)) < 0.01) continue;
+			double fdx = (base.Eval(px[k]+step,py[k])-base.Eval(px[k]-step,py[k]))/(2.0*step);
+			double fdy = (base.Eval(px[k],py[k]+step)-base.Eval(px[k],py[k]-step))/(2.0*step);
+			gdiff = std::max(gdiff,std::max(std::abs(pdx[k]-fdx),std::abs(pdy[k]-fdy)));
+			gsize = std::max(gsize,std::max(std::abs(fdx),std::abs(fdy)));
+		}
+		if(!(diff <= 1e-12*size && gdiff <= 1e-5*(gsize+size*N))) failed.push_back("evalpoints");
+
+		for(int m = 0; m < numConfigs; m++)
+		{
+			ConvDiff& cd = *cds[elementMajor[rng()%3]];
+			cd.SetSolverConfig(configs[m]);
+			double resid = cd.Solve();
+			bool weak = (configs[m].method != SOLVER_AUTO && configs[m].precond != PRECOND_ILU0);
+			if(!(resid <= 1e-8*rhsNorm)) unconverged[m]++;
+			if(resid <= 1e-8*rhsNorm ? !(CoeffDiff(cd,base,phi) < 1e-6) : !weak) failed.push_back(SolverName(configs[m].method));
+		}
+		{
+			// GCRO-DR with a subspace recycled from a nearby velocity
+			ConvDiff& cd = *cds[elementMajor[rng()%3]];
+			SolverConfig gcrodr;
+			gcrodr.method = SOLVER_GCRODR;
+			gcrodr.restart = 10+rng()%21;
+			gcrodr.recycle = 1+rng()%(gcrodr.restart/2);
+			cd.SetSolverConfig(gcrodr);
+			cd.SetU(0.7*ux-5.0,0.7*uy+5.0);
+			cd.Solve();
+			cd.SetU(ux,uy);
+			double resid = cd.Solve();
+			if(!(resid <= 1e-8*rhsNorm)) unconverged[numConfigs]++;
+			if(!(resid <= 1e-8*rhsNorm && CoeffDiff(cd,base,phi) < 1e-6)) failed.push_back("recycled");
+		}
+		{
+			// from zero: SetPhi() makes continuation start over at u = 0
+			ConvDiff& cd = *cds[elementMajor[rng()%3]];
+			cd.SetSolverConfig(SolverConfig());
+			cd.SetPhi(Vec::Zero(cd.GetDof()));
+			double resid = cd.SolveContinuation();
+			if(!(resid <= 1e-8*rhsNorm && CoeffDiff(cd,base,phi) < 1e-6)) failed.push_back("continuation");
+		}
+		{
+			// a loose tolerance leaves a residual big enough to compare
+			SolverConfig loose;
+			loose.tol = 1e-2;
+			base.SetSolverConfig(loose);
+			double resid = base.Solve();
+			SpMat R;
+			base.AssembleSystem(R);
+			double check = (R*base.GetPhi()-base.GetRHS()).norm();
+			if(!(std::abs(resid-check) <= 1e-10*rhsNorm+1e-8*check)) failed.push_back("residual");
+		}
+		if(!failed.empty())
+		{
+			printf("fuzz case %d: -N %d -K %d -ux %.17g -uy %.17g FAILED:",c,N,K,ux,uy);
+			for(size_t f = 0; f < failed.size(); f++) printf(" %s",failed[f]);
+			printf("\n");
+			failures++;
+		}
+	}
+	printf("fuzz: %d cases from seed %u, %d failed; iterative solves that did not converge:\n",cases,seed,failures);
+	for(int m = 0; m <= numConfigs; m++)
+	{
+		if(m == numConfigs) printf("  %-16s %d\n","recycled gcrodr",unconverged[m]);
+		else
+		{
+			char name[32];
+			snprintf(name,sizeof(name),"%s/%s",SolverName(configs[m].method),configs[m].method == SOLVER_AUTO ? "-" : PreconditionerName(configs[m].precond));
+			printf("  %-16s %d\n",name,unconverged[m]);
+		}
+	}
+	return failures;
+}
+
+// Exact spectral extremes of the unpinned A + U from its Bloch symbols,
+// leaving out the zero eigenvalue and singular value of the constants; NaN
+// where SymbolSpectrum() does not apply.
+struct SymbolExtremes
+{
+	double reMin, absMin, absMax, sigmaMin, sigmaMax;
+};
+
+static SymbolExtremes SymbolStats(ConvDiff& cd)
+{
+	SymbolExtremes ex;
+	CMat eig;
+	Mat sv;
+	if(!cd.SymbolSpectrum(eig,sv))
+	{
+		ex.reMin = ex.absMin = ex.absMax = ex.sigmaMin = ex.sigmaMax = NAN;
+		return ex;
+	}
+	ex.reMin = ex.absMin = ex.sigmaMin = HUGE_VAL;
+	ex.absMax = ex.sigmaMax = 0.0;
+	for(int c = 0; c < eig.cols(); c++)
+	{
+		int zero = -1;
+		if(c == 0) eig.col(0).cwiseAbs().minCoeff(&zero);
+		for(int r = 0; r < eig.rows(); r++)
+		{
+			if(r == zero) continue;
+			ex.reMin = std::min(ex.reMin,eig(r,c).real());
+			ex.absMin = std::min(ex.absMin,std::abs(eig(r,c)));
+			ex.absMax = std::max(ex.absMax,std::abs(eig(r,c)));
+		}
+		int last = (int)sv.rows()-1-(c == 0);
+		ex.sigmaMax = std::max(ex.sigmaMax,sv(0,c));
+		if(last >= 0) ex.sigmaMin = std::min(ex.sigmaMin,sv(last,c));
+	}
+	return ex;
+}
+
+// Write the Bloch symbol spectrum of A + U at cd's velocity as CSV, one
+// line per Fourier mode (kx,ky) and eigenvalue; sigma is the singular
+// value of the same rank, which is not paired with the eigenvalue.
+static bool WriteSymbol(ConvDiff& cd, const char *fname)
+{
+	CMat eig;
+	Mat sv;
+	if(!cd.SymbolSpectrum(eig,sv))
+	{
+		fprintf(stderr,"the symbol needs N >= 2\n");
+		return false;
+	}
+	FILE *f = fopen(fname,"w");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s\n",fname);
+		return false;
+	}
+	int N = cd.GetN();
+	fprintf(f,"kx,ky,re,im,sigma\n");
+	for(int c = 0; c < eig.cols(); c++)
+	{
+		for(int r = 0; r < eig.rows(); r++) fprintf(f,"%d,%d,%.17g,%.17g,%.17g\n",c/N,c%N,eig(r,c).real(),eig(r,c).imag(),sv(r,c));
+	}
+	return fclose(f) == 0;
+}
+
+// Spectra of A + U at steps+1 velocities from 0 to cd's, with the cost and
+// accuracy of a solve at each, to compare penalty and solver settings: the
+// exact symbol extremes, EstimateSpectrum()'s condition number and Ritz
+// extremes of the pinned, preconditioned system, and the configured
+// solver's iterations, time and L2 error on ExactPhi. Written to fname as
+// CSV and summarized on stdout.
+static bool SpectrumScan(ConvDiff& cd, const char *fname, int steps)
+{
+	FILE *f = fopen(fname,"w");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s\n",fname);
+		return false;
+	}
+	double ux = cd.GetUx(), uy = cd.GetUy();
+	fprintf(f,"ux,uy,symbol_re_min,symbol_abs_min,symbol_abs_max,symbol_sigma_min,symbol_sigma_max,"
+		"sigma_min,sigma_max,condition,ritz_re_min,ritz_abs_min,ritz_abs_max,iterations,solve_ms,error\n");
+	printf("sigma0 %g, beta0 %g, epsilon %g\n",cd.GetSigma0(),cd.GetBeta0(),cd.GetEpsilon());
+	printf("%9s %9s %10s %10s %10s %10s %10s %6s %9s %9s\n","ux","uy","sym re","sym cond","cond","ritz re","ritz |max|","iters","solve ms","error");
+	for(int s = 0; s <= steps; s++)
+	{
+		cd.SetU(ux*s/steps,uy*s/steps);
+		SetExactSource(cd);
+		double start = Tracer::Now();
+		cd.Solve();
+		double ms = Tracer::Now()-start;
+		int iters = cd.iterations;
+		double err = ExactError(cd);
+		SymbolExtremes sym = SymbolStats(cd);
+		SpectrumEstimate est;
+		cd.EstimateSpectrum(60,est);
+		double ritzRe = HUGE_VAL, ritzMin = HUGE_VAL, ritzMax = 0.0;
+		for(size_t k = 0; k < est.ritz.size(); k++)
+		{
+			ritzRe = std::min(ritzRe,est.ritz[k].real());
+			ritzMin = std::min(ritzMin,std::abs(est.ritz[k]));
+			ritzMax = std::max(ritzMax,std::abs(est.ritz[k]));
+		}
+		fprintf(f,"%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%d,%.6g,%.17g\n",
+			cd.GetUx(),cd.GetUy(),sym.reMin,sym.absMin,sym.absMax,sym.sigmaMin,sym.sigmaMax,
+			est.sigmaMin,est.sigmaMax,est.condition,ritzRe,ritzMin,ritzMax,iters,ms,err);
+		printf("%9.3g %9.3g %10.3e %10.3e %10.3e %10.3e %10.3e %6d %9.2f %9.2e\n",cd.GetUx(),cd.GetUy(),
+			sym.reMin,sym.sigmaMax/sym.sigmaMin,est.condition,ritzRe,ritzMax,iters,ms,err);
+	}
+	return fclose(f) == 0;
+}
+
+static bool ParseSolver(const char *name, SolverMethod& method)
+{
+	for(int m = SOLVER_BICGSTAB; m <= SOLVER_GCRODR; m++)
+	{
+		if(!strcmp(name,SolverName((SolverMethod)m)))
+		{
+			method = (SolverMethod)m;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool ParseOrdering(const char *name, DofOrdering& ordering)
+{
+	for(int o = ORDER_ELEMENT; o <= ORDER_HILBERT; o++)
+	{
+		if(!strcmp(name,OrderingName((DofOrdering)o)))
+		{
+			ordering = (DofOrdering)o;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool ParsePreconditioner(const char *name, Preconditioner& precond)
+{
+	for(int p = PRECOND_ILU0; p <= PRECOND_NONE; p++)
+	{
+		if(!strcmp(name,PreconditionerName((Preconditioner)p)))
+		{
+			precond = (Preconditioner)p;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Native driver: solve once and stream the result to disk. Built with
+// CONVDIFF_MPI the solve is distributed over all ranks of MPI_COMM_WORLD and
+// rank 0 gathers the solution for output.
+int main(int argc, char ** argv)
+{
+	int N = 3;
+	int K = 10;
+	double ux = 0.0;
+	double uy = 0.0;
+	int res = 693;
+	int tileRows = 64;
+	const char *rawFile = 0;
+	const char *vtkFile = 0;
+	const char *coeffFile = 0;
+	const char *imageFile = 0;
+	const char *traceFile = 0;
+	const char *probeFile = 0;
+	const char *spectrumFile = 0;
+	const char *symbolFile = 0;
+	const char *dragFile = 0;
+	double sigma0 = 0.0;
+	double beta0 = 1.0;
+	double epsilon = -1.0;
+	bool exactBlocks = true;
+	double tol = 1e-10;
+	int maxIter = 1000;
+	bool tolSet = false;
+	bool gradient = false;
+	bool continuation = false;
+	DofOrdering ordering = ORDER_ELEMENT;
+	bool hdg = false;
+	bool check = false;
+	unsigned seed = 1;
+	SolverConfig solver;
+
+	for(int i = 1; i < argc; i++)
+	{
+		bool hasArg = (i+1 < argc);
+		if(!strcmp(argv[i],"-N") && hasArg) N = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-K") && hasArg) K = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-ux") && hasArg) ux = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-uy") && hasArg) uy = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-res") && hasArg) res = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-tile") && hasArg) tileRows = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-raw") && hasArg) rawFile = argv[++i];
+		else if(!strcmp(argv[i],"-vtk") && hasArg) vtkFile = argv[++i];
+		else if(!strcmp(argv[i],"-coeffs") && hasArg) coeffFile = argv[++i];
+		else if(!strcmp(argv[i],"-ppm") && hasArg) imageFile = argv[++i];
+		else if(!strcmp(argv[i],"-trace") && hasArg) traceFile = argv[++i];
+		else if(!strcmp(argv[i],"-probe") && hasArg) probeFile = argv[++i];
+		else if(!strcmp(argv[i],"-spectrum") && hasArg) spectrumFile = argv[++i];
+		else if(!strcmp(argv[i],"-symbol") && hasArg) symbolFile = argv[++i];
+		else if(!strcmp(argv[i],"-sigma0") && hasArg) sigma0 = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-beta0") && hasArg) beta0 = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-epsilon") && hasArg) epsilon = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-schwarz") && hasArg) exactBlocks = strcmp(argv[++i],"ilut") != 0;
+		else if(!strcmp(argv[i],"-tol") && hasArg)
+		{
+			tol = atof(argv[++i]);
+			tolSet = true;
+		}
+		else if(!strcmp(argv[i],"-maxiter") && hasArg) maxIter = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-solver") && hasArg && ParseSolver(argv[i+1],solver.method)) i++;
+		else if(!strcmp(argv[i],"-precond") && hasArg && ParsePreconditioner(argv[i+1],solver.precond)) i++;
+		else if(!strcmp(argv[i],"-order") && hasArg && ParseOrdering(argv[i+1],ordering)) i++;
+		else if(!strcmp(argv[i],"-restart") && hasArg) solver.restart = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-shadow") && hasArg) solver.shadow = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-recycle") && hasArg) solver.recycle = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-drag") && hasArg) dragFile = argv[++i];
+		else if(!strcmp(argv[i],"-gradient")) gradient = true;
+		else if(!strcmp(argv[i],"-continuation")) continuation = true;
+		else if(!strcmp(argv[i],"-hdg")) hdg = true;
+		else if(!strcmp(argv[i],"-check")) check = true;
+		else if(!strcmp(argv[i],"-seed") && hasArg) seed = strtoul(argv[++i],NULL,10);
+		else if(!strcmp(argv[i],"-bench"))
+		{
+			Benchmark();
+			BenchmarkContinuation();
+			BenchmarkRecycling();
+			BenchmarkOrdering();
+			BenchmarkHDG();
+			BenchmarkProbes(res);
+			BenchmarkColormap(res);
+			return 0;
+		}
+		else
+		{
+			fprintf(stderr,"usage: %s [-N n] [-K k] [-ux u] [-uy u] [-res r] [-tile rows]"
+				" [-raw file] [-vtk file] [-coeffs file] [-ppm file] [-probe file] [-trace file]"
+				" [-spectrum file] [-symbol file] [-sigma0 s] [-beta0 b] [-epsilon e]"
+				" [-schwarz lu|ilut] [-tol t] [-maxiter n] [-solver bicgstab|gmres|idrs|direct|auto|gcrodr]"
+				" [-precond ilu0|jacobi|none] [-order element|mode|morton|hilbert] [-restart m] [-shadow s] [-recycle k] [-drag file] [-hdg] [-continuation] [-gradient] [-bench] [-check] [-seed s]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(check)
+	{
+#ifdef CONVDIFF_MPI
+		MPI_Init(&argc,&argv);
+		int rank;
+		MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+		int failures = CheckDistributed(MPI_COMM_WORLD);
+		MPI_Finalize();
+		if(rank != 0) return 0;
+#else
+		int failures = 0;
+#endif
+		failures += CheckConvergence();
+		failures += CheckRegression();
+		failures += FuzzSolvers(seed,40);
+		printf("%d checks failed\n",failures);
+		return failures ? 1 : 0;
+	}
+	if(N < 1 || K < 0 || res < 1)
+	{
+		fprintf(stderr,"invalid grid parameters\n");
+		return 1;
+	}
+	if(K > POLYMAX) K = POLYMAX;
+
+	if(spectrumFile || symbolFile)
+	{
+		ConvDiff cd(N,K,1.0);
+		cd.SetOrdering(ordering);
+		cd.SetPenalty(sigma0 > 0.0 ? sigma0 : cd.GetSigma0(),beta0,epsilon);
+		cd.SetU(ux,uy);
+		if(tolSet) solver.tol = tol;
+		cd.SetSolverConfig(solver);
+		cd.init();
+		bool ok = true;
+		if(symbolFile) ok = WriteSymbol(cd,symbolFile) && ok;
+		if(spectrumFile) ok = SpectrumScan(cd,spectrumFile,8) && ok;
+		return ok ? 0 : 1;
+	}
+	if(dragFile)
+	{
+		if(tolSet) solver.tol = tol;
+		return ReplayDrag(N,K,ordering,solver,dragFile) ? 0 : 1;
+	}
+
+	if(traceFile) Tracer::Get().SetEnabled(true);
+
+	ConvDiff convDiff(N,K,1.0);
+	convDiff.SetOrdering(ordering);
+	convDiff.SetPenalty(sigma0 > 0.0 ? sigma0 : convDiff.GetSigma0(),beta0,epsilon);
+	if(hdg) convDiff.SetDiscretization(DISCRETIZATION_HDG);
+	convDiff.SetU(ux,uy);
+	if(tolSet) solver.tol = tol;
+	convDiff.SetSolverConfig(solver);
+#ifdef CONVDIFF_MPI
+	MPI_Init(&argc,&argv);
+	int rank, size;
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&size);
+	if(!DistConvDiff::FitsGrid(MPI_COMM_WORLD,N))
+	{
+		if(rank == 0) fprintf(stderr,"%d ranks leave some without elements of the %d x %d grid; use fewer ranks\n",size,N,N);
+		MPI_Finalize();
+		return 1;
+	}
+	// the distributed solver only has the IP-DG system
+	if(hdg)
+	{
+		if(rank == 0) fprintf(stderr,"-hdg is not available with MPI\n");
+		MPI_Finalize();
+		return 1;
+	}
+	{
+		DistConvDiff dist(MPI_COMM_WORLD,N,K,1.0,exactBlocks,ordering);
+		if(sigma0 > 0.0 || beta0 != 1.0 || epsilon != -1.0) dist.SetPenalty(convDiff.GetSigma0(),beta0,epsilon);
+		dist.SetU(ux,uy);
+		dist.Setup();
+		bool converged = dist.Solve(tol,maxIter);
+		dist.Gather(convDiff);
+		if(rank == 0)
+		{
+			printf("%d ranks, %d iterations, relative residual %3.2e%s\n",
+				size, dist.iterations, dist.relResid, converged ? "" : " (not converged)");
+		}
+	}
+	if(rank != 0)
+	{
+		MPI_Finalize();
+		return 0;
+	}
+	printf("spatial residual %3.2e\n", convDiff.SolResid());
+	if(gradient || continuation) printf("-gradient and -continuation are not available with MPI\n");
+#else
+	(void)exactBlocks; (void)maxIter;
+	convDiff.init();
+	if(gradient) CheckGradient(convDiff);
+	ContinuationStats cont;
+	double matResid = continuation ? convDiff.SolveContinuation(&cont) : convDiff.Solve();
+	double solResid = convDiff.SolResid();
+	const SolverConfig& used = convDiff.GetUsedSolverConfig();
+	if(hdg) printf("HDG, trace system solved directly\n");
+	else if(used.method == SOLVER_DIRECT) printf("solver direct\n");
+	else printf("solver %s, %s preconditioner, %d iterations\n",SolverName(used.method),PreconditionerName(used.precond),convDiff.iterations);
+	if(continuation)
+	{
+		printf("continuation: %d steps, %d rejected, %d factorizations, preconditioner reused %d times%s\n",
+			cont.steps,cont.rejected,cont.factorizations,cont.reuses,cont.fallback ? ", finished by the direct solver" : "");
+	}
+	printf("matrix residual %3.2e, spatial residual %3.2e\n", matResid, solResid);
+	if(AllocationCount() >= 0)
+	{
+		long before = AllocationCount();
+		convDiff.Solve();
+		printf("heap allocations in a repeated solve: %ld\n", AllocationCount()-before);
+	}
+#endif
+
+	bool ok = true;
+	if(rawFile) ok = convDiff.WriteRaster(rawFile,res,RASTER_RAW,tileRows) && ok;
+	if(vtkFile) ok = convDiff.WriteRaster(vtkFile,res,RASTER_VTK,tileRows) && ok;
+	if(coeffFile) ok = convDiff.WriteCoeffs(coeffFile) && ok;
+	if(imageFile) ok = WriteContourImage(convDiff,imageFile,res) && ok;
+	if(probeFile) ok = WriteProbes(convDiff,probeFile) && ok;
+	if(traceFile)
+	{
+		ok = Tracer::Get().WriteChromeTrace(traceFile) && ok;
+		printf("%s\n",Tracer::Get().StatsJSON());
+	}
+#ifdef CONVDIFF_MPI
+	MPI_Finalize();
+#endif
+	return ok ? 0 : 1;
+}
+
+#endif
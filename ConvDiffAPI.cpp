@@ -0,0 +1,230 @@
+#include "ConvDiffAPI.h"
+#include "ConvDiffCore.h"
+#include <new>
+#include <string.h>
+#include <limits.h>
+
+struct convdiff_solver
+{
+	ConvDiff cd;
+	bool assembled;
+	bool solved;
+	convdiff_stats stats;
+	convdiff_solver(int N, int K, double L) : cd(N,K,L), assembled(false), solved(false) {}
+};
+
+// Every row of R couples to the modes of its element and four neighbours,
+// and its nonzeros, like the dofs, are counted in int.
+static bool ValidGrid(int N, int K)
+{
+	if(N < 1 || K < 0 || K > POLYMAX) return false;
+	long long nb = (K+1)*(K+2)/2;
+	return (long long)N*N*nb*nb*5 <= INT_MAX;
+}
+
+// Assemble s->cd, after moving it to an N by N grid of degree K if N > 0,
+// timing it for the stats.
+static int Assemble(convdiff_solver *s, int N = 0, int K = 0)
+{
+	double start = Tracer::Now();
+	try
+	{
+		if(N > 0) s->cd.SetGrid(N,K,s->cd.GetL());
+		s->cd.init();
+	}
+	catch(const std::bad_alloc&)
+	{
+		s->assembled = false;
+		s->solved = false;
+		return CONVDIFF_ENOMEM;
+	}
+	s->assembled = true;
+	s->stats.assemblyMs = Tracer::Now()-start;
+	s->stats.N = s->cd.GetN();
+	s->stats.K = s->cd.GetK();
+	s->stats.dof = s->cd.GetDof();
+	s->solved = false;
+	return CONVDIFF_OK;
+}
+
+convdiff_solver *convdiff_create(int N, int K, double L)
+{
+	if(!ValidGrid(N,K) || !(L > 0.0) || !std::isfinite(L)) return NULL;
+	convdiff_solver *s;
+	try
+	{
+		s = new convdiff_solver(N,K,L);
+	}
+	catch(const std::bad_alloc&)
+	{
+		return NULL;
+	}
+	memset(&s->stats,0,sizeof(s->stats));
+	if(Assemble(s) != CONVDIFF_OK)
+	{
+		delete s;
+		return NULL;
+	}
+	return s;
+}
+
+void convdiff_destroy(convdiff_solver *s)
+{
+	delete s;
+}
+
+int convdiff_max_degree(void)
+{
+	return POLYMAX;
+}
+
+int convdiff_set_velocity(convdiff_solver *s, double ux, double uy)
+{
+	if(!s || !std::isfinite(ux) || !std::isfinite(uy)) return CONVDIFF_EINVAL;
+	s->cd.SetU(ux,uy);
+	s->solved = false;
+	return CONVDIFF_OK;
+}
+
+int convdiff_set_solver(convdiff_solver *s, int method)
+{
+	// the CONVDIFF_SOLVER_* values are those of SolverMethod
+	if(!s || method < CONVDIFF_SOLVER_BICGSTAB || method > CONVDIFF_SOLVER_GCRODR) return CONVDIFF_EINVAL;
+	s->cd.SetSolver((SolverMethod)method);
+	return CONVDIFF_OK;
+}
+
+int convdiff_set_preconditioner(convdiff_solver *s, int precond)
+{
+	// the CONVDIFF_PRECOND_* values are those of Preconditioner
+	if(!s || precond < CONVDIFF_PRECOND_ILU0 || precond > CONVDIFF_PRECOND_NONE) return CONVDIFF_EINVAL;
+	SolverConfig cfg = s->cd.GetSolverConfig();
+	cfg.precond = (Preconditioner)precond;
+	s->cd.SetSolverConfig(cfg);
+	return CONVDIFF_OK;
+}
+
+int convdiff_set_discretization(convdiff_solver *s, int discretization)
+{
+	// the CONVDIFF_DISCRETIZATION_* values are those of Discretization
+	if(!s || discretization < CONVDIFF_DISCRETIZATION_IPDG || discretization > CONVDIFF_DISCRETIZATION_HDG) return CONVDIFF_EINVAL;
+	s->cd.SetDiscretization((Discretization)discretization);
+	s->solved = false;
+	return CONVDIFF_OK;
+}
+
+int convdiff_set_source(convdiff_solver *s, const double *params)
+{
+	if(!s || !params) return CONVDIFF_EINVAL;
+	for(int k = 0; k < CONVDIFF_SOURCE_PARAMS; k++) if(!std::isfinite(params[k])) return CONVDIFF_EINVAL;
+	if(!(params[CONVDIFF_SOURCE_WIDTH] > 0.0)) return CONVDIFF_EINVAL;
+	SourceParams src;
+	src.x0 = params[CONVDIFF_SOURCE_X0];
+	src.y0 = params[CONVDIFF_SOURCE_Y0];
+	src.x1 = params[CONVDIFF_SOURCE_X1];
+	src.y1 = params[CONVDIFF_SOURCE_Y1];
+	src.width = params[CONVDIFF_SOURCE_WIDTH];
+	s->cd.SetSource(src);
+	s->solved = false;
+	return CONVDIFF_OK;
+}
+
+int convdiff_set_grid(convdiff_solver *s, int N, int K)
+{
+	if(!s || !ValidGrid(N,K)) return CONVDIFF_EINVAL;
+	return Assemble(s,N,K);
+}
+
+int convdiff_solve(convdiff_solver *s, double *residual)
+{
+	if(!s) return CONVDIFF_EINVAL;
+	// a grid change that ran out of memory is retried here
+	if(!s->assembled && Assemble(s) != CONVDIFF_OK) return CONVDIFF_ENOMEM;
+	double start = Tracer::Now();
+	double resid;
+	try
+	{
+		resid = s->cd.Solve();
+	}
+	catch(const std::bad_alloc&)
+	{
+		s->solved = false;
+		return CONVDIFF_ENOMEM;
+	}
+	double ms = Tracer::Now()-start;
+	s->stats.solves++;
+	s->stats.iterations = s->cd.iterations;
+	s->stats.residual = resid;
+	s->stats.lastSolveMs = ms;
+	s->stats.method = s->cd.GetUsedSolverConfig().method;
+	s->stats.precond = s->cd.GetUsedSolverConfig().precond;
+	s->stats.totalSolveMs += ms;
+	s->solved = true;
+	if(residual) *residual = resid;
+	return CONVDIFF_OK;
+}
+
+// Check the points and evaluate them; dx and dy may be NULL.
+static int EvalPoints(convdiff_solver *s, int n, const double *x, const double *y, double *out, double *dx, double *dy)
+{
+	if(!s || n < 0 || (n > 0 && (!x || !y || !out))) return CONVDIFF_EINVAL;
+	if(!s->solved) return CONVDIFF_ENOSOLUTION;
+	for(int k = 0; k < n; k++)
+	{
+		if(!std::isfinite(x[k]) || !std::isfinite(y[k])) return CONVDIFF_EINVAL;
+	}
+	try
+	{
+		s->cd.EvalPoints(n,x,y,out,dx,dy);
+	}
+	catch(const std::bad_alloc&)
+	{
+		return CONVDIFF_ENOMEM;
+	}
+	return CONVDIFF_OK;
+}
+
+int convdiff_eval(convdiff_solver *s, int n, const double *x, const double *y, double *out)
+{
+	return EvalPoints(s,n,x,y,out,NULL,NULL);
+}
+
+int convdiff_eval_gradient(convdiff_solver *s, int n, const double *x, const double *y, double *out, double *dx, double *dy)
+{
+	if(n > 0 && (!dx || !dy)) return CONVDIFF_EINVAL;
+	return EvalPoints(s,n,x,y,out,dx,dy);
+}
+
+int convdiff_gradient(convdiff_solver *s, const double *dJdcoeffs, int n, double *grad, double *residual)
+{
+	if(!s || !dJdcoeffs || !grad || n < s->cd.GetDof() || s->cd.GetDiscretization() == DISCRETIZATION_HDG) return CONVDIFF_EINVAL;
+	if(!s->solved) return CONVDIFF_ENOSOLUTION;
+	double resid;
+	try
+	{
+		Vec dJdphi = Eigen::Map<const Vec>(dJdcoeffs,s->cd.GetDof());
+		if(!s->cd.Gradient(dJdphi,grad[0],grad[1],grad+2,&resid)) return CONVDIFF_EINVAL;
+	}
+	catch(const std::bad_alloc&)
+	{
+		return CONVDIFF_ENOMEM;
+	}
+	if(residual) *residual = resid;
+	return CONVDIFF_OK;
+}
+
+int convdiff_get_coeffs(convdiff_solver *s, double *coeffs, int n)
+{
+	if(!s || !coeffs || n < s->cd.GetDof()) return CONVDIFF_EINVAL;
+	if(!s->solved) return CONVDIFF_ENOSOLUTION;
+	const Vec& phi = s->cd.GetPhi();
+	for(int k = 0; k < phi.size(); k++) coeffs[k] = phi(k);
+	return CONVDIFF_OK;
+}
+
+int convdiff_get_stats(convdiff_solver *s, convdiff_stats *stats)
+{
+	if(!s || !stats) return CONVDIFF_EINVAL;
+	*stats = s->stats;
+	return CONVDIFF_OK;
+}
@@ -0,0 +1,115 @@
+/* C interface to the convection-diffusion solver core, for use from C, from
+ * other languages through an FFI, or from other C++ projects that should not
+ * depend on the core's classes. Each solver handle owns all of its state,
+ * so separate handles may be used concurrently from separate threads; a
+ * single handle must not be used from two threads at once.
+ *
+ * Functions returning int give CONVDIFF_OK on success and a negative
+ * CONVDIFF_E* code on failure. */
+#ifndef CONVDIFFAPI_H
+#define CONVDIFFAPI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONVDIFF_OK 0
+#define CONVDIFF_EINVAL (-1)     /* bad handle or argument */
+#define CONVDIFF_ENOMEM (-2)     /* allocation failed */
+#define CONVDIFF_ENOSOLUTION (-3) /* no solve since the last change */
+
+#define CONVDIFF_SOLVER_BICGSTAB 0  /* default */
+#define CONVDIFF_SOLVER_DIRECT 1    /* sparse LU, refactored on velocity change */
+#define CONVDIFF_SOLVER_GMRES 2     /* restarted GMRES(30) */
+#define CONVDIFF_SOLVER_IDRS 3      /* IDR(4) */
+#define CONVDIFF_SOLVER_AUTO 4      /* fastest of the above per grid and Peclet range, timed on first use */
+#define CONVDIFF_SOLVER_GCRODR 5    /* GCRO-DR(30,10): GMRES recycling a subspace across solves, for slowly varying velocity */
+
+#define CONVDIFF_PRECOND_ILU0 0     /* default */
+#define CONVDIFF_PRECOND_JACOBI 1
+#define CONVDIFF_PRECOND_NONE 2
+
+#define CONVDIFF_DISCRETIZATION_IPDG 0 /* default: interior-penalty DG */
+#define CONVDIFF_DISCRETIZATION_HDG 1  /* hybridized: solves for face traces only, faster at high degree */
+
+/* Parameters of the source term, a periodic Gaussian centred at (x0,y0)
+ * minus one at (x1,y1), both of the given width, in units of the domain
+ * side; defaults 0.2, 0.8, 0.8, 0.2, 0.15. */
+#define CONVDIFF_SOURCE_X0 0
+#define CONVDIFF_SOURCE_Y0 1
+#define CONVDIFF_SOURCE_X1 2
+#define CONVDIFF_SOURCE_Y1 3
+#define CONVDIFF_SOURCE_WIDTH 4
+#define CONVDIFF_SOURCE_PARAMS 5
+
+/* Layout of the gradient from convdiff_gradient: d/dux, d/duy, then the
+ * source parameters in CONVDIFF_SOURCE_* order. */
+#define CONVDIFF_GRADIENT_SIZE (2+CONVDIFF_SOURCE_PARAMS)
+
+typedef struct convdiff_solver convdiff_solver;
+
+typedef struct convdiff_stats
+{
+	int N;
+	int K;
+	int dof;
+	long solves;          /* solves since creation */
+	int iterations;       /* Krylov iterations of the last solve */
+	double residual;      /* ||R phi - rhs|| after the last solve */
+	double lastSolveMs;   /* wall time of the last solve */
+	double totalSolveMs;  /* wall time of all solves */
+	double assemblyMs;    /* wall time of the last (re)assembly */
+	int method;           /* CONVDIFF_SOLVER_* the last solve used */
+	int precond;          /* CONVDIFF_PRECOND_* the last solve used */
+} convdiff_stats;
+
+/* Create a solver on an N by N periodic grid of side L with polynomial
+ * degree K (0 <= K <= convdiff_max_degree()); N is limited to where the
+ * operator's nonzero count fits in an int. The operators are assembled
+ * here. Returns NULL on failure. */
+convdiff_solver *convdiff_create(int N, int K, double L);
+void convdiff_destroy(convdiff_solver *s);
+
+int convdiff_max_degree(void);
+int convdiff_set_velocity(convdiff_solver *s, double ux, double uy);
+/* Select the solver and preconditioner (CONVDIFF_SOLVER_*, CONVDIFF_PRECOND_*);
+ * the preconditioner is ignored by the direct and auto solvers. */
+int convdiff_set_solver(convdiff_solver *s, int method);
+int convdiff_set_preconditioner(convdiff_solver *s, int precond);
+/* Select the discretization (CONVDIFF_DISCRETIZATION_*); HDG always solves
+ * directly and has no gradient. Discards the solution. */
+int convdiff_set_discretization(convdiff_solver *s, int discretization);
+/* Set the CONVDIFF_SOURCE_PARAMS source parameters; discards the solution. */
+int convdiff_set_source(convdiff_solver *s, const double *params);
+/* Change the grid, reassembling the operators; discards the solution. If
+ * that runs out of memory the grid is still changed and the next
+ * convdiff_solve retries the assembly. */
+int convdiff_set_grid(convdiff_solver *s, int N, int K);
+/* Solve for the current velocity; residual may be NULL. Returns
+ * CONVDIFF_ENOMEM if the solver, or an assembly it retries, runs out of
+ * memory. */
+int convdiff_solve(convdiff_solver *s, double *residual);
+/* Evaluate the solution at n points; coordinates wrap periodically. The
+ * points are grouped by element internally, so one call with many points
+ * is much cheaper than many calls with one. */
+int convdiff_eval(convdiff_solver *s, int n, const double *x, const double *y, double *out);
+/* As convdiff_eval, also writing the gradient of the solution to dx, dy. */
+int convdiff_eval_gradient(convdiff_solver *s, int n, const double *x, const double *y, double *out, double *dx, double *dy);
+/* Gradient of a functional J of the solution with respect to the velocity
+ * and source parameters, given dJ/dcoeffs (n >= dof values, in the layout of
+ * convdiff_get_coeffs). Costs one solve with the transposed operator, which
+ * reuses the last solve's factorization or preconditioner; built against
+ * Eigen older than 3.4 a direct solve's adjoint runs BiCGSTAB with ILU(0)
+ * instead. grad receives
+ * CONVDIFF_GRADIENT_SIZE values; residual, which may be NULL, receives the
+ * adjoint residual. */
+int convdiff_gradient(convdiff_solver *s, const double *dJdcoeffs, int n, double *grad, double *residual);
+/* Copy the dof modal coefficients of the solution into coeffs. */
+int convdiff_get_coeffs(convdiff_solver *s, double *coeffs, int n);
+int convdiff_get_stats(convdiff_solver *s, convdiff_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
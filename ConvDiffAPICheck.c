@@ -0,0 +1,201 @@
+/* Checks of the C interface in ConvDiffAPI.h, run by make check. Bad
+ * arguments must give CONVDIFF_EINVAL and reading a solution before a solve
+ * CONVDIFF_ENOSOLUTION. Two handles, one direct and one BiCGSTAB, are then
+ * solved at once from two threads and must match the native driver's
+ * -probe output for the same grid and velocity.
+ *
+ * usage: ConvDiffAPICheck N K ux uy probes */
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ConvDiffAPI.h"
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)) { fprintf(stderr,"%s:%d: %s failed\n",__FILE__,__LINE__,#cond); failures++; } } while(0)
+
+static void CheckArguments(void)
+{
+	double src[CONVDIFF_SOURCE_PARAMS] = { 0.2, 0.8, 0.8, 0.2, 0.0 };
+	double grad[CONVDIFF_GRADIENT_SIZE];
+	double x = 0.3, y = 0.6, bad = NAN, val, dx, dy;
+	convdiff_stats stats;
+	convdiff_solver *s;
+	double *coeffs;
+	int dof;
+
+	EXPECT(convdiff_create(0,2,1.0) == NULL);
+	EXPECT(convdiff_create(4,-1,1.0) == NULL);
+	EXPECT(convdiff_create(4,convdiff_max_degree()+1,1.0) == NULL);
+	EXPECT(convdiff_create(4,2,0.0) == NULL);
+	EXPECT(convdiff_create(4,2,NAN) == NULL);
+	EXPECT(convdiff_set_velocity(NULL,1.0,0.0) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_solve(NULL,NULL) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_eval(NULL,1,&x,&y,&val) == CONVDIFF_EINVAL);
+	convdiff_destroy(NULL);
+
+	s = convdiff_create(4,2,1.0);
+	EXPECT(s != NULL);
+	if(!s) return;
+	EXPECT(convdiff_get_stats(s,NULL) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_get_stats(s,&stats) == CONVDIFF_OK);
+	dof = stats.dof;
+	EXPECT(dof == 4*4*6);
+	coeffs = (double*)calloc(dof,sizeof(double));
+	EXPECT(convdiff_set_velocity(s,INFINITY,0.0) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_solver(s,-1) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_solver(s,CONVDIFF_SOLVER_GCRODR+1) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_preconditioner(s,CONVDIFF_PRECOND_NONE+1) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_discretization(s,CONVDIFF_DISCRETIZATION_HDG+1) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_source(s,NULL) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_source(s,src) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_grid(s,0,2) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_set_grid(s,4,-1) == CONVDIFF_EINVAL);
+
+	/* nothing to read before the first solve */
+	EXPECT(convdiff_eval(s,1,&x,&y,&val) == CONVDIFF_ENOSOLUTION);
+	EXPECT(convdiff_eval_gradient(s,1,&x,&y,&val,&dx,&dy) == CONVDIFF_ENOSOLUTION);
+	EXPECT(convdiff_get_coeffs(s,coeffs,dof) == CONVDIFF_ENOSOLUTION);
+	EXPECT(convdiff_gradient(s,coeffs,dof,grad,NULL) == CONVDIFF_ENOSOLUTION);
+
+	/* with a solution, bad arguments are still refused */
+	EXPECT(convdiff_solve(s,NULL) == CONVDIFF_OK);
+	EXPECT(convdiff_eval(s,1,&x,&y,&val) == CONVDIFF_OK);
+	EXPECT(convdiff_eval(s,-1,&x,&y,&val) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_eval(s,1,&bad,&y,&val) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_eval(s,1,&x,&y,NULL) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_eval_gradient(s,1,&x,&y,&val,NULL,&dy) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_get_coeffs(s,coeffs,dof-1) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_gradient(s,coeffs,dof-1,grad,NULL) == CONVDIFF_EINVAL);
+	EXPECT(convdiff_get_coeffs(s,coeffs,dof) == CONVDIFF_OK);
+
+	/* and a change of problem discards it */
+	EXPECT(convdiff_set_velocity(s,1.0,0.5) == CONVDIFF_OK);
+	EXPECT(convdiff_eval(s,1,&x,&y,&val) == CONVDIFF_ENOSOLUTION);
+	EXPECT(convdiff_solve(s,NULL) == CONVDIFF_OK);
+	src[CONVDIFF_SOURCE_WIDTH] = 0.15;
+	EXPECT(convdiff_set_source(s,src) == CONVDIFF_OK);
+	EXPECT(convdiff_get_coeffs(s,coeffs,dof) == CONVDIFF_ENOSOLUTION);
+	EXPECT(convdiff_solve(s,NULL) == CONVDIFF_OK);
+	EXPECT(convdiff_set_grid(s,3,1) == CONVDIFF_OK);
+	EXPECT(convdiff_eval(s,1,&x,&y,&val) == CONVDIFF_ENOSOLUTION);
+
+	free(coeffs);
+	convdiff_destroy(s);
+}
+
+typedef struct Job
+{
+	int N, K, method, n;
+	double ux, uy;
+	const double *x, *y;
+	double *val;
+	int status;
+} Job;
+
+static void *RunJob(void *arg)
+{
+	Job *job = (Job*)arg;
+	convdiff_solver *s = convdiff_create(job->N,job->K,1.0);
+	if(!s)
+	{
+		job->status = CONVDIFF_ENOMEM;
+		return NULL;
+	}
+	job->status = convdiff_set_velocity(s,job->ux,job->uy);
+	if(job->status == CONVDIFF_OK) job->status = convdiff_set_solver(s,job->method);
+	if(job->status == CONVDIFF_OK) job->status = convdiff_solve(s,NULL);
+	if(job->status == CONVDIFF_OK) job->status = convdiff_eval(s,job->n,job->x,job->y,job->val);
+	convdiff_destroy(s);
+	return NULL;
+}
+
+/* Read the x y phi lines of the driver's -probe output, skipping the rest;
+ * returns the number of points. */
+static int ReadProbes(const char *fname, double **x, double **y, double **phi)
+{
+	FILE *f = fopen(fname,"r");
+	char line[512];
+	int n = 0, cap = 0;
+	double px, py, v, dx, dy;
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s\n",fname);
+		return 0;
+	}
+	*x = *y = *phi = NULL;
+	while(fgets(line,sizeof(line),f))
+	{
+		if(sscanf(line,"%lf %lf %lf %lf %lf",&px,&py,&v,&dx,&dy) != 5) continue;
+		if(n == cap)
+		{
+			cap = cap ? 2*cap : 16;
+			*x = (double*)realloc(*x,cap*sizeof(double));
+			*y = (double*)realloc(*y,cap*sizeof(double));
+			*phi = (double*)realloc(*phi,cap*sizeof(double));
+		}
+		(*x)[n] = px;
+		(*y)[n] = py;
+		(*phi)[n] = v;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void CheckHandles(int N, int K, double ux, double uy, const char *probes)
+{
+	double *x, *y, *phi;
+	double scale = 0.0;
+	pthread_t threads[2];
+	Job jobs[2];
+	int n = ReadProbes(probes,&x,&y,&phi);
+	EXPECT(n > 0);
+	if(n == 0) return;
+	for(int k = 0; k < n; k++) scale = fmax(scale,fabs(phi[k]));
+	for(int j = 0; j < 2; j++)
+	{
+		memset(&jobs[j],0,sizeof(Job));
+		jobs[j].N = N;
+		jobs[j].K = K;
+		jobs[j].method = (j == 0 ? CONVDIFF_SOLVER_DIRECT : CONVDIFF_SOLVER_BICGSTAB);
+		jobs[j].n = n;
+		jobs[j].ux = ux;
+		jobs[j].uy = uy;
+		jobs[j].x = x;
+		jobs[j].y = y;
+		jobs[j].val = (double*)malloc(n*sizeof(double));
+		EXPECT(pthread_create(&threads[j],NULL,RunJob,&jobs[j]) == 0);
+	}
+	for(int j = 0; j < 2; j++)
+	{
+		double diff = 0.0;
+		pthread_join(threads[j],NULL);
+		EXPECT(jobs[j].status == CONVDIFF_OK);
+		if(jobs[j].status == CONVDIFF_OK)
+		{
+			for(int k = 0; k < n; k++) diff = fmax(diff,fabs(jobs[j].val[k]-phi[k]));
+			printf("C API %s handle: %d probes, difference %.1e from the driver\n",j == 0 ? "direct" : "bicgstab",n,diff);
+			EXPECT(diff <= 1e-8*scale);
+		}
+		free(jobs[j].val);
+	}
+	free(x);
+	free(y);
+	free(phi);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 6)
+	{
+		fprintf(stderr,"usage: %s N K ux uy probes\n",argv[0]);
+		return 1;
+	}
+	CheckArguments();
+	CheckHandles(atoi(argv[1]),atoi(argv[2]),atof(argv[3]),atof(argv[4]),argv[5]);
+	printf("%d C API checks failed\n",failures);
+	return failures ? 1 : 0;
+}
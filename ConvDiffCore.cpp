@@ -0,0 +1,2762 @@
+#include "ConvDiffCore.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#ifdef CONVDIFF_COUNT_ALLOCS
+#include <malloc.h>
+#include <errno.h>
+#endif
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+#ifdef CONVDIFF_COUNT_ALLOCS
+// Count every heap allocation so hot paths can be checked for heap traffic.
+// malloc and its relatives are replaced, rather than operator new, because
+// Eigen's aligned_malloc calls malloc directly; operator new reaches them
+// too. The replacements forward to the C library's own allocator.
+#ifdef __EMSCRIPTEN__
+#include <emscripten/heap.h>
+#define BUILTIN_MALLOC emscripten_builtin_malloc
+#define BUILTIN_FREE emscripten_builtin_free
+#define BUILTIN_MEMALIGN emscripten_builtin_memalign
+#else
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void __libc_free(void *p);
+extern "C" void *__libc_memalign(size_t align, size_t n);
+#define BUILTIN_MALLOC __libc_malloc
+#define BUILTIN_FREE __libc_free
+#define BUILTIN_MEMALIGN __libc_memalign
+#endif
+std::atomic<long> allocCount(0);
+extern "C"
+{
+void *malloc(size_t n)
+{
+	allocCount++;
+	return BUILTIN_MALLOC(n);
+}
+void free(void *p)
+{
+	BUILTIN_FREE(p);
+}
+void *calloc(size_t count, size_t n)
+{
+	if(n && count > (size_t)-1/n) return NULL;
+	void *p = malloc(count*n);
+	if(p) memset(p,0,count*n);
+	return p;
+}
+// the old block's size is not known here, so growing always moves it
+void *realloc(void *p, size_t n)
+{
+	if(!p) return malloc(n);
+	if(!n)
+	{
+		free(p);
+		return NULL;
+	}
+	void *q = malloc(n);
+	if(!q) return NULL;
+	memcpy(q,p,std::min(n,malloc_usable_size(p)));
+	free(p);
+	return q;
+}
+void *memalign(size_t align, size_t n)
+{
+	allocCount++;
+	return BUILTIN_MEMALIGN(align,n);
+}
+void *aligned_alloc(size_t align, size_t n)
+{
+	return memalign(align,n);
+}
+int posix_memalign(void **out, size_t align, size_t n)
+{
+	void *p = memalign(align,n);
+	if(!p) return ENOMEM;
+	*out = p;
+	return 0;
+}
+}
+#endif
+
+long AllocationCount()
+{
+#ifdef CONVDIFF_COUNT_ALLOCS
+	return allocCount;
+#else
+	return -1;
+#endif
+}
+
+double Tracer::Now()
+{
+#ifdef __EMSCRIPTEN__
+	return emscripten_get_now();
+#else
+	return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const char *Tracer::SectionName(int section)
+{
+	static const char *names[TRACE_NUMSECTIONS] = { "frame", "solve", "assembly", "preconditioner",
+		"krylov", "errorEstimate", "evaluation", "rasterization", "factorization", "substitution", "autotune", "adjoint" };
+	return names[section];
+}
+
+const char *Tracer::CounterName(int counter)
+{
+	static const char *names[COUNT_NUMCOUNTERS] = { "solves", "krylovIterations", "frames", "droppedEvents", "tunings",
+		"continuationSteps", "preconditionerReuses" };
+	return names[counter];
+}
+
+int Tracer::ThreadId()
+{
+	static std::atomic<int> next(0);
+	static thread_local int id = next++;
+	return id;
+}
+
+void Tracer::SetEnabled(bool on)
+{
+	{
+#ifdef CONVDIFF_THREADS
+		std::lock_guard<std::mutex> guard(lock);
+#endif
+		if(on && events.capacity() < maxEvents) events.reserve(maxEvents);
+	}
+	enabled.store(on,std::memory_order_relaxed);
+}
+
+void Tracer::Reset()
+{
+#ifdef CONVDIFF_THREADS
+	std::lock_guard<std::mutex> guard(lock);
+#endif
+	for(int k = 0; k < TRACE_NUMSECTIONS; k++)
+	{
+		counts[k] = 0;
+		totalMs[k] = 0.0;
+		maxMs[k] = 0.0;
+	}
+	for(int k = 0; k < COUNT_NUMCOUNTERS; k++) counters[k] = 0;
+	events.clear();
+}
+
+void Tracer::Record(int section, double start, double end)
+{
+	double ms = end-start;
+	int tid = ThreadId();
+#ifdef CONVDIFF_THREADS
+	std::lock_guard<std::mutex> guard(lock);
+#endif
+	counts[section]++;
+	totalMs[section] += ms;
+	if(ms > maxMs[section]) maxMs[section] = ms;
+	if(events.size() < maxEvents)
+	{
+		TraceEvent e = { section, tid, start, ms };
+		events.push_back(e);
+	}
+	else counters[COUNT_DROPPEDEVENTS]++;
+}
+
+void Tracer::Count(int counter, long n)
+{
+#ifdef CONVDIFF_THREADS
+	std::lock_guard<std::mutex> guard(lock);
+#endif
+	counters[counter] += n;
+}
+
+// Accumulated statistics as JSON. The returned string stays valid until the
+// next call.
+const char *Tracer::StatsJSON()
+{
+#ifdef CONVDIFF_THREADS
+	std::lock_guard<std::mutex> guard(lock);
+#endif
+	char buf[256];
+	statsJSON = "{\"sections\":{";
+	for(int k = 0; k < TRACE_NUMSECTIONS; k++)
+	{
+		snprintf(buf,sizeof(buf),"%s\"%s\":{\"count\":%ld,\"totalMs\":%.3f,\"meanMs\":%.4f,\"maxMs\":%.3f}",
+			k ? "," : "", SectionName(k), counts[k], totalMs[k], counts[k] ? totalMs[k]/counts[k] : 0.0, maxMs[k]);
+		statsJSON += buf;
+	}
+	statsJSON += "},\"counters\":{";
+	for(int k = 0; k < COUNT_NUMCOUNTERS; k++)
+	{
+		snprintf(buf,sizeof(buf),"%s\"%s\":%ld",k ? "," : "",CounterName(k),counters[k]);
+		statsJSON += buf;
+	}
+	statsJSON += "}}";
+	return statsJSON.c_str();
+}
+
+// Write the recorded events in the Chrome trace-event format.
+bool Tracer::WriteChromeTrace(const char *fname)
+{
+	FILE *f = fopen(fname,"w");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s for writing\n",fname);
+		return false;
+	}
+#ifdef CONVDIFF_THREADS
+	std::lock_guard<std::mutex> guard(lock);
+#endif
+	fprintf(f,"{\"traceEvents\":[\n");
+	for(size_t k = 0; k < events.size(); k++)
+	{
+		const TraceEvent& e = events[k];
+		fprintf(f,"%s{\"name\":\"%s\",\"cat\":\"convdiff\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}\n",
+			k ? "," : "", SectionName(e.section), e.tid, 1000.0*(e.start-origin), 1000.0*e.duration);
+	}
+	fprintf(f,"],\"displayTimeUnit\":\"ms\",\"otherData\":{");
+	for(int k = 0; k < COUNT_NUMCOUNTERS; k++) fprintf(f,"%s\"%s\":%ld",k ? "," : "",CounterName(k),counters[k]);
+	fprintf(f,"}}\n");
+	bool ok = (fclose(f) == 0);
+	if(!ok) fprintf(stderr,"error writing %s\n",fname);
+	return ok;
+}
+
+double LegendreEval(int p, double y)
+{
+	if(p == 0) return 1.0;
+	if(p == 1) return y;
+	double prev = 1.0;
+	double cur = y;
+	for(int n = 1; n < p; n++)
+	{
+		double next = ((2.0*n+1.0)*y*cur - n*prev)/(n+1.0);
+		prev = cur;
+		cur = next;
+	}
+	return cur;
+}
+
+double LegendreDerivEval(int p, double y)
+{
+	double val = 0.0;
+	for(int n = 0; n < p; n++)
+	{
+		val = (n+1.0)*LegendreEval(n,y) + y*val;
+	}
+	return val;
+}
+
+double LegendreL2Norm(int p)
+{
+	return std::pow(2.0/(2.0*p+1.0),0.5);
+}
+
+
+
+double LegendreEvalNorm(int p, double y)
+{
+	return LegendreEval(p,y) / LegendreL2Norm(p);
+}
+
+double LegendreDerivEvalNorm(int p, double y)
+{
+	return LegendreDerivEval(p,y) / LegendreL2Norm(p);
+}
+
+// n-point Gauss-Legendre rule on [-1,1], nodes in increasing order. The
+// nodes are found by Newton's method on P_n from Chebyshev-like initial
+// guesses, which converges in a handful of steps for any n.
+void GaussLegendre(int n, double *coords, double *weights)
+{
+	for(int i = 0; i < (n+1)/2; i++)
+	{
+		double x = std::cos(PI*(i+0.75)/(n+0.5));
+		double dp = 0.0;
+		for(int iter = 0; iter < 100; iter++)
+		{
+			double prev = 1.0;
+			double cur = x;
+			for(int k = 1; k < n; k++)
+			{
+				double next = ((2.0*k+1.0)*x*cur - k*prev)/(k+1.0);
+				prev = cur;
+				cur = next;
+			}
+			dp = n*(x*cur - prev)/(x*x - 1.0);
+			double dx = cur/dp;
+			x -= dx;
+			if(std::abs(dx) < 1e-16) break;
+		}
+		double w = 2.0/((1.0-x*x)*dp*dp);
+		coords[i] = -x;
+		coords[n-1-i] = x;
+		weights[i] = w;
+		weights[n-1-i] = w;
+	}
+	if(n%2) coords[n/2] = 0.0;
+}
+
+LegendreTables::LegendreTables()
+{
+	for(int K = 0; K < POLYMAX+1; K++)
+	{
+		int n = QuadraturePoints(K);
+		coords[K].resize(n);
+		weights[K].resize(n);
+		GaussLegendre(n,coords[K].data(),weights[K].data());
+	}
+	for(int p = 0; p < POLYMAX+1; p++)
+	{
+		leftVals[p] = LegendreEvalNorm(p,-1.0);
+		rightVals[p] = LegendreEvalNorm(p,1.0);
+		derivLeftVals[p] = LegendreDerivEvalNorm(p,-1.0);
+		derivRightVals[p] = LegendreDerivEvalNorm(p,1.0);
+	}
+	// the integrands have degree at most 2*POLYMAX-1, so any of the rules
+	// integrates them exactly
+	const std::vector<double>& w = weights[POLYMAX];
+	const std::vector<double>& x = coords[POLYMAX];
+	for(int p = 0; p < POLYMAX+1; p++)
+	{
+		for(int q = 0; q < POLYMAX+1; q++)
+		{
+			double deriv = 0.0;
+			double alt = 0.0;
+			for(size_t k = 0; k < w.size(); k++)
+			{
+				deriv += w[k] * LegendreDerivEvalNorm(p,x[k]) * LegendreDerivEvalNorm(q,x[k]);
+				alt += w[k] * LegendreEvalNorm(p,x[k]) * LegendreDerivEvalNorm(q,x[k]);
+			}
+			derivProducts[p][q] = deriv;
+			altProducts[p][q] = alt;
+		}
+	}
+}
+
+const LegendreTables& LegendreTables::Get()
+{
+	static const LegendreTables tables;
+	return tables;
+}
+
+void ConvDiff::UseTables()
+{
+	const LegendreTables& t = LegendreTables::Get();
+	numPoints = t.weights[K].size();
+	weights = t.weights[K].data();
+	coords = t.coords[K].data();
+	normLegendreDerivProducts = t.derivProducts;
+	normLegendreAltProducts = t.altProducts;
+	normLegendreLeftVals = t.leftVals;
+	normLegendreRightVals = t.rightVals;
+	normLegendreDerivLeftVals = t.derivLeftVals;
+	normLegendreDerivRightVals = t.derivRightVals;
+}
+
+const char *OrderingName(DofOrdering ordering)
+{
+	static const char *names[] = { "element", "mode", "morton", "hilbert" };
+	return names[ordering];
+}
+
+// Distance of (x,y) along the Hilbert curve filling an n by n grid, n a
+// power of two.
+static long HilbertIndex(int n, int x, int y)
+{
+	long d = 0;
+	for(int s = n/2; s > 0; s /= 2)
+	{
+		int rx = (x & s) > 0;
+		int ry = (y & s) > 0;
+		d += (long)s*s*((3*rx)^ry);
+		if(ry == 0)
+		{
+			if(rx == 1)
+			{
+				x = s-1-x;
+				y = s-1-y;
+			}
+			std::swap(x,y);
+		}
+	}
+	return d;
+}
+
+static long MortonIndex(int x, int y)
+{
+	long d = 0;
+	for(int b = 0; b < 16; b++) d |= (long)((x >> b) & 1) << (2*b+1) | (long)((y >> b) & 1) << (2*b);
+	return d;
+}
+
+// Build elemPos and posElem for the current ordering. The curve orderings
+// visit the elements of the smallest enclosing power-of-two grid in curve
+// order and skip those outside it; all of them start at element (0,0), so
+// the pinned unknown 0 stays its mean.
+void ConvDiff::SetupOrdering()
+{
+	nb = ((K+1)*(K+2))/2;
+	std::vector<std::pair<long,int> > keys(N*N);
+	int n = 1;
+	while(n < N) n *= 2;
+	for(int ix = 0; ix < N; ix++)
+	{
+		for(int iy = 0; iy < N; iy++)
+		{
+			long key = ix*N+iy;
+			if(ordering == ORDER_MORTON) key = MortonIndex(ix,iy);
+			else if(ordering == ORDER_HILBERT) key = HilbertIndex(n,ix,iy);
+			keys[ix*N+iy] = std::make_pair(key,ix*N+iy);
+		}
+	}
+	std::sort(keys.begin(),keys.end());
+	elemPos.resize(N*N);
+	posElem.resize(N*N);
+	for(int e = 0; e < N*N; e++)
+	{
+		posElem[e] = keys[e].second;
+		elemPos[keys[e].second] = e;
+	}
+}
+
+void ConvDiff::BuildMatA()
+{
+	double h = L/N;
+	double hbeta0 = std::pow(h,beta0);
+	// entries go where aidx() puts them; idxv, the global row, finds row 0
+	std::vector<Trip> elems;
+
+	// Diagonal blocks
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					double val = 0.0;
+					val += diffconst * std::pow(2.0/h,2) * normLegendreDerivProducts[px][qx] * (py == qy ? 1.0 : 0.0);
+					val += diffconst * std::pow(2.0/h,2) * (px == qx ? 1.0 : 0.0) * normLegendreDerivProducts[py][qy];
+					
+					// East
+					val += diffconst * (2.0/h) * (2.0/h) * (-0.5) * (py == qy ? 1.0 : 0.0)
+						* normLegendreRightVals[qx] * normLegendreDerivRightVals[px];
+					val -= (2.0/h) * (2.0/h) *(-1.0)* epsilon * 0.5 * (py == qy ? 1.0 : 0.0)
+						* normLegendreRightVals[px] * normLegendreDerivRightVals[qx];
+					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreRightVals[px]*normLegendreRightVals[qx] )
+						* (py == qy ? 1.0 : 0.0);
+					
+					// West
+					val += diffconst * (2.0/h) *(2.0/h) * (0.5) * (py == qy ? 1.0 : 0.0)
+						* normLegendreLeftVals[qx] * normLegendreDerivLeftVals[px];
+					val -= (2.0/h) *(2.0/h) * epsilon * 0.5 * (py == qy ? 1.0 : 0.0)
+						* normLegendreLeftVals[px] * normLegendreDerivLeftVals[qx];
+					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreLeftVals[qx]*normLegendreLeftVals[px] )
+						* (py == qy ? 1.0 : 0.0);
+					
+
+					// North
+					val += diffconst * (2.0/h) *(2.0/h) * (-0.5) * (px == qx ? 1.0 : 0.0)
+						* normLegendreRightVals[qy] * normLegendreDerivRightVals[py];
+					val -= (2.0/h) * (-1.0)*(2.0/h) * epsilon * 0.5 * (px == qx ? 1.0 : 0.0)
+						* normLegendreRightVals[py] * normLegendreDerivRightVals[qy];
+					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreRightVals[py]*normLegendreRightVals[qy] )
+						* (px == qx ? 1.0 : 0.0);
+					
+					// South
+					val += diffconst * (2.0/h) *(2.0/h) * (0.5) * (px == qx ? 1.0 : 0.0)
+						* normLegendreLeftVals[qy] * normLegendreDerivLeftVals[py];
+					val -= (2.0/h) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
+						* normLegendreLeftVals[py] * normLegendreDerivLeftVals[qy];
+					val += (2.0/h) * (sigma0/hbeta0) * ( normLegendreLeftVals[qy]*normLegendreLeftVals[py] )
+						* (px == qx ? 1.0 : 0.0);
+					
+					for(int ix = ex0; ix < ex1; ix++)
+					{
+						for(int iy = ey0; iy < ey1; iy++)
+						{
+							int idxv = idx(ix,iy,qx,qy);
+							int idxphi = aidx(ix,iy,px,py);
+							Trip t(aidx(ix,iy,qx,qy),idxphi,val);
+							if(idxv != 0) elems.push_back(t);
+							if(idxv == 0 && px == 0 && qx == 0)
+							{
+								Trip t1(aidx(ix,iy,qx,qy),idxphi,1.0);
+								elems.push_back(t1);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// East blocks
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					double val = 0.0;
+					val += diffconst * (2.0/h) *(2.0/h) * (-0.5) * (py == qy ? 1.0 : 0.0)
+						* normLegendreRightVals[qx] * normLegendreDerivLeftVals[px];
+					val -= (2.0/h) * epsilon *(2.0/h) * 0.5 * (py == qy ? 1.0 : 0.0)
+						* normLegendreLeftVals[px] * normLegendreDerivRightVals[qx];
+					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[px]*normLegendreRightVals[qx] )
+						* (py == qy ? 1.0 : 0.0);
+					for(int ix = ex0; ix < ex1; ix++)
+					{
+						for(int iy = ey0; iy < ey1; iy++)
+						{
+							int idxv = idx(ix,iy,qx,qy);
+							int idxphi = aidx(ix+1,iy,px,py);
+							Trip t(aidx(ix,iy,qx,qy),idxphi,val);
+							if(idxv != 0) elems.push_back(t);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// West blocks
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					double val = 0.0;
+					val += diffconst * (2.0/h) * (0.5) *(2.0/h) * (py == qy ? 1.0 : 0.0)
+						* normLegendreLeftVals[qx] * normLegendreDerivRightVals[px];
+					val -= (2.0/h) * (-1.0) * epsilon * 0.5 *(2.0/h) * (py == qy ? 1.0 : 0.0)
+						* normLegendreRightVals[px] * normLegendreDerivLeftVals[qx];
+					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[qx]*normLegendreRightVals[px] )
+						* (py == qy ? 1.0 : 0.0);
+					for(int ix = ex0; ix < ex1; ix++)
+					{
+						for(int iy = ey0; iy < ey1; iy++)
+						{
+							int idxv = idx(ix,iy,qx,qy);
+							int idxphi = aidx(ix-1,iy,px,py);
+							Trip t(aidx(ix,iy,qx,qy),idxphi,val);
+							if(idxv != 0) elems.push_back(t);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// North blocks
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					double val = 0.0;
+					val += diffconst * (2.0/h) * (-0.5) *(2.0/h) * (px == qx ? 1.0 : 0.0)
+						* normLegendreRightVals[qy] * normLegendreDerivLeftVals[py];
+					val -= (2.0/h) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
+						* normLegendreLeftVals[py] * normLegendreDerivRightVals[qy];
+					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[py]*normLegendreRightVals[qy] )
+						* (px == qx ? 1.0 : 0.0);
+					for(int ix = ex0; ix < ex1; ix++)
+					{
+						for(int iy = ey0; iy < ey1; iy++)
+						{
+							int idxv = idx(ix,iy,qx,qy);
+							int idxphi = aidx(ix,iy+1,px,py);
+							Trip t(aidx(ix,iy,qx,qy),idxphi,val);
+							if(idxv != 0) elems.push_back(t);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// South blocks
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					double val = 0.0;
+					val += diffconst * (2.0/h) * (0.5) *(2.0/h) * (px == qx ? 1.0 : 0.0)
+						* normLegendreLeftVals[qy] * normLegendreDerivRightVals[py];
+					val -= (2.0/h) * (-1.0) * epsilon * 0.5 *(2.0/h) * (px == qx ? 1.0 : 0.0)
+						* normLegendreRightVals[py] * normLegendreDerivLeftVals[qy];
+					val += (2.0/h) * (-1.0 * sigma0/hbeta0) * ( normLegendreLeftVals[qy]*normLegendreRightVals[py] )
+						* (px == qx ? 1.0 : 0.0);
+					for(int ix = ex0; ix < ex1; ix++)
+					{
+						for(int iy = ey0; iy < ey1; iy++)
+						{
+							int idxv = idx(ix,iy,qx,qy);
+							int idxphi = aidx(ix,iy-1,px,py);
+							Trip t(aidx(ix,iy,qx,qy),idxphi,val);
+							if(idxv != 0) elems.push_back(t);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	A.setFromTriplets(elems.begin(),elems.end());
+}
+
+
+
+// Neighbours a convection block couples an element to, and their offsets.
+enum { CONV_SELF, CONV_WEST, CONV_EAST, CONV_SOUTH, CONV_NORTH, CONV_NUMBLOCKS };
+static const int convShift[CONV_NUMBLOCKS][2] = { {0,0}, {-1,0}, {1,0}, {0,-1}, {0,1} };
+
+// The 1d tables of the convection operators, each term rounded as it has
+// always been when the operators were assembled in full.
+void ConvDiff::BuildConvection()
+{
+	double h = L/N;
+	int n = K+1;
+	convVol.resize(n*n);
+	convOutP.resize(n*n);
+	convOutM.resize(n*n);
+	convInP.resize(n*n);
+	convInM.resize(n*n);
+	for(int p = 0; p < n; p++)
+	{
+		for(int q = 0; q < n; q++)
+		{
+			convVol[p*n+q] = -((2.0/h)*normLegendreAltProducts[p][q]);
+			convOutP[p*n+q] = (2.0/h)*normLegendreRightVals[p]*normLegendreRightVals[q];
+			convOutM[p*n+q] = -((2.0/h)*normLegendreLeftVals[q]*normLegendreLeftVals[p]);
+			convInP[p*n+q] = -((2.0/h)*normLegendreLeftVals[q]*normLegendreRightVals[p]);
+			convInM[p*n+q] = (2.0/h)*normLegendreLeftVals[p]*normLegendreRightVals[q];
+		}
+	}
+}
+
+// The entries of row mode (qx,qy) of cxp*UXP + cxm*UXM + cyp*UYP + cym*UYM,
+// the same in every element: for each, the neighbour block (CONV_*) and
+// the mode of its column, and its value. The x terms come first, each
+// operator's in turn. Returns the count, at most 8*(K+1).
+int ConvDiff::ConvectionRow(int qx, int qy, double cxp, double cxm, double cyp, double cym, int *nbr, int *mode, double *val)
+{
+	int n = K+1;
+	int count = 0;
+	for(int dir = 0; dir < 2; dir++)
+	{
+		// along x the column modes are (p,qy); along y, (qx,p)
+		double cp = (dir == 0 ? cxp : cyp);
+		double cm = (dir == 0 ? cxm : cym);
+		int q = (dir == 0 ? qx : qy);
+		int other = (dir == 0 ? qy : qx);
+		for(int sign = 0; sign < 2; sign++)
+		{
+			double c = (sign == 0 ? cp : cm);
+			if(c == 0.0) continue;
+			const std::vector<double>& out = (sign == 0 ? convOutP : convOutM);
+			const std::vector<double>& in = (sign == 0 ? convInP : convInM);
+			int upwind = (dir == 0 ? (sign == 0 ? CONV_WEST : CONV_EAST) : (sign == 0 ? CONV_SOUTH : CONV_NORTH));
+			for(int p = 0; p < n-other; p++)
+			{
+				int m = (dir == 0 ? ((p+qy)*(p+qy+1))/2 + p : ((qx+p)*(qx+p+1))/2 + qx);
+				nbr[count] = CONV_SELF;
+				mode[count] = m;
+				val[count++] = c*(convVol[p*n+q]+out[p*n+q]);
+				nbr[count] = upwind;
+				mode[count] = m;
+				val[count++] = c*in[p*n+q];
+			}
+		}
+	}
+	return count;
+}
+
+// y = (cxp UXP + cxm UXM + cyp UYP + cym UYM) x, from the 1d tables.
+void ConvDiff::ApplyConvection(double cxp, double cxm, double cyp, double cym, const Vec& x, Vec& y)
+{
+	const int *outer = ws.R.outerIndexPtr();
+	const int *inner = ws.R.innerIndexPtr();
+	int nbr[8*(POLYMAX+1)], mode[8*(POLYMAX+1)];
+	double val[8*(POLYMAX+1)];
+	y.setZero();
+	for(int qx = 0; qx < K+1; qx++)
+	{
+		for(int qy = 0; qy < K+1-qx; qy++)
+		{
+			int n = ConvectionRow(qx,qy,cxp,cxm,cyp,cym,nbr,mode,val);
+			for(int ix = ex0; ix < ex1; ix++)
+			{
+				for(int iy = ey0; iy < ey1; iy++)
+				{
+					int i = idx(ix,iy,qx,qy);
+					if(i == 0) continue;
+					const int *off = &ws.convOffset[(ix*N+iy)*CONV_NUMBLOCKS*nb];
+					const int *cols = inner+outer[i];
+					double sum = 0.0;
+					for(int k = 0; k < n; k++) sum += val[k]*x(cols[off[nbr[k]*nb+mode[k]]]);
+					y(i) = sum;
+				}
+			}
+		}
+	}
+}
+
+// R = A + U(ux,uy) as a new matrix, built independently of the workspace
+// values Solve() uses; numbered locally on a partial element range.
+void ConvDiff::AssembleSystem(SpMat& R)
+{
+	int nbr[8*(POLYMAX+1)], mode[8*(POLYMAX+1)];
+	double val[8*(POLYMAX+1)];
+	// the column modes by their index within an element, so the columns can
+	// be numbered without the solve workspace, which a rank of the
+	// distributed solver does not set up
+	std::vector<int> modeX(nb), modeY(nb);
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			modeX[((px+py)*(px+py+1))/2+px] = px;
+			modeY[((px+py)*(px+py+1))/2+px] = py;
+		}
+	}
+	std::vector<Trip> elems;
+	for(int qx = 0; qx < K+1; qx++)
+	{
+		for(int qy = 0; qy < K+1-qx; qy++)
+		{
+			int n = ConvectionRow(qx,qy,ux>0.0?ux:0.0,ux<0.0?ux:0.0,uy>0.0?uy:0.0,uy<0.0?uy:0.0,nbr,mode,val);
+			for(int ix = ex0; ix < ex1; ix++)
+			{
+				for(int iy = ey0; iy < ey1; iy++)
+				{
+					if(idx(ix,iy,qx,qy) == 0) continue;
+					int i = aidx(ix,iy,qx,qy);
+					for(int k = 0; k < n; k++)
+					{
+						int col = aidx(ix+convShift[nbr[k]][0],iy+convShift[nbr[k]][1],modeX[mode[k]],modeY[mode[k]]);
+						elems.push_back(Trip(i,col,val[k]));
+					}
+				}
+			}
+		}
+	}
+	SpMat U(AssemblySize(),AssemblySize());
+	U.setFromTriplets(elems.begin(),elems.end());
+	R = A+U;
+	R.makeCompressed();
+}
+
+double PeriodicGaussian(double x, double y, double r)
+{
+	double val = 0.0;
+	for(int i = -2; i <= 2; i++)
+	{
+		for(int j = -2; j <= 2; j++)
+		{
+			val += std::exp(-0.5*std::pow((x-1.0*i)/r,2)-0.5*std::pow((y-1.0*j)/r,2));
+		}
+	}
+	return val;
+}
+
+double EvalRHS(const SourceParams& src, double x, double y)
+{ 
+	return PeriodicGaussian(x-src.x0,y-src.y0,src.width) - PeriodicGaussian(x-src.x1,y-src.y1,src.width);
+}
+
+// Derivatives of EvalRHS with respect to each SourceParam.
+void EvalRHSGrad(const SourceParams& src, double x, double y, double *grad)
+{
+	const double cx[2] = { src.x0, src.x1 };
+	const double cy[2] = { src.y0, src.y1 };
+	double r = src.width;
+	grad[SOURCE_WIDTH] = 0.0;
+	for(int g = 0; g < 2; g++)
+	{
+		double sign = (g == 0 ? 1.0 : -1.0);
+		double dx = 0.0, dy = 0.0, dr = 0.0;
+		for(int i = -2; i <= 2; i++)
+		{
+			for(int j = -2; j <= 2; j++)
+			{
+				double px = x-cx[g]-1.0*i;
+				double py = y-cy[g]-1.0*j;
+				double e = std::exp(-0.5*(px*px+py*py)/(r*r));
+				dx += e*px;
+				dy += e*py;
+				dr += e*(px*px+py*py);
+			}
+		}
+		grad[2*g] = sign*dx/(r*r);
+		grad[2*g+1] = sign*dy/(r*r);
+		grad[SOURCE_WIDTH] += sign*dr/(r*r*r);
+	}
+}
+
+void ConvDiff::BuildRHS()
+{
+	double h = L/N;
+	for(int ix = ex0; ix < ex1; ix++)
+	{
+		for(int iy = ey0; iy < ey1; iy++)
+		{
+			double xc = (ix+0.5)*h;
+			double yc = (iy+0.5)*h;
+			for(int px = 0; px < K+1; px++)
+			{
+				for(int py = 0; py < K+1-px; py++)
+				{
+					double val = 0.0;
+					for(int j = 0; j < numPoints; j++)
+					{
+						for(int k = 0; k < numPoints; k++)
+						{
+							val += weights[j]*weights[k]
+								* LegendreEvalNorm(px,coords[j])
+								* LegendreEvalNorm(py,coords[k])
+								* EvalRHS(source,(xc+coords[j]*(h/2.0))/L, (yc+coords[k]*(h/2.0))/L);
+						}
+					}
+					rhs(aidx(ix,iy,px,py)) = val;
+				}
+			}
+		}
+	}
+	// unknown 0 is the first of element (0,0) in either numbering
+	if(ex0 > 0 || ey0 > 0) return;
+	rhsPinned = rhs(0);
+	rhs(0) = 0.0;
+}
+
+// d(rhs)/d(source) by the same quadrature as BuildRHS, one column per
+// SourceParam.
+void ConvDiff::BuildRHSGrad()
+{
+	rhsGrad.setZero(dof,SOURCE_NUMPARAMS);
+	double h = L/N;
+	std::vector<double> grads(numPoints*numPoints*SOURCE_NUMPARAMS);
+	for(int ix = ex0; ix < ex1; ix++)
+	{
+		for(int iy = ey0; iy < ey1; iy++)
+		{
+			double xc = (ix+0.5)*h;
+			double yc = (iy+0.5)*h;
+			for(int j = 0; j < numPoints; j++)
+			{
+				for(int k = 0; k < numPoints; k++)
+				{
+					EvalRHSGrad(source,(xc+coords[j]*(h/2.0))/L,(yc+coords[k]*(h/2.0))/L,&grads[(j*numPoints+k)*SOURCE_NUMPARAMS]);
+				}
+			}
+			for(int px = 0; px < K+1; px++)
+			{
+				for(int py = 0; py < K+1-px; py++)
+				{
+					int row = idx(ix,iy,px,py);
+					for(int j = 0; j < numPoints; j++)
+					{
+						for(int k = 0; k < numPoints; k++)
+						{
+							double w = weights[j]*weights[k]
+								* LegendreEvalNorm(px,coords[j])
+								* LegendreEvalNorm(py,coords[k]);
+							for(int q = 0; q < SOURCE_NUMPARAMS; q++) rhsGrad(row,q) += w*grads[(j*numPoints+k)*SOURCE_NUMPARAMS+q];
+						}
+					}
+				}
+			}
+		}
+	}
+	rhsGrad.row(0).setZero();
+	rhsGradValid = true;
+}
+
+// Positions of the entries of M within the row-major pattern of R.
+static void PatternPositions(const SpMat& M, const RowSpMat& R, std::vector<int>& pos)
+{
+	pos.resize(M.nonZeros());
+	const int *outer = R.outerIndexPtr();
+	const int *inner = R.innerIndexPtr();
+	int k = 0;
+	for(int j = 0; j < M.outerSize(); j++)
+	{
+		for(SpMat::InnerIterator it(M,j); it; ++it)
+		{
+			const int *found = std::lower_bound(inner+outer[it.row()],inner+outer[it.row()+1],j);
+			pos[k++] = found-inner;
+		}
+	}
+}
+
+void ConvDiff::SetupWorkspace()
+{
+	A.makeCompressed();
+	// A has full blocks for every element and its four neighbours, so its
+	// pattern holds the convection operators too
+	ws.R = A;
+	ws.R.makeCompressed();
+	PatternPositions(A,ws.R,ws.posA);
+	// where the column for each neighbour and mode falls in the rows of each
+	// element; every row but the pinned row 0 has the same columns
+	const int *outer = ws.R.outerIndexPtr();
+	ws.convOffset.assign(N*N*CONV_NUMBLOCKS*nb,-1);
+	for(int ix = ex0; ix < ex1; ix++)
+	{
+		for(int iy = ey0; iy < ey1; iy++)
+		{
+			int i = idx(ix,iy,K,0);
+			if(i == 0) continue;
+			const int *inner = ws.R.innerIndexPtr()+outer[i];
+			int *off = &ws.convOffset[(ix*N+iy)*CONV_NUMBLOCKS*nb];
+			for(int b = 0; b < CONV_NUMBLOCKS; b++)
+			{
+				for(int px = 0; px < K+1; px++)
+				{
+					for(int py = 0; py < K+1-px; py++)
+					{
+						int col = idx(ix+convShift[b][0],iy+convShift[b][1],px,py);
+						off[b*nb+((px+py)*(px+py+1))/2+px] = std::lower_bound(inner,inner+(outer[i+1]-outer[i]),col)-inner;
+					}
+				}
+			}
+		}
+	}
+	ws.LU = ws.R;
+	ws.diagPos.assign(dof,-1);
+	for(int i = 0; i < dof; i++)
+	{
+		for(int k = ws.LU.outerIndexPtr()[i]; k < ws.LU.outerIndexPtr()[i+1]; k++)
+		{
+			if(ws.LU.innerIndexPtr()[k] == i) ws.diagPos[i] = k;
+		}
+	}
+	ws.marker.assign(dof,-1);
+	ws.gather.resize(CONV_NUMBLOCKS*nb);
+	ws.r.resize(dof);
+	ws.r0.resize(dof);
+	ws.p.resize(dof);
+	ws.v.resize(dof);
+	ws.s.resize(dof);
+	ws.t.resize(dof);
+	ws.y.resize(dof);
+	ws.z.resize(dof);
+	ws.recycled = 0;
+	ws.C = ws.R;
+	ws.C.makeCompressed();
+	ws.colPos.resize(ws.R.nonZeros());
+	for(int i = 0; i < dof; i++)
+	{
+		for(int k = ws.R.outerIndexPtr()[i]; k < ws.R.outerIndexPtr()[i+1]; k++)
+		{
+			int j = ws.R.innerIndexPtr()[k];
+			const int *inner = ws.C.innerIndexPtr();
+			ws.colPos[k] = std::lower_bound(inner+ws.C.outerIndexPtr()[j],inner+ws.C.outerIndexPtr()[j+1],i)-inner;
+		}
+	}
+	ws.analyzed = false;
+	ws.factored = false;
+	ws.luValid = false;
+}
+
+// Write the values of R = A + U(ux,uy) into the preallocated pattern.
+void ConvDiff::FillSystem()
+{
+	TRACE_SCOPE(TRACE_ASSEMBLY);
+	double *vals = ws.R.valuePtr();
+	std::fill(vals,vals+ws.R.nonZeros(),0.0);
+	const double cxp = ux>0.0?ux:0.0, cxm = ux<0.0?ux:0.0;
+	const double cyp = uy>0.0?uy:0.0, cym = uy<0.0?uy:0.0;
+	for(int k = 0; k < A.nonZeros(); k++) vals[ws.posA[k]] += A.valuePtr()[k];
+	if(cxp == 0.0 && cxm == 0.0 && cyp == 0.0 && cym == 0.0) return;
+	const int *outer = ws.R.outerIndexPtr();
+	int nbr[8*(POLYMAX+1)], mode[8*(POLYMAX+1)];
+	double val[8*(POLYMAX+1)];
+	for(int qx = 0; qx < K+1; qx++)
+	{
+		for(int qy = 0; qy < K+1-qx; qy++)
+		{
+			int n = ConvectionRow(qx,qy,cxp,cxm,cyp,cym,nbr,mode,val);
+			for(int ix = ex0; ix < ex1; ix++)
+			{
+				for(int iy = ey0; iy < ey1; iy++)
+				{
+					int i = idx(ix,iy,qx,qy);
+					if(i == 0) continue;
+					const int *off = &ws.convOffset[(ix*N+iy)*CONV_NUMBLOCKS*nb];
+					double *row = vals+outer[i];
+					for(int k = 0; k < n; k++) row[off[nbr[k]*nb+mode[k]]] += val[k];
+				}
+			}
+		}
+	}
+}
+
+// Incomplete LU factorization of R with no fill, in place in ws.LU: unit
+// lower triangle below the diagonal, upper triangle on and above it.
+void ConvDiff::FactorILU0()
+{
+	TRACE_SCOPE(TRACE_PRECOND);
+	std::copy(ws.R.valuePtr(),ws.R.valuePtr()+ws.R.nonZeros(),ws.LU.valuePtr());
+	const int *outer = ws.LU.outerIndexPtr();
+	const int *inner = ws.LU.innerIndexPtr();
+	double *vals = ws.LU.valuePtr();
+	for(int i = 0; i < dof; i++)
+	{
+		for(int k = outer[i]; k < outer[i+1]; k++) ws.marker[inner[k]] = k;
+		for(int k = outer[i]; k < ws.diagPos[i]; k++)
+		{
+			int c = inner[k];
+			vals[k] /= vals[ws.diagPos[c]];
+			for(int m = ws.diagPos[c]+1; m < outer[c+1]; m++)
+			{
+				int at = ws.marker[inner[m]];
+				if(at >= 0) vals[at] -= vals[k]*vals[m];
+			}
+		}
+		for(int k = outer[i]; k < outer[i+1]; k++) ws.marker[inner[k]] = -1;
+	}
+	ws.luValid = true;
+	ws.luUx = ux;
+	ws.luUy = uy;
+}
+
+void ConvDiff::ApplyILU0(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x)
+{
+	const int *outer = ws.LU.outerIndexPtr();
+	const int *inner = ws.LU.innerIndexPtr();
+	const double *vals = ws.LU.valuePtr();
+	for(int i = 0; i < dof; i++)
+	{
+		double sum = b(i);
+		for(int k = outer[i]; k < ws.diagPos[i]; k++) sum -= vals[k]*x(inner[k]);
+		x(i) = sum;
+	}
+	for(int i = dof-1; i >= 0; i--)
+	{
+		double sum = x(i);
+		for(int k = ws.diagPos[i]+1; k < outer[i+1]; k++) sum -= vals[k]*x(inner[k]);
+		x(i) = sum/vals[ws.diagPos[i]];
+	}
+}
+
+// The same factors applied to R^T: U^T is solved forwards and L^T
+// backwards, both by columns of the row-major storage.
+void ConvDiff::ApplyILU0Transposed(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x)
+{
+	const int *outer = ws.LU.outerIndexPtr();
+	const int *inner = ws.LU.innerIndexPtr();
+	const double *vals = ws.LU.valuePtr();
+	x = b;
+	for(int i = 0; i < dof; i++)
+	{
+		x(i) /= vals[ws.diagPos[i]];
+		for(int k = ws.diagPos[i]+1; k < outer[i+1]; k++) x(inner[k]) -= vals[k]*x(i);
+	}
+	for(int i = dof-1; i >= 0; i--)
+	{
+		for(int k = outer[i]; k < ws.diagPos[i]; k++) x(inner[k]) -= vals[k]*x(i);
+	}
+}
+
+const char *SolverName(SolverMethod method)
+{
+	static const char *names[] = { "bicgstab", "direct", "gmres", "idrs", "auto", "gcrodr" };
+	return names[method];
+}
+
+const char *PreconditionerName(Preconditioner precond)
+{
+	static const char *names[] = { "ilu0", "jacobi", "none" };
+	return names[precond];
+}
+
+void ConvDiff::SetupPrecond()
+{
+	if(precond == PRECOND_ILU0) FactorILU0();
+}
+
+void ConvDiff::ApplyPrecond(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x)
+{
+	if(precond == PRECOND_ILU0)
+	{
+		if(transposed) ApplyILU0Transposed(b,x);
+		else ApplyILU0(b,x);
+	}
+	else if(precond == PRECOND_JACOBI)
+	{
+		const double *vals = ws.R.valuePtr();
+		for(int i = 0; i < dof; i++) x(i) = b(i)/vals[ws.diagPos[i]];
+	}
+	else x = b;
+}
+
+#ifdef __wasm_simd128__
+// Dot product of n consecutive values, summed in four lanes.
+static inline double RowDot(const double *v, const double *x, int n)
+{
+	v128_t acc0 = wasm_f64x2_splat(0.0);
+	v128_t acc1 = wasm_f64x2_splat(0.0);
+	int k = 0;
+	for(; k+4 <= n; k += 4)
+	{
+		acc0 = wasm_f64x2_add(acc0,wasm_f64x2_mul(wasm_v128_load(v+k),wasm_v128_load(x+k)));
+		acc1 = wasm_f64x2_add(acc1,wasm_f64x2_mul(wasm_v128_load(v+k+2),wasm_v128_load(x+k+2)));
+	}
+	acc0 = wasm_f64x2_add(acc0,acc1);
+	double sum = wasm_f64x2_extract_lane(acc0,0)+wasm_f64x2_extract_lane(acc0,1);
+	for(; k < n; k++) sum += v[k]*x[k];
+	return sum;
+}
+#else
+static inline double RowDot(const double *v, const double *x, int n)
+{
+	double sum = 0.0;
+	for(int k = 0; k < n; k++) sum += v[k]*x[k];
+	return sum;
+}
+#endif
+
+// y = R x (R^T x when transposed). Eigen has no wasm SIMD kernels, so that
+// build uses GatherMatVec(); it rounds differently from the scalar product
+// used natively.
+void ConvDiff::MatVec(const Vec& x, Vec& y)
+{
+	if(transposed) y.noalias() = ws.R.transpose()*x;
+#ifdef __wasm_simd128__
+	else GatherMatVec(x,y);
+#else
+	else y.noalias() = ws.R*x;
+#endif
+}
+
+// y = R x over the full element range: every row of an element but the
+// pinned row 0 has the same columns, so x is gathered once per element and
+// each of its rows becomes a dot product of consecutive values.
+void ConvDiff::GatherMatVec(const Vec& x, Vec& y)
+{
+	const int *outer = ws.R.outerIndexPtr();
+	const int *inner = ws.R.innerIndexPtr();
+	const double *vals = ws.R.valuePtr();
+	double *gather = ws.gather.data();
+	for(int pos = 0; pos < N*N; pos++)
+	{
+		int ix = posElem[pos]/N, iy = posElem[pos]%N;
+		// a row with the element's columns, unless its only row is row 0
+		int ref = idx(ix,iy,K,0);
+		int n = (ref == 0 ? 0 : outer[ref+1]-outer[ref]);
+		for(int k = 0; k < n; k++) gather[k] = x(inner[outer[ref]+k]);
+		for(int qx = 0; qx < K+1; qx++)
+		{
+			for(int qy = 0; qy < K+1-qx; qy++)
+			{
+				int i = idx(ix,iy,qx,qy);
+				if(i == 0)
+				{
+					double sum = 0.0;
+					for(int k = outer[0]; k < outer[1]; k++) sum += vals[k]*x(inner[k]);
+					y(0) = sum;
+				}
+				else y(i) = RowDot(vals+outer[i],gather,n);
+			}
+		}
+	}
+}
+
+void ConvDiff::AnalyzeDirect()
+{
+	if(ws.analyzed) return;
+	TRACE_SCOPE(TRACE_FACTOR);
+	ws.direct.analyzePattern(ws.C);
+	ws.analyzed = true;
+	ws.factored = false;
+}
+
+// Sparse LU of R, unless it is already factored at this velocity. Returns
+// false if R could not be factored.
+bool ConvDiff::FactorDirect()
+{
+	AnalyzeDirect();
+	if(!ws.factored || ux != ws.factoredUx || uy != ws.factoredUy)
+	{
+		TRACE_SCOPE(TRACE_FACTOR);
+		double *vals = ws.C.valuePtr();
+		for(size_t k = 0; k < ws.colPos.size(); k++) vals[ws.colPos[k]] = ws.R.valuePtr()[k];
+		ws.direct.factorize(ws.C);
+		ws.factored = (ws.direct.info() == Eigen::Success);
+		ws.factoredUx = ux;
+		ws.factoredUy = uy;
+	}
+	return ws.factored;
+}
+
+// Solve R phi = rhs with sparse LU. Returns false if R could not be
+// factored, in which case the caller falls back to the iterative solver.
+bool ConvDiff::SolveDirect()
+{
+	if(!FactorDirect()) return false;
+	TRACE_SCOPE(TRACE_SUBSTITUTION);
+	phi = ws.direct.solve(rhs);
+	return true;
+}
+
+// Right-preconditioned BiCGSTAB on R x = b (R^T x = b when transposed)
+// starting from x, using only the workspace vectors. Returns the number of
+// iterations taken. A breakdown (r0.v = 0, or no w) restarts the shadow
+// residual; one right after a restart stops early with x unconverged, for
+// the caller to fall back.
+int ConvDiff::BiCGSTAB(const Vec& b, Vec& x, double tol, int maxIter)
+{
+	TRACE_SCOPE(TRACE_KRYLOV);
+	Vec& r = ws.r;
+	Vec& r0 = ws.r0;
+	Vec& p = ws.p;
+	Vec& v = ws.v;
+	Vec& s = ws.s;
+	Vec& t = ws.t;
+	Vec& y = ws.y;
+	Vec& z = ws.z;
+	MatVec(x,r);
+	r = b - r;
+	r0 = r;
+	double bnorm = b.norm();
+	if(bnorm == 0.0) bnorm = 1.0;
+	double rho = 1.0, alpha = 1.0, w = 1.0;
+	p.setZero();
+	v.setZero();
+	int iter = 0;
+	bool restart = false;
+	while(r.norm() > tol*bnorm && iter < maxIter)
+	{
+		double rhoNew = r0.dot(r);
+		bool fresh = (iter == 0);
+		if(restart || std::abs(rhoNew) < 1e-30*bnorm*bnorm)
+		{
+			// r0 became orthogonal to r, or the last step broke down:
+			// restart the shadow residual
+			r0 = r;
+			rhoNew = r0.dot(r);
+			p.setZero();
+			v.setZero();
+			rho = alpha = w = 1.0;
+			fresh = true;
+			restart = false;
+		}
+		double beta = (rhoNew/rho)*(alpha/w);
+		rho = rhoNew;
+		p = r + beta*(p - w*v);
+		ApplyPrecond(p,y);
+		MatVec(y,v);
+		double r0v = r0.dot(v);
+		if(r0v == 0.0)
+		{
+			if(fresh) break;
+			restart = true;
+			continue;
+		}
+		alpha = rho/r0v;
+		s = r - alpha*v;
+		ApplyPrecond(s,z);
+		MatVec(z,t);
+		double tt = t.dot(t);
+		w = tt > 0.0 ? t.dot(s)/tt : 0.0;
+		x += alpha*y + w*z;
+		r = s - w*t;
+		restart = (w == 0.0);
+		iter++;
+	}
+	TRACE_COUNT(COUNT_KRYLOVITERATIONS,iter);
+	return iter;
+}
+
+// Right-preconditioned restarted GMRES(m), modified Gram-Schmidt with Givens
+// rotations. Returns the number of iterations (one matrix product each).
+int ConvDiff::GMRES(const Vec& b, Vec& x, double tol, int maxIter, int m)
+{
+	TRACE_SCOPE(TRACE_KRYLOV);
+	m = std::max(1,std::min(m,dof));
+	if(ws.V.rows() != dof || ws.V.cols() != m+1)
+	{
+		ws.V.resize(dof,m+1);
+		ws.H.resize(m+1,m);
+		ws.cs.resize(m);
+		ws.sn.resize(m);
+		ws.g.resize(m+1);
+		ws.h.resize(m);
+	}
+	Vec& r = ws.r;
+	Vec& w = ws.t;
+	Vec& y = ws.y;
+	Vec& s = ws.s;
+	Vec& z = ws.z;
+	double bnorm = b.norm();
+	if(bnorm == 0.0) bnorm = 1.0;
+	MatVec(x,r);
+	r = b - r;
+	double beta = r.norm();
+	int iter = 0;
+	int stalled = 0;
+	while(beta > tol*bnorm && iter < maxIter)
+	{
+		ws.V.col(0) = r/beta;
+		ws.g.setZero();
+		ws.g(0) = beta;
+		int j = 0;
+		bool done = false;
+		while(j < m && iter < maxIter && !done)
+		{
+			ApplyPrecond(ws.V.col(j),y);
+			MatVec(y,w);
+			for(int i = 0; i <= j; i++)
+			{
+				ws.H(i,j) = ws.V.col(i).dot(w);
+				w -= ws.H(i,j)*ws.V.col(i);
+			}
+			double hnext = w.norm();
+			if(hnext > 0.0) ws.V.col(j+1) = w/hnext;
+			for(int i = 0; i < j; i++)
+			{
+				double hij = ws.H(i,j);
+				ws.H(i,j) = ws.cs(i)*hij + ws.sn(i)*ws.H(i+1,j);
+				ws.H(i+1,j) = -ws.sn(i)*hij + ws.cs(i)*ws.H(i+1,j);
+			}
+			double d = std::hypot(ws.H(j,j),hnext);
+			ws.cs(j) = d > 0.0 ? ws.H(j,j)/d : 1.0;
+			ws.sn(j) = d > 0.0 ? hnext/d : 0.0;
+			ws.H(j,j) = d;
+			ws.g(j+1) = -ws.sn(j)*ws.g(j);
+			ws.g(j) *= ws.cs(j);
+			j++;
+			iter++;
+			done = (std::abs(ws.g(j)) <= tol*bnorm || hnext == 0.0);
+		}
+		// x += M^-1 V y with H y = g upper triangular
+		for(int i = j-1; i >= 0; i--)
+		{
+			double sum = ws.g(i);
+			for(int k = i+1; k < j; k++) sum -= ws.H(i,k)*ws.h(k);
+			ws.h(i) = ws.H(i,i) != 0.0 ? sum/ws.H(i,i) : 0.0;
+		}
+		s.setZero();
+		for(int i = 0; i < j; i++) s += ws.h(i)*ws.V.col(i);
+		ApplyPrecond(s,z);
+		x += z;
+		MatVec(x,r);
+		r = b - r;
+		beta = r.norm();
+		// the recurrence claims convergence but rounding keeps the true
+		// residual above tol: give up after a couple of retries
+		if(done && beta > tol*bnorm && ++stalled > 2) break;
+	}
+	TRACE_COUNT(COUNT_KRYLOVITERATIONS,iter);
+	return iter;
+}
+
+// Orthonormalize the first kc columns of Ck by modified Gram-Schmidt (two
+// passes), applying the same operations to Zk and Uk so Ck = R Zk still
+// holds; nearly dependent columns are dropped. Returns how many remain.
+int ConvDiff::OrthonormalizeRecycled(int kc)
+{
+	int kept = 0;
+	for(int i = 0; i < kc; i++)
+	{
+		if(kept != i)
+		{
+			ws.Ck.col(kept) = ws.Ck.col(i);
+			ws.Zk.col(kept) = ws.Zk.col(i);
+			ws.Uk.col(kept) = ws.Uk.col(i);
+		}
+		double norm0 = ws.Ck.col(kept).norm();
+		for(int pass = 0; pass < 2; pass++)
+		{
+			for(int l = 0; l < kept; l++)
+			{
+				double c = ws.Ck.col(l).dot(ws.Ck.col(kept));
+				ws.Ck.col(kept) -= c*ws.Ck.col(l);
+				ws.Zk.col(kept) -= c*ws.Zk.col(l);
+				ws.Uk.col(kept) -= c*ws.Uk.col(l);
+			}
+		}
+		double norm = ws.Ck.col(kept).norm();
+		if(!(norm > 1e-10*norm0)) continue;
+		ws.Ck.col(kept) /= norm;
+		ws.Zk.col(kept) /= norm;
+		ws.Uk.col(kept) /= norm;
+		kept++;
+	}
+	return kept;
+}
+
+// Replace the recycled subspace after a cycle of kc recycled and j Arnoldi
+// directions by the k harmonic Ritz vectors of R M^-1 with the smallest
+// harmonic Ritz values, the directions restarted GMRES is slowest on. With
+// What = [Uk V_j] (M times the search directions [Zk Y_j]) and Vhat =
+// [Ck V_j+1], R [Zk Y_j] = Vhat Gk, and the vectors What p solve
+// Gk^T Gk p = theta Gk^T Vhat^T What p. The new Ck is Vhat Q and Zk, Uk are
+// [Zk Y_j] P R^-1, [Uk V_j] P R^-1 for Gk P = Q R. Returns the new recycled
+// dimension; the subspace is left as it was if the problem is degenerate.
+int ConvDiff::UpdateRecycled(int kc, int j, int k)
+{
+	int n = kc+j;
+	if(j == 0) return kc;
+	k = std::min(k,n);
+	Mat G = ws.Gk.topLeftCorner(n+1,n);
+	Mat F = Mat::Zero(n+1,n);
+	if(kc > 0)
+	{
+		F.topLeftCorner(kc,kc).noalias() = ws.Ck.leftCols(kc).transpose()*ws.Uk.leftCols(kc);
+		F.block(kc,0,j+1,kc).noalias() = ws.V.leftCols(j+1).transpose()*ws.Uk.leftCols(kc);
+	}
+	for(int a = 0; a < j; a++) F(kc+a,kc+a) = 1.0;
+	Eigen::FullPivLU<Mat> lu(G.transpose()*F);
+	if(!lu.isInvertible()) return kc;
+	Eigen::EigenSolver<Mat> es(lu.solve(G.transpose()*G));
+	if(es.info() != Eigen::Success) return kc;
+	std::vector<int> order(n);
+	for(int i = 0; i < n; i++) order[i] = i;
+	std::sort(order.begin(),order.end(),[&](int a, int b) { return std::abs(es.eigenvalues()(a)) < std::abs(es.eigenvalues()(b)); });
+	// a complex pair contributes the real and imaginary parts of its vector
+	Mat P(n,k);
+	for(int i = 0; i < k; i++)
+	{
+		int e = order[i];
+		if(es.eigenvalues()(e).imag() < 0.0) P.col(i) = es.eigenvectors().col(e).imag();
+		else P.col(i) = es.eigenvectors().col(e).real();
+	}
+	Eigen::HouseholderQR<Mat> qr(G*P);
+	Mat Q = qr.householderQ()*Mat::Identity(n+1,k);
+	Mat Rt = qr.matrixQR().topLeftCorner(k,k).triangularView<Eigen::Upper>();
+	double rmax = Rt.diagonal().cwiseAbs().maxCoeff();
+	if(!(Rt.diagonal().cwiseAbs().minCoeff() > 1e-12*rmax)) return kc;
+	// P R^-1, from R^T (P R^-1)^T = P^T
+	Mat PR = Rt.transpose().triangularView<Eigen::Lower>().solve(P.transpose()).transpose();
+	auto T = ws.Tk.leftCols(k);
+	T.noalias() = ws.V.leftCols(j+1)*Q.bottomRows(j+1);
+	if(kc > 0) T.noalias() += ws.Ck.leftCols(kc)*Q.topRows(kc);
+	ws.Ck.leftCols(k) = T;
+	T.noalias() = ws.Y.leftCols(j)*PR.bottomRows(j);
+	if(kc > 0) T.noalias() += ws.Zk.leftCols(kc)*PR.topRows(kc);
+	ws.Zk.leftCols(k) = T;
+	T.noalias() = ws.V.leftCols(j)*PR.bottomRows(j);
+	if(kc > 0) T.noalias() += ws.Uk.leftCols(kc)*PR.topRows(kc);
+	ws.Uk.leftCols(k) = T;
+	return k;
+}
+
+// Right-preconditioned GCRO-DR(m,k) (Parks, de Sturler, Mackey, Johnson and
+// Maiti, SISC 28(5), 2006): GMRES(m) whose cycles keep the residual
+// orthogonal to Ck = R Zk and spend m-k steps on Arnoldi with (I - Ck Ck^T)
+// R M^-1. The subspace Zk is carried over to the next call, where Ck is
+// rebuilt from the current R at the cost of k matrix products (counted as
+// iterations), so a solve at a nearby velocity starts with the slow
+// directions of the last one already deflated. Returns the number of
+// iterations (one matrix product each).
+int ConvDiff::GCRODR(const Vec& b, Vec& x, double tol, int maxIter, int m, int k)
+{
+	TRACE_SCOPE(TRACE_KRYLOV);
+	// with k near m each cycle adds too few new directions to make progress
+	m = std::max(2,std::min(m,dof));
+	k = std::max(1,std::min(k,m/2));
+	if(ws.V.rows() != dof || ws.V.cols() != m+1)
+	{
+		ws.V.resize(dof,m+1);
+		ws.H.resize(m+1,m);
+		ws.cs.resize(m);
+		ws.sn.resize(m);
+		ws.g.resize(m+1);
+		ws.h.resize(m);
+	}
+	if(ws.Y.rows() != dof || ws.Y.cols() != m)
+	{
+		ws.Y.resize(dof,m);
+		ws.Gk.resize(m+1,m);
+	}
+	if(ws.Zk.rows() != dof || ws.Zk.cols() != k)
+	{
+		ws.Zk.resize(dof,k);
+		ws.Ck.resize(dof,k);
+		ws.Uk.resize(dof,k);
+		ws.Tk.resize(dof,k);
+		ws.recycled = 0;
+	}
+	Vec& r = ws.r;
+	Vec& w = ws.t;
+	Vec& y = ws.y;
+	double bnorm = b.norm();
+	if(bnorm == 0.0) bnorm = 1.0;
+	int iter = 0;
+	// the subspace came from another operator: Ck = R Zk again
+	int kc = ws.recycled;
+	for(int i = 0; i < kc; i++)
+	{
+		ws.s = ws.Zk.col(i);
+		MatVec(ws.s,w);
+		ws.Ck.col(i) = w;
+		iter++;
+	}
+	kc = OrthonormalizeRecycled(kc);
+	MatVec(x,r);
+	r = b - r;
+	int stalled = 0;
+	bool done = false;
+	while(true)
+	{
+		// x += Zk Ck^T r, r -= Ck Ck^T r
+		for(int i = 0; i < kc; i++)
+		{
+			double c = ws.Ck.col(i).dot(r);
+			x += c*ws.Zk.col(i);
+			r -= c*ws.Ck.col(i);
+		}
+		double beta = r.norm();
+		if(beta <= tol*bnorm || iter >= maxIter) break;
+		// the recurrence claims convergence but rounding keeps the true
+		// residual above tol: give up after a couple of retries
+		if(done && ++stalled > 2) break;
+		// Gk = [I B; 0 Hbar] is upper Hessenberg, rotated into H
+		int steps = m-kc;
+		ws.V.col(0) = r/beta;
+		ws.g.setZero();
+		ws.g(kc) = beta;
+		ws.Gk.setZero();
+		ws.H.setZero();
+		for(int i = 0; i < kc; i++)
+		{
+			ws.Gk(i,i) = 1.0;
+			ws.H(i,i) = 1.0;
+			ws.cs(i) = 1.0;
+			ws.sn(i) = 0.0;
+		}
+		int j = 0;
+		done = false;
+		while(j < steps && iter < maxIter && !done)
+		{
+			int col = kc+j;
+			ApplyPrecond(ws.V.col(j),y);
+			ws.Y.col(j) = y;
+			MatVec(y,w);
+			for(int i = 0; i < kc; i++)
+			{
+				double c = ws.Ck.col(i).dot(w);
+				w -= c*ws.Ck.col(i);
+				ws.Gk(i,col) = c;
+			}
+			for(int i = 0; i <= j; i++)
+			{
+				double c = ws.V.col(i).dot(w);
+				w -= c*ws.V.col(i);
+				ws.Gk(kc+i,col) = c;
+			}
+			double hnext = w.norm();
+			ws.Gk(col+1,col) = hnext;
+			if(hnext > 0.0) ws.V.col(j+1) = w/hnext;
+			ws.H.col(col).head(col+1) = ws.Gk.col(col).head(col+1);
+			for(int i = kc; i < col; i++)
+			{
+				double hij = ws.H(i,col);
+				ws.H(i,col) = ws.cs(i)*hij + ws.sn(i)*ws.H(i+1,col);
+				ws.H(i+1,col) = -ws.sn(i)*hij + ws.cs(i)*ws.H(i+1,col);
+			}
+			double d = std::hypot(ws.H(col,col),hnext);
+			ws.cs(col) = d > 0.0 ? ws.H(col,col)/d : 1.0;
+			ws.sn(col) = d > 0.0 ? hnext/d : 0.0;
+			ws.H(col,col) = d;
+			ws.g(col+1) = -ws.sn(col)*ws.g(col);
+			ws.g(col) *= ws.cs(col);
+			j++;
+			iter++;
+			done = (std::abs(ws.g(col+1)) <= tol*bnorm || hnext == 0.0);
+		}
+		int n = kc+j;
+		for(int i = n-1; i >= 0; i--)
+		{
+			double sum = ws.g(i);
+			for(int l = i+1; l < n; l++) sum -= ws.H(i,l)*ws.h(l);
+			ws.h(i) = ws.H(i,i) != 0.0 ? sum/ws.H(i,i) : 0.0;
+		}
+		// x += Zk h_top + Y h_bottom
+		for(int i = 0; i < kc; i++) x += ws.h(i)*ws.Zk.col(i);
+		for(int i = 0; i < j; i++) x += ws.h(kc+i)*ws.Y.col(i);
+		kc = UpdateRecycled(kc,j,k);
+		MatVec(x,r);
+		r = b - r;
+	}
+	ws.recycled = kc;
+	TRACE_COUNT(COUNT_KRYLOVITERATIONS,iter);
+	return iter;
+}
+
+// Preconditioned IDR(s) with biorthogonalization (van Gijzen and Sonneveld,
+// ACM TOMS 38(1), 2011). The shadow space P is a fixed pseudo-random
+// orthonormal basis, so runs are reproducible. Returns the number of
+// iterations (one matrix product each).
+int ConvDiff::IDRS(const Vec& b, Vec& x, double tol, int maxIter, int s)
+{
+	TRACE_SCOPE(TRACE_KRYLOV);
+	s = std::max(1,std::min(s,dof));
+	Mat& P = ws.P;
+	Mat& G = ws.G;
+	Mat& U = ws.U;
+	Mat& M = ws.M;
+	Vec& f = ws.f;
+	Vec& c = ws.c;
+	if(P.rows() != dof || P.cols() != s)
+	{
+		P.resize(dof,s);
+		G.resize(dof,s);
+		U.resize(dof,s);
+		M.resize(s,s);
+		f.resize(s);
+		c.resize(s);
+		uint64_t seed = 12345;
+		for(int j = 0; j < s; j++)
+		{
+			for(int i = 0; i < dof; i++)
+			{
+				seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+				P(i,j) = (seed >> 11)*(1.0/9007199254740992.0) - 0.5;
+			}
+			for(int i = 0; i < j; i++) P.col(j) -= P.col(i).dot(P.col(j))*P.col(i);
+			P.col(j).normalize();
+		}
+	}
+	Vec& r = ws.r;
+	Vec& v = ws.v;
+	Vec& y = ws.y;
+	Vec& t = ws.t;
+	double bnorm = b.norm();
+	if(bnorm == 0.0) bnorm = 1.0;
+	int iter = 0;
+	// The recursively updated residual drifts away from the true one; when
+	// it claims convergence too early, start over from the true residual.
+	for(int restart = 0; restart < 3 && iter < maxIter; restart++)
+	{
+		MatVec(x,r);
+		r = b - r;
+		double rnorm = r.norm();
+		if(rnorm <= tol*bnorm) break;
+		G.setZero();
+		U.setZero();
+		M.setIdentity();
+		double om = 1.0;
+		while(rnorm > tol*bnorm && iter < maxIter)
+		{
+			for(int i = 0; i < s; i++) f(i) = P.col(i).dot(r);
+			for(int k = 0; k < s; k++)
+			{
+				// c = M(k:s,k:s)^-1 f(k:s), M lower triangular
+				for(int i = k; i < s; i++)
+				{
+					double sum = f(i);
+					for(int j = k; j < i; j++) sum -= M(i,j)*c(j);
+					c(i) = sum/M(i,i);
+				}
+				v = r;
+				for(int i = k; i < s; i++) v -= c(i)*G.col(i);
+				ApplyPrecond(v,y);
+				y *= om;
+				for(int i = k; i < s; i++) y += c(i)*U.col(i);
+				U.col(k) = y;
+				MatVec(y,t);
+				G.col(k) = t;
+				for(int i = 0; i < k; i++)
+				{
+					double alpha = P.col(i).dot(G.col(k))/M(i,i);
+					G.col(k) -= alpha*G.col(i);
+					U.col(k) -= alpha*U.col(i);
+				}
+				for(int i = k; i < s; i++) M(i,k) = P.col(i).dot(G.col(k));
+				iter++;
+				if(M(k,k) == 0.0)
+				{
+					TRACE_COUNT(COUNT_KRYLOVITERATIONS,iter);
+					return iter;
+				}
+				double beta = f(k)/M(k,k);
+				r -= beta*G.col(k);
+				x += beta*U.col(k);
+				rnorm = r.norm();
+				if(rnorm <= tol*bnorm || iter >= maxIter) break;
+				for(int i = k+1; i < s; i++) f(i) -= beta*M(i,k);
+			}
+			if(rnorm <= tol*bnorm || iter >= maxIter) break;
+			// dimension reduction step, with the omega safeguard of the paper
+			ApplyPrecond(r,y);
+			MatVec(y,t);
+			double tt = t.dot(t);
+			double tr = t.dot(r);
+			om = tt > 0.0 ? tr/tt : 0.0;
+			double rho = std::abs(tr)/(std::sqrt(tt)*rnorm);
+			if(rho < 0.7 && rho > 0.0) om *= 0.7/rho;
+			x += om*y;
+			r -= om*t;
+			rnorm = r.norm();
+			iter++;
+		}
+	}
+	TRACE_COUNT(COUNT_KRYLOVITERATIONS,iter);
+	return iter;
+}
+
+double ConvDiff::Solve()
+{
+	if(discretization == DISCRETIZATION_HDG) return SolveHDG();
+	TRACE_SCOPE(TRACE_SOLVE);
+	TRACE_COUNT(COUNT_SOLVES,1);
+	FillSystem();
+	bool cached = (config.method == SOLVER_AUTO && tuned.count(TuneKey()));
+	RunSolver(config.method == SOLVER_AUTO ? Tune() : config,2*dof);
+	double resid = PhiResidual();
+	// a choice timed at another velocity of the same range can fail here:
+	// time the candidates again at this one
+	if(cached && !(resid <= 1e-8*rhs.norm()))
+	{
+		tuned.erase(TuneKey());
+		RunSolver(Tune(),2*dof);
+		resid = PhiResidual();
+	}
+	contValid = (resid <= 1e-8*rhs.norm());
+	contHasPrev = false;
+	contUx = ux;
+	contUy = uy;
+	return resid;
+}
+
+// ||R phi - rhs|| for the system in ws.R.
+double ConvDiff::PhiResidual()
+{
+	ws.r.noalias() = ws.R*phi;
+	ws.r -= rhs;
+	return ws.r.norm();
+}
+
+// Solve at the current velocity by continuation from the last converged
+// solution, or from u = 0, along the straight path between the two
+// velocities. Each step predicts phi by extrapolating the last two
+// solutions, kept only if that lowers the residual, and corrects it with
+// the configured Krylov method: to a loose tolerance on the way and the
+// configured one at the end. The ILU(0) factors are kept across steps and
+// calls while the velocity stays within 20% (plus one) of where they were
+// computed, and recomputed early when a corrector fails on them or needs
+// twice the iterations the first one did. A failed step is retried at half
+// the size and a quick one doubles the next. Below 1/64 of the path, or
+// past 4*dof iterations, the direct solver finishes, which bounds the time
+// per call. A direct configuration just solves directly. Returns
+// ||R phi - rhs||.
+double ConvDiff::SolveContinuation(ContinuationStats *stats)
+{
+	if(discretization == DISCRETIZATION_HDG)
+	{
+		if(stats) *stats = ContinuationStats();
+		return SolveHDG();
+	}
+	TRACE_SCOPE(TRACE_SOLVE);
+	TRACE_COUNT(COUNT_SOLVES,1);
+	ContinuationStats local;
+	ContinuationStats& st = (stats ? *stats : local);
+	st = ContinuationStats();
+	const double tx = ux, ty = uy;
+	FillSystem();
+	// tuning solves at the target and overwrites phi
+	contSaved = phi;
+	SolverConfig cfg = (config.method == SOLVER_AUTO ? Tune() : config);
+	phi = contSaved;
+	if(cfg.method == SOLVER_DIRECT || (cfg.precond == PRECOND_ILU0 && ordering == ORDER_MODE))
+	{
+		RunSolver(cfg,2*dof);
+		double resid = PhiResidual();
+		contValid = (resid <= 1e-8*rhs.norm());
+		contHasPrev = false;
+		contUx = tx;
+		contUy = ty;
+		return resid;
+	}
+	used = cfg;
+	precond = cfg.precond;
+	const double stepTol = 1e-8;
+	const double stepAccept = 1e-6;
+	const double finalAccept = 1e-8;
+	const int stepIter = std::min(2*dof,200);
+	const double reuseRadius = 0.2;
+	double bnorm = rhs.norm();
+	if(bnorm == 0.0) bnorm = 1.0;
+	if(!contValid)
+	{
+		phi.setZero();
+		contUx = contUy = 0.0;
+		contHasPrev = false;
+	}
+	// phi is converged at (cx,cy) except on a cold start
+	double cx = contUx, cy = contUy;
+	bool converged = contValid;
+	contValid = false;
+	double s = 0.0, ds = 1.0;
+	while(s < 1.0)
+	{
+		double sn = std::min(1.0,s+ds);
+		bool last = (sn == 1.0);
+		double nx = last ? tx : contUx+sn*(tx-contUx);
+		double ny = last ? ty : contUy+sn*(ty-contUy);
+		contSaved = phi;
+		ux = nx;
+		uy = ny;
+		FillSystem();
+		if(contHasPrev)
+		{
+			double dx = cx-contPrevUx, dy = cy-contPrevUy;
+			double a = ((nx-cx)*dx+(ny-cy)*dy)/(dx*dx+dy*dy);
+			double before = PhiResidual();
+			phi += a*(contSaved-contPrev);
+			if(PhiResidual() > before) phi = contSaved;
+		}
+		bool fresh = false;
+		if(precond == PRECOND_ILU0)
+		{
+			double du = std::hypot(ux-ws.luUx,uy-ws.luUy);
+			if(!ws.luValid || du > reuseRadius*std::hypot(ws.luUx,ws.luUy)+1.0)
+			{
+				FactorILU0();
+				st.factorizations++;
+				fresh = true;
+			}
+			else if(du > 0.0) st.reuses++;
+		}
+		int it = Krylov(cfg,rhs,phi,last ? cfg.tol : stepTol,last ? 2*dof : stepIter);
+		st.iterations += it;
+		bool ok = PhiResidual() <= (last ? finalAccept : stepAccept)*bnorm;
+		if(fresh)
+		{
+			ws.luIter = it;
+			ws.luIterFinal = last;
+		}
+		// the factors have gone stale once they take twice the iterations
+		else if(precond == PRECOND_ILU0 && (!ok || (last == ws.luIterFinal && it > 2*std::max(ws.luIter,5))))
+		{
+			ws.luValid = false;
+		}
+		if(ok)
+		{
+			if(converged)
+			{
+				contPrev = contSaved;
+				contPrevUx = cx;
+				contPrevUy = cy;
+				contHasPrev = (cx != nx || cy != ny);
+			}
+			cx = nx;
+			cy = ny;
+			converged = true;
+			s = sn;
+			st.steps++;
+			if(it <= stepIter/4) ds *= 2.0;
+		}
+		else
+		{
+			phi = contSaved;
+			// first blame reused factors, then the step size
+			if(precond != PRECOND_ILU0 || fresh)
+			{
+				st.rejected++;
+				ds *= 0.5;
+			}
+		}
+		if(s < 1.0 && (ds < 1.0/64 || st.iterations > 4*dof))
+		{
+			ux = tx;
+			uy = ty;
+			FillSystem();
+			SolverConfig direct = cfg;
+			direct.method = SOLVER_DIRECT;
+			RunSolver(direct,2*dof);
+			st.fallback = true;
+			contHasPrev = false;
+			break;
+		}
+	}
+	iterations = st.iterations;
+	TRACE_COUNT(COUNT_CONTINUATIONSTEPS,st.steps);
+	TRACE_COUNT(COUNT_PRECONDREUSES,st.reuses);
+	double resid = PhiResidual();
+	contValid = (resid <= 1e-8*rhs.norm());
+	contUx = tx;
+	contUy = ty;
+	return resid;
+}
+
+// Solve R phi = rhs, already filled in, with the given configuration. A
+// failed direct factorization falls back to BiCGSTAB with ILU(0). ILU(0) of
+// the mode-major numbering, which factors the nearly singular block of the
+// element means first, stalls even without convection, so under ORDER_MODE
+// a Krylov method with it solves directly instead and the fallback uses
+// Jacobi.
+void ConvDiff::RunSolver(const SolverConfig& cfg, int maxIter)
+{
+	used = cfg;
+	if(used.precond == PRECOND_ILU0 && ordering == ORDER_MODE) used.method = SOLVER_DIRECT;
+	if(used.method == SOLVER_DIRECT)
+	{
+		if(SolveDirect())
+		{
+			iterations = 0;
+			return;
+		}
+		used.method = SOLVER_BICGSTAB;
+		used.precond = (ordering == ORDER_MODE ? PRECOND_JACOBI : PRECOND_ILU0);
+	}
+	precond = used.precond;
+	SetupPrecond();
+	phi.setZero();
+	iterations = Krylov(used,rhs,phi,used.tol,maxIter);
+}
+
+// Run the Krylov method of cfg on b from x, with the preconditioner set up.
+int ConvDiff::Krylov(const SolverConfig& cfg, const Vec& b, Vec& x, double tol, int maxIter)
+{
+	if(cfg.method == SOLVER_GMRES) return GMRES(b,x,tol,maxIter,cfg.restart);
+	if(cfg.method == SOLVER_IDRS) return IDRS(b,x,tol,maxIter,cfg.shadow);
+	// the recycled subspace belongs to R, so adjoint solves run plain GMRES
+	if(cfg.method == SOLVER_GCRODR) return transposed ? GMRES(b,x,tol,maxIter,cfg.restart) : GCRODR(b,x,tol,maxIter,cfg.restart,cfg.recycle);
+	return BiCGSTAB(b,x,tol,maxIter);
+}
+
+// Gradient of a functional J(phi) at the last solution from one adjoint
+// solve, R^T adj = dJ/dphi: dJ/du = -adj^T (dR/du) phi and, for the source
+// parameters, dJ/dp = adj^T d(rhs)/dp. Call it after Solve(), with the
+// velocity unchanged. The adjoint reuses the last solve's LU factors when it
+// was direct (with Eigen 3.4 or later; before that it runs BiCGSTAB with
+// ILU(0)), otherwise its Krylov method with the preconditioner applied
+// transposed. R has a kink at ux = 0 (uy = 0); there the derivative for
+// increasing ux (uy) is returned. dsource, when given, receives
+// SOURCE_NUMPARAMS values and resid ||R^T adj - dJdphi||. Only the IP-DG
+// discretization has an adjoint: under HDG it returns false and sets every
+// output to NaN.
+bool ConvDiff::Gradient(const Vec& dJdphi, double& dux, double& duy, double *dsource, double *resid)
+{
+	if(discretization == DISCRETIZATION_HDG)
+	{
+		dux = duy = std::numeric_limits<double>::quiet_NaN();
+		if(dsource) for(int q = 0; q < SOURCE_NUMPARAMS; q++) dsource[q] = dux;
+		if(resid) *resid = dux;
+		return false;
+	}
+	TRACE_SCOPE(TRACE_ADJOINT);
+	bool solved = false;
+	adjointIterations = 0;
+#if EIGEN_VERSION_AT_LEAST(3,4,0)
+	if(used.method == SOLVER_DIRECT)
+	{
+		TRACE_SCOPE(TRACE_SUBSTITUTION);
+		adj = ws.direct.transpose().solve(dJdphi);
+		solved = true;
+	}
+#endif
+	if(!solved)
+	{
+		// without SparseLU::transpose() a direct solve falls back as in
+		// RunSolver, for this solve only
+		Preconditioner saved = precond;
+		if(used.method == SOLVER_DIRECT)
+		{
+			precond = (ordering == ORDER_MODE ? PRECOND_JACOBI : PRECOND_ILU0);
+			SetupPrecond();
+		}
+		transposed = true;
+		adj.setZero();
+		adjointIterations = Krylov(used,dJdphi,adj,used.tol,2*dof);
+		transposed = false;
+		precond = saved;
+	}
+	ApplyConvection(ux >= 0.0 ? 1.0 : 0.0,ux >= 0.0 ? 0.0 : 1.0,0.0,0.0,phi,ws.t);
+	dux = -adj.dot(ws.t);
+	ApplyConvection(0.0,0.0,uy >= 0.0 ? 1.0 : 0.0,uy >= 0.0 ? 0.0 : 1.0,phi,ws.t);
+	duy = -adj.dot(ws.t);
+	if(dsource)
+	{
+		if(!rhsGradValid) BuildRHSGrad();
+		for(int q = 0; q < SOURCE_NUMPARAMS; q++) dsource[q] = adj.dot(rhsGrad.col(q));
+	}
+	if(resid)
+	{
+		ws.r.noalias() = ws.R.transpose()*adj;
+		ws.r -= dJdphi;
+		*resid = ws.r.norm();
+	}
+	return true;
+}
+
+// y = R^T R x
+void ConvDiff::NormalProduct(const Vec& x, Vec& y)
+{
+	ws.t.noalias() = ws.R*x;
+	y.noalias() = ws.R.transpose()*ws.t;
+}
+
+// y = (R^T R)^-1 x, with R factored by FactorDirect()
+void ConvDiff::InverseNormalProduct(const Vec& x, Vec& y)
+{
+#if EIGEN_VERSION_AT_LEAST(3,4,0)
+	Vec u = ws.direct.transpose().solve(x);
+#else
+	// without SparseLU::transpose() R^T is solved iteratively, as in
+	// Gradient(), with the ILU(0) factors EstimateSpectrum() computed
+	Vec u = Vec::Zero(dof);
+	transposed = true;
+	BiCGSTAB(x,u,1e-13,2*dof);
+	transposed = false;
+#endif
+	y = ws.direct.solve(u);
+}
+
+// Largest eigenvalue of the symmetric positive operator op by Lanczos with
+// full reorthogonalization, from a fixed start vector, stopping once the
+// largest Ritz value settles to 1e-10 or after maxSteps steps.
+double ConvDiff::LanczosLargest(void (ConvDiff::*op)(const Vec&, Vec&), int maxSteps, int& steps)
+{
+	int m = std::min(maxSteps,dof);
+	Mat V(dof,m+1);
+	Vec alpha(m), beta(m), w(dof);
+	for(int i = 0; i < dof; i++) V(i,0) = std::sin(1.0+0.7548776662*i);
+	V.col(0).normalize();
+	double theta = 0.0;
+	steps = 0;
+	for(int j = 0; j < m; j++)
+	{
+		(this->*op)(V.col(j),w);
+		alpha(j) = V.col(j).dot(w);
+		for(int pass = 0; pass < 2; pass++) w -= V.leftCols(j+1)*(V.leftCols(j+1).transpose()*w);
+		beta(j) = w.norm();
+		steps = j+1;
+		Mat T = Mat::Zero(j+1,j+1);
+		for(int k = 0; k <= j; k++)
+		{
+			T(k,k) = alpha(k);
+			if(k > 0) T(k,k-1) = T(k-1,k) = beta(k-1);
+		}
+		double last = theta;
+		theta = Eigen::SelfAdjointEigenSolver<Mat>(T,Eigen::EigenvaluesOnly).eigenvalues()(j);
+		if(std::abs(theta-last) <= 1e-10*theta || beta(j) <= 1e-14*theta) break;
+		V.col(j+1) = w/beta(j);
+	}
+	return theta;
+}
+
+// Extreme singular values and Ritz values of R at the current velocity;
+// each Krylov run takes at most maxSteps steps. The ws.R values and, for
+// sigmaMin, the direct solver's factors are left at this velocity.
+void ConvDiff::EstimateSpectrum(int maxSteps, SpectrumEstimate& est)
+{
+	FillSystem();
+	int steps;
+	est.sigmaMax = std::sqrt(LanczosLargest(&ConvDiff::NormalProduct,maxSteps,steps));
+	est.lanczosSteps = steps;
+	if(FactorDirect())
+	{
+#if !EIGEN_VERSION_AT_LEAST(3,4,0)
+		precond = PRECOND_ILU0;
+		SetupPrecond();
+#endif
+		est.sigmaMin = 1.0/std::sqrt(LanczosLargest(&ConvDiff::InverseNormalProduct,maxSteps,steps));
+		est.lanczosSteps += steps;
+	}
+	else est.sigmaMin = 0.0;
+	est.condition = est.sigmaMax/est.sigmaMin;
+
+	// Arnoldi on R M^-1, with modified Gram-Schmidt applied twice
+	int m = std::min(maxSteps,dof);
+	Mat V(dof,m+1);
+	Mat H = Mat::Zero(m+1,m);
+	Vec w(dof);
+	for(int i = 0; i < dof; i++) V(i,0) = std::sin(1.0+0.7548776662*i);
+	V.col(0).normalize();
+	precond = config.precond;
+	SetupPrecond();
+	int k = 0;
+	for(int j = 0; j < m; j++)
+	{
+		ApplyPrecond(V.col(j),ws.z);
+		w.noalias() = ws.R*ws.z;
+		for(int pass = 0; pass < 2; pass++)
+		{
+			for(int i = 0; i <= j; i++)
+			{
+				double hij = V.col(i).dot(w);
+				H(i,j) += hij;
+				w -= hij*V.col(i);
+			}
+		}
+		H(j+1,j) = w.norm();
+		k = j+1;
+		if(H(j+1,j) <= 1e-14*H.col(j).norm()) break;
+		V.col(j+1) = w/H(j+1,j);
+	}
+	Eigen::EigenSolver<Mat> eig(H.topLeftCorner(k,k),false);
+	est.ritz.resize(k);
+	for(int i = 0; i < k; i++) est.ritz[i] = eig.eigenvalues()(i);
+}
+
+// The spectrum of the unpinned A + U(ux,uy), exactly, through its Bloch
+// symbols. On the uniform periodic grid the operator is block circulant:
+// for Fourier mode (kx,ky) it maps c exp(2 pi i (kx ix + ky iy)/N), the
+// same modes c on every element (ix,iy), to S c times the same wave, where
+// S is the nb x nb sum of an element row's blocks weighted by the phase of
+// their neighbour. The N^2 symbols together have every eigenvalue and
+// singular value of the operator. Column kx*N+ky of eig and sv receives
+// them for that mode, singular values in decreasing order; mode (0,0) holds
+// the zero that the constants give. The symbols are read from an element
+// row of ws.R, which is filled for the current velocity. Returns false for
+// N = 1, where every row of the one element is needed and one is pinned,
+// or when only part of the grid is assembled.
+bool ConvDiff::SymbolSpectrum(CMat& eig, Mat& sv)
+{
+	if(N < 2 || ex0 != 0 || ex1 != N || ey0 != 0 || ey1 != N) return false;
+	FillSystem();
+	// any element but (0,0), whose first row is the pinning row
+	int ex = N/2, ey = N/2;
+	const int *outer = ws.R.outerIndexPtr();
+	const int *inner = ws.R.innerIndexPtr();
+	const double *vals = ws.R.valuePtr();
+	eig.resize(nb,N*N);
+	sv.resize(nb,N*N);
+	CMat S(nb,nb);
+	Eigen::ComplexEigenSolver<CMat> es;
+	Eigen::JacobiSVD<CMat> svd;
+	for(int kx = 0; kx < N; kx++)
+	{
+		for(int ky = 0; ky < N; ky++)
+		{
+			S.setZero();
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					int i = idx(ex,ey,qx,qy);
+					int q = ((qx+qy)*(qx+qy+1))/2 + qx;
+					for(int k = outer[i]; k < outer[i+1]; k++)
+					{
+						int jx, jy;
+						dofElement(inner[k],jx,jy);
+						// the phase only depends on the offset modulo N
+						double t = 2.0*PI*(kx*(jx-ex)+ky*(jy-ey))/N;
+						S(q,dofMode(inner[k])) += vals[k]*std::complex<double>(std::cos(t),std::sin(t));
+					}
+				}
+			}
+			es.compute(S,false);
+			svd.compute(S);
+			eig.col(kx*N+ky) = es.eigenvalues();
+			sv.col(kx*N+ky) = svd.singularValues();
+		}
+	}
+	return true;
+}
+
+// Peclet number range of the current velocity: 0 below 1, then one range
+// per doubling.
+int ConvDiff::PecletBucket()
+{
+	double pe = std::max(std::abs(ux),std::abs(uy))*L/diffconst;
+	return pe < 1.0 ? 0 : 1+(int)std::log2(pe);
+}
+
+// Fastest configuration for the current grid and Peclet range. The first
+// time a range is seen every candidate solves the current system and is
+// timed; candidates that do not reach a relative residual of 1e-8 are
+// rejected, and once one has converged the others get at most four times
+// its number of matrix products. Restart length, shadow dimension and tolerance
+// come from the configuration set with SetSolverConfig.
+long ConvDiff::TuneKey()
+{
+	return ((long)N*(POLYMAX+1)+K)*64 + PecletBucket();
+}
+
+const SolverConfig& ConvDiff::Tune()
+{
+	long key = TuneKey();
+	std::map<long,SolverConfig>::iterator found = tuned.find(key);
+	if(found != tuned.end()) return found->second;
+	TRACE_SCOPE(TRACE_TUNE);
+	TRACE_COUNT(COUNT_TUNINGS,1);
+	static const SolverMethod methods[] = { SOLVER_BICGSTAB, SOLVER_GMRES, SOLVER_IDRS, SOLVER_BICGSTAB, SOLVER_IDRS, SOLVER_DIRECT };
+	static const Preconditioner preconds[] = { PRECOND_ILU0, PRECOND_ILU0, PRECOND_ILU0, PRECOND_JACOBI, PRECOND_JACOBI, PRECOND_NONE };
+	AnalyzeDirect();
+	double bnorm = rhs.norm();
+	SolverConfig best = config;
+	best.method = SOLVER_BICGSTAB;
+	best.precond = PRECOND_ILU0;
+	double bestMs = -1.0;
+	int products = 2*dof;
+	for(size_t k = 0; k < sizeof(methods)/sizeof(methods[0]); k++)
+	{
+		SolverConfig cfg = config;
+		cfg.method = methods[k];
+		cfg.precond = preconds[k];
+		// BiCGSTAB makes two matrix products per iteration
+		int perIter = (cfg.method == SOLVER_BICGSTAB ? 2 : 1);
+		ws.factored = false;
+		double start = Tracer::Now();
+		RunSolver(cfg,products/perIter);
+		double ms = Tracer::Now()-start;
+		ws.r.noalias() = ws.R*phi;
+		ws.r -= rhs;
+		if(used.method != cfg.method || ws.r.norm() > 1e-8*bnorm) continue;
+		products = std::min(products,4*std::max(iterations*perIter,5));
+		if(bestMs < 0.0 || ms < bestMs)
+		{
+			best = cfg;
+			bestMs = ms;
+		}
+	}
+	return tuned[key] = best;
+}
+
+// Trace unknowns of face (0 west, 1 east, 2 south, 3 north) of element
+// (ix,iy) start here. Faces x = ix*h come first, then faces y = iy*h.
+int ConvDiff::TraceIndex(int ix, int iy, int face)
+{
+	if(face == 1) ix = (ix+1 == N ? 0 : ix+1);
+	if(face == 3) iy = (iy+1 == N ? 0 : iy+1);
+	return ((face >= 2 ? N*N : 0) + ix*N+iy)*(K+1);
+}
+
+// Pattern of the trace matrix and where each element's condensed block
+// lands in it.
+void ConvDiff::SetupHDG()
+{
+	int nt = K+1;
+	int n4 = 4*nt;
+	int ntrace = 2*N*N*nt;
+	std::vector<Trip> elems;
+	elems.reserve((size_t)N*N*n4*n4);
+	for(int ix = 0; ix < N; ix++)
+	{
+		for(int iy = 0; iy < N; iy++)
+		{
+			for(int i = 0; i < n4; i++)
+			{
+				for(int j = 0; j < n4; j++)
+				{
+					elems.push_back(Trip(TraceIndex(ix,iy,i/nt)+i%nt,TraceIndex(ix,iy,j/nt)+j%nt,1.0));
+				}
+			}
+		}
+	}
+	hdg.S.resize(ntrace,ntrace);
+	hdg.S.setFromTriplets(elems.begin(),elems.end());
+	hdg.S.makeCompressed();
+	const int *outer = hdg.S.outerIndexPtr();
+	const int *inner = hdg.S.innerIndexPtr();
+	hdg.pos.resize(elems.size());
+	for(size_t k = 0; k < elems.size(); k++)
+	{
+		int col = elems[k].col();
+		hdg.pos[k] = std::lower_bound(inner+outer[col],inner+outer[col+1],elems[k].row())-inner;
+	}
+	hdg.row0Pos.clear();
+	for(int k = 0; k < hdg.S.nonZeros(); k++) if(inner[k] == 0) hdg.row0Pos.push_back(k);
+	hdg.g.resize(ntrace);
+	hdg.lambda.resize(ntrace);
+	hdg.F.resize(nb,N*N);
+	hdg.Lam.resize(n4,N*N);
+	hdg.direct.analyzePattern(hdg.S);
+	hdg.ready = true;
+}
+
+// The element matrices of IP-H for the current velocity, scaled like the
+// IP-DG ones by (2/h)^2. On a face with outward normal n the flux is
+// -grad phi.n + (u.n) lambda + tau (phi - lambda) with
+// tau = sigma0/h^beta0 + max(u.n,0), which upwinds the convection; the
+// element equations are symmetrized as in SIPG, and the trace equations
+// ask for a single-valued flux. The (u.n) lambda term of the trace
+// equations cancels between the two sides of a face and is left out.
+void ConvDiff::BuildHDGLocal()
+{
+	double h = L/N;
+	double s = 2.0/h;
+	double alpha = sigma0/std::pow(h,beta0);
+	int nt = K+1;
+	int n4 = 4*nt;
+	hdg.A.setZero(nb,nb);
+	hdg.B.setZero(nb,n4);
+	hdg.C.setZero(n4,nb);
+	hdg.D.setZero(n4,n4);
+	// west, east, south, north
+	const double un[4] = { -ux, ux, -uy, uy };
+	const double sign[4] = { -1.0, 1.0, -1.0, 1.0 };
+	const double *vals[4] = { normLegendreLeftVals, normLegendreRightVals, normLegendreLeftVals, normLegendreRightVals };
+	const double *dvals[4] = { normLegendreDerivLeftVals, normLegendreDerivRightVals, normLegendreDerivLeftVals, normLegendreDerivRightVals };
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			int a = ((px+py)*(px+py+1))/2 + px;
+			for(int qx = 0; qx < K+1; qx++)
+			{
+				for(int qy = 0; qy < K+1-qx; qy++)
+				{
+					int b = ((qx+qy)*(qx+qy+1))/2 + qx;
+					double val = 0.0;
+					val += diffconst*s*s*(normLegendreDerivProducts[px][qx]*(py == qy ? 1.0 : 0.0) + (px == qx ? 1.0 : 0.0)*normLegendreDerivProducts[py][qy]);
+					val -= s*(ux*normLegendreAltProducts[px][qx]*(py == qy ? 1.0 : 0.0) + uy*(px == qx ? 1.0 : 0.0)*normLegendreAltProducts[py][qy]);
+					for(int f = 0; f < 4; f++)
+					{
+						// normal and tangential degrees of the trial and test functions
+						int pn = f < 2 ? px : py, pt = f < 2 ? py : px;
+						int qn = f < 2 ? qx : qy, qt = f < 2 ? qy : qx;
+						if(pt != qt) continue;
+						double tau = alpha + std::max(un[f],0.0);
+						val -= diffconst*s*s*sign[f]*(dvals[f][pn]*vals[f][qn] + vals[f][pn]*dvals[f][qn]);
+						val += s*tau*vals[f][pn]*vals[f][qn];
+					}
+					hdg.A(b,a) = val;
+				}
+			}
+			// couplings to the traces, whose degree matches the tangential one
+			for(int f = 0; f < 4; f++)
+			{
+				int pn = f < 2 ? px : py, pt = f < 2 ? py : px;
+				double tau = alpha + std::max(un[f],0.0);
+				int t = f*nt + pt;
+				hdg.B(a,t) = diffconst*s*s*sign[f]*dvals[f][pn] - s*tau*vals[f][pn] + s*un[f]*vals[f][pn];
+				hdg.C(t,a) = diffconst*s*s*sign[f]*dvals[f][pn] - s*tau*vals[f][pn];
+			}
+		}
+	}
+	for(int f = 0; f < 4; f++)
+	{
+		double tau = alpha + std::max(un[f],0.0);
+		for(int k = 0; k < nt; k++) hdg.D(f*nt+k,f*nt+k) = s*tau;
+	}
+}
+
+// Solve the HDG discretization: condense every element onto its face
+// traces, solve the trace system with sparse LU, and recover the element
+// modes into phi. The constant left free by the periodic problem is pinned
+// by one trace unknown and then shifted to satisfy the same condition the
+// IP-DG system pins, so both give comparable solutions. Returns the
+// residual of the trace system. If the trace system cannot be factored, phi
+// is the IP-DG solution from the configured solver and the residual is that
+// system's.
+double ConvDiff::SolveHDG()
+{
+	TRACE_SCOPE(TRACE_SOLVE);
+	TRACE_COUNT(COUNT_SOLVES,1);
+	if(!hdg.ready) SetupHDG();
+	int nt = K+1;
+	int n4 = 4*nt;
+	{
+		TRACE_SCOPE(TRACE_ASSEMBLY);
+		BuildHDGLocal();
+		hdg.local.compute(hdg.A);
+		hdg.W.noalias() = hdg.local.solve(hdg.B);
+		hdg.Sloc = hdg.D;
+		hdg.Sloc.noalias() -= hdg.C*hdg.W;
+		double *vals = hdg.S.valuePtr();
+		std::fill(vals,vals+hdg.S.nonZeros(),0.0);
+		size_t k = 0;
+		for(int e = 0; e < N*N; e++)
+		{
+			for(int i = 0; i < n4; i++)
+			{
+				for(int j = 0; j < n4; j++) vals[hdg.pos[k++]] += hdg.Sloc(i,j);
+			}
+		}
+		// pin trace unknown 0: its row becomes the identity
+		for(size_t r = 0; r < hdg.row0Pos.size(); r++) vals[hdg.row0Pos[r]] = 0.0;
+		vals[hdg.S.outerIndexPtr()[0]] = 1.0;
+
+		// element loads and the trace right-hand side
+		for(int ix = 0; ix < N; ix++)
+		{
+			for(int iy = 0; iy < N; iy++)
+			{
+				for(int px = 0; px < K+1; px++)
+				{
+					for(int py = 0; py < K+1-px; py++) hdg.F(((px+py)*(px+py+1))/2 + px,ix*N+iy) = rhs(idx(ix,iy,px,py));
+				}
+			}
+		}
+		hdg.F(0,0) = rhsPinned;
+		hdg.Y.noalias() = hdg.local.solve(hdg.F);
+		hdg.Lam.noalias() = hdg.C*hdg.Y;
+		hdg.g.setZero();
+		for(int ix = 0; ix < N; ix++)
+		{
+			for(int iy = 0; iy < N; iy++)
+			{
+				for(int i = 0; i < n4; i++) hdg.g(TraceIndex(ix,iy,i/nt)+i%nt) -= hdg.Lam(i,ix*N+iy);
+			}
+		}
+		hdg.g(0) = 0.0;
+	}
+	{
+		TRACE_SCOPE(TRACE_FACTOR);
+		hdg.direct.factorize(hdg.S);
+	}
+	if(hdg.direct.info() != Eigen::Success)
+	{
+		// as a failed direct IP-DG solve falls back to an iterative one
+		FillSystem();
+		RunSolver(config.method == SOLVER_AUTO ? Tune() : config,2*dof);
+		return PhiResidual();
+	}
+	{
+		TRACE_SCOPE(TRACE_SUBSTITUTION);
+		hdg.lambda = hdg.direct.solve(hdg.g);
+		// back-substitution, phi_T = A^-1 (f_T - B lambda_T)
+		for(int ix = 0; ix < N; ix++)
+		{
+			for(int iy = 0; iy < N; iy++)
+			{
+				for(int i = 0; i < n4; i++) hdg.Lam(i,ix*N+iy) = hdg.lambda(TraceIndex(ix,iy,i/nt)+i%nt);
+			}
+		}
+		hdg.Y.noalias() -= hdg.W*hdg.Lam;
+		double shift = 0.0;
+		for(int py = 0; py < K+1; py++) shift -= hdg.Y(((py*(py+1))/2),0);
+		for(int ix = 0; ix < N; ix++)
+		{
+			for(int iy = 0; iy < N; iy++)
+			{
+				for(int px = 0; px < K+1; px++)
+				{
+					for(int py = 0; py < K+1-px; py++)
+					{
+						int m = ((px+py)*(px+py+1))/2 + px;
+						phi(idx(ix,iy,px,py)) = hdg.Y(m,ix*N+iy) + (m == 0 ? shift : 0.0);
+					}
+				}
+			}
+		}
+	}
+	iterations = 0;
+	hdg.g -= hdg.S*hdg.lambda;
+	return hdg.g.norm();
+}
+
+double ConvDiff::Eval(double x, double y)
+{
+	// wrap into [0,L]; idx() wraps the element at x = L
+	if(x < 0.0 || x > L) x -= L*std::floor(x/L);
+	if(y < 0.0 || y > L) y -= L*std::floor(y/L);
+	double h = L/N;
+	int ix = x/h;
+	int iy = y/h;
+	double val = 0.0;
+	double xc = (ix+0.5)*h;
+	double yc = (iy+0.5)*h;
+	for(int px = 0; px < K+1; px++)
+	{
+		for(int py = 0; py < K+1-px; py++)
+		{
+			val += phi(idx(ix,iy,px,py)) * LegendreEvalNorm(px,(x-xc)*(2.0/h)) * LegendreEvalNorm(py,(y-yc)*(2.0/h));
+		}
+	}
+	return val;
+}
+
+// Normalized Legendre values P_0..P_K at t and, when d is given, their
+// derivatives, by the recurrences of LegendreEval and LegendreDerivEval.
+static void LegendreTable(int K, double t, const double *invNorm, double *p, double *d)
+{
+	double prev = 1.0, cur = t, dcur = 1.0;
+	p[0] = invNorm[0];
+	if(d) d[0] = 0.0;
+	if(K == 0) return;
+	p[1] = t*invNorm[1];
+	if(d) d[1] = invNorm[1];
+	for(int n = 1; n < K; n++)
+	{
+		double next = ((2.0*n+1.0)*t*cur - n*prev)/(n+1.0);
+		dcur = (n+1.0)*cur + t*dcur;
+		prev = cur;
+		cur = next;
+		p[n+1] = cur*invNorm[n+1];
+		if(d) d[n+1] = dcur*invNorm[n+1];
+	}
+}
+
+// Evaluate phi at n finite points (x[k],y[k]), wrapped periodically, into
+// val, and its gradient into dx and dy when both are given. The points are bucketed
+// by element with a counting sort, so each element's coefficients are
+// gathered once for all of its points; each point then needs one pass of
+// the Legendre recurrences per direction. The work space grows to the
+// largest n seen, so repeated calls do not allocate.
+void ConvDiff::EvalPoints(int n, const double *x, const double *y, double *val, double *dx, double *dy)
+{
+	TRACE_SCOPE(TRACE_EVAL);
+	double h = L/N;
+	int ne = N*N;
+	probeStart.assign(ne+1,0);
+	probeOrder.resize(n);
+	probeElem.resize(n);
+	probeLocal.resize(2*n);
+	for(int k = 0; k < n; k++)
+	{
+		double xw = x[k]-L*std::floor(x[k]/L);
+		double yw = y[k]-L*std::floor(y[k]/L);
+		// rounding can leave a wrapped coordinate at L
+		int ix = std::min((int)(xw/h),N-1);
+		int iy = std::min((int)(yw/h),N-1);
+		probeElem[k] = ix*N+iy;
+		probeLocal[2*k] = (xw-(ix+0.5)*h)*(2.0/h);
+		probeLocal[2*k+1] = (yw-(iy+0.5)*h)*(2.0/h);
+		probeStart[ix*N+iy+1]++;
+	}
+	for(int e = 0; e < ne; e++) probeStart[e+1] += probeStart[e];
+	for(int k = 0; k < n; k++) probeOrder[probeStart[probeElem[k]]++] = k;
+	// the fill advanced each start to the next bucket's
+	for(int e = ne; e > 0; e--) probeStart[e] = probeStart[e-1];
+	probeStart[0] = 0;
+
+	bool grad = dx && dy;
+	double invNorm[POLYMAX+1];
+	for(int p = 0; p <= K; p++) invNorm[p] = 1.0/LegendreL2Norm(p);
+	double c[(POLYMAX+1)*(POLYMAX+1)];
+	double px[POLYMAX+1], py[POLYMAX+1], dpx[POLYMAX+1], dpy[POLYMAX+1];
+	for(int e = 0; e < ne; e++)
+	{
+		if(probeStart[e] == probeStart[e+1]) continue;
+		// c[i*(K+1)+j] is the coefficient of P_i(x) P_j(y)
+		for(int i = 0; i < K+1; i++)
+		{
+			for(int j = 0; j < K+1-i; j++) c[i*(K+1)+j] = phi(idx(e/N,e%N,i,j));
+		}
+		for(int q = probeStart[e]; q < probeStart[e+1]; q++)
+		{
+			int k = probeOrder[q];
+			LegendreTable(K,probeLocal[2*k],invNorm,px,grad ? dpx : NULL);
+			LegendreTable(K,probeLocal[2*k+1],invNorm,py,grad ? dpy : NULL);
+			double v = 0.0, vx = 0.0, vy = 0.0;
+			for(int i = 0; i < K+1; i++)
+			{
+				const double *ci = c+i*(K+1);
+				double s = 0.0, sy = 0.0;
+				for(int j = 0; j < K+1-i; j++) s += ci[j]*py[j];
+				v += px[i]*s;
+				if(!grad) continue;
+				for(int j = 0; j < K+1-i; j++) sy += ci[j]*dpy[j];
+				vx += dpx[i]*s;
+				vy += px[i]*sy;
+			}
+			val[k] = v;
+			if(grad)
+			{
+				dx[k] = vx*(2.0/h);
+				dy[k] = vy*(2.0/h);
+			}
+		}
+	}
+}
+
+// Evaluate rows [row0,row0+rows) of a res by res raster covering [0,L)^2,
+// sampled at the same points as repaintHigh. Rows run in y, columns in x.
+// The per-column basis values are kept between calls with the same res, so
+// a raster can be produced a few rows at a time at little extra cost. They
+// are stored one mode at a time across the columns, and each element's
+// columns are summed together a mode at a time, so the inner loops run over
+// consecutive pixels and vectorize; every pixel still sums its modes in
+// order, so the values do not depend on the vector width.
+void ConvDiff::EvalStrip(int res, int row0, int rows, float *out)
+{
+	TRACE_SCOPE(TRACE_EVAL);
+	double h = L/N;
+	if(stripRes != res)
+	{
+		stripColStart.resize(N+1);
+		stripColVals.resize(res*(K+1));
+		int e = 0;
+		for(int j = 0; j < res; j++)
+		{
+			double x = L*(1.0*j)/res;
+			int ix = x/h;
+			if(ix >= N) ix = N-1;
+			while(e <= ix) stripColStart[e++] = j;
+			for(int px = 0; px < K+1; px++)
+			{
+				stripColVals[px*res+j] = LegendreEvalNorm(px,(x-(ix+0.5)*h)*(2.0/h));
+			}
+		}
+		while(e <= N) stripColStart[e++] = res;
+		stripRowVals.resize(K+1);
+		stripElemCoeffs.resize(N*(K+1));
+		stripSums.resize(res);
+		stripRes = res;
+	}
+	const std::vector<int>& colStart = stripColStart;
+	const double *colVals = stripColVals.data();
+	std::vector<double>& rowVals = stripRowVals;
+	std::vector<double>& elemCoeffs = stripElemCoeffs;
+	double *sums = stripSums.data();
+
+	for(int i = row0; i < row0+rows; i++)
+	{
+		double y = L*(1.0*i)/res;
+		int iy = y/h;
+		if(iy >= N) iy = N-1;
+		for(int py = 0; py < K+1; py++)
+		{
+			rowVals[py] = LegendreEvalNorm(py,(y-(iy+0.5)*h)*(2.0/h));
+		}
+
+		// collapse the y direction once per element in this row
+		for(int ix = 0; ix < N; ix++)
+		{
+			for(int px = 0; px < K+1; px++)
+			{
+				double c = 0.0;
+				for(int py = 0; py < K+1-px; py++)
+				{
+					c += phi(idx(ix,iy,px,py)) * rowVals[py];
+				}
+				elemCoeffs[ix*(K+1)+px] = c;
+			}
+		}
+
+		std::fill(sums,sums+res,0.0);
+		for(int ix = 0; ix < N; ix++)
+		{
+			const double *c = &elemCoeffs[ix*(K+1)];
+			for(int px = 0; px < K+1; px++)
+			{
+				const double *v = colVals+px*res;
+				const double cp = c[px];
+				for(int j = colStart[ix]; j < colStart[ix+1]; j++) sums[j] += cp*v[j];
+			}
+		}
+		float *outRow = out + (size_t)(i-row0)*res;
+		for(int j = 0; j < res; j++) outRow[j] = (float)sums[j];
+	}
+}
+
+static void SwapToBigEndian(float *data, size_t n)
+{
+	const unsigned int one = 1;
+	if(*((const unsigned char*)&one) == 0) return;
+	for(size_t k = 0; k < n; k++)
+	{
+		unsigned char *b = (unsigned char*)(data+k);
+		unsigned char t = b[0]; b[0] = b[3]; b[3] = t;
+		t = b[1]; b[1] = b[2]; b[2] = t;
+	}
+}
+
+// Stream the solution to disk as a res by res float32 raster, tileRows rows
+// at a time. RASTER_RAW is headerless native-endian row-major data;
+// RASTER_VTK is a legacy binary VTK structured-points file.
+bool ConvDiff::WriteRaster(const char *fname, int res, RasterFormat format, int tileRows)
+{
+	FILE *f = fopen(fname,"wb");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s for writing\n",fname);
+		return false;
+	}
+	if(format == RASTER_VTK)
+	{
+		fprintf(f,"# vtk DataFile Version 3.0\n");
+		fprintf(f,"ConvDiff2d solution N=%d K=%d ux=%g uy=%g\n",N,K,ux,uy);
+		fprintf(f,"BINARY\nDATASET STRUCTURED_POINTS\n");
+		fprintf(f,"DIMENSIONS %d %d 1\n",res,res);
+		fprintf(f,"ORIGIN 0 0 0\n");
+		fprintf(f,"SPACING %.17g %.17g 1\n",L/res,L/res);
+		fprintf(f,"POINT_DATA %lld\n",(long long)res*res);
+		fprintf(f,"SCALARS phi float 1\nLOOKUP_TABLE default\n");
+	}
+
+	if(tileRows < 1) tileRows = 1;
+	if(tileRows > res) tileRows = res;
+	std::vector<float> tile((size_t)tileRows*res);
+	bool ok = true;
+	for(int row0 = 0; row0 < res && ok; row0 += tileRows)
+	{
+		int rows = (row0+tileRows > res) ? res-row0 : tileRows;
+		EvalStrip(res,row0,rows,tile.data());
+		if(format == RASTER_VTK) SwapToBigEndian(tile.data(),(size_t)rows*res);
+		ok = (fwrite(tile.data(),sizeof(float),(size_t)rows*res,f) == (size_t)rows*res);
+	}
+	if(format == RASTER_VTK) fprintf(f,"\n");
+	if(fclose(f) != 0) ok = false;
+	if(!ok) fprintf(stderr,"error writing %s\n",fname);
+	return ok;
+}
+
+// Write the modal coefficients of every element as text, one line per mode:
+// ix iy px py value, in the normalized Legendre basis of the element.
+bool ConvDiff::WriteCoeffs(const char *fname)
+{
+	FILE *f = fopen(fname,"w");
+	if(!f)
+	{
+		fprintf(stderr,"could not open %s for writing\n",fname);
+		return false;
+	}
+	fprintf(f,"# N %d K %d L %.17g ux %.17g uy %.17g\n",N,K,L,ux,uy);
+	fprintf(f,"# ix iy px py coeff\n");
+	for(int ix = 0; ix < N; ix++)
+	{
+		for(int iy = 0; iy < N; iy++)
+		{
+			for(int px = 0; px < K+1; px++)
+			{
+				for(int py = 0; py < K+1-px; py++)
+				{
+					fprintf(f,"%d %d %d %d %.17g\n",ix,iy,px,py,phi(idx(ix,iy,px,py)));
+				}
+			}
+		}
+	}
+	bool ok = (fclose(f) == 0);
+	if(!ok) fprintf(stderr,"error writing %s\n",fname);
+	return ok;
+}
+
+double ConvDiff::SolResid()
+{
+	TRACE_SCOPE(TRACE_ERRORESTIMATE);
+	int sp = 21;
+	int numpts = sp*sp;
+	double resid = 0.0;
+	double sizeRHS = 0.0;
+	double h = L/sp;
+	for(int i = 0; i < sp; i++)
+	{
+		for(int j = 0; j < sp; j++)
+		{
+			double xx = (0.5+i)*h;
+			double yy = (0.5+j)*h;
+			double val = 0.0;
+			val -= diffconst*( -Eval(xx+4.0*h,yy)/560.0 + Eval(xx+3.0*h,yy)*8.0/315.0  -Eval(xx+2.0*h,yy)/5.0+Eval(xx+h,yy)*8.0/5.0+Eval(xx-h,yy)*8.0/5.0-Eval(xx-2.0*h,yy)/5.0 + Eval(xx-3.0*h,yy)*8.0/315.0 - Eval(xx-4.0*h,yy)/560.0 - Eval(xx,yy+4.0*h)/560.0+Eval(xx,yy+3.0*h)*8.0/315.0 -Eval(xx,yy+2.0*h)/5.0+Eval(xx,yy+h)*8.0/5.0+Eval(xx,yy-h)*8.0/5.0-Eval(xx,yy-2.0*h)/5.0 + Eval(xx,yy-3.0*h)*8.0/315.0 - Eval(xx,yy-4.0*h)/560.0 - Eval(xx,yy)*2.0*205.0/72.0 )/(h*h);
+			val += ux * (-Eval(xx+4.0*h,yy)/280.0+Eval(xx+3.0*h,yy)*4.0/105.0-Eval(xx+2.0*h,yy)/5.0+Eval(xx+h,yy)*4.0/5.0-Eval(xx-h,yy)*4.0/5.0+Eval(xx-2.0*h,yy)/5.0-Eval(xx-3.0*h,yy)*4.0/105.0+Eval(xx-4.0*h,yy)/280.0)/(h);
+			val += uy * (-Eval(xx,yy+4.0*h)/280.0+Eval(xx,yy+3.0*h)*4.0/105.0-Eval(xx,yy+2.0*h)/5.0+Eval(xx,yy+h)*4.0/5.0-Eval(xx,yy-h)*4.0/5.0+Eval(xx,yy-2.0*h)/5.0-Eval(xx,yy-3.0*h)*4.0/105.0+Eval(xx,yy-4.0*h)/280.0)/(h);
+			val -= EvalRHS(source,xx/L,yy/L);
+			resid += std::pow(val,2);
+			sizeRHS += std::pow(EvalRHS(source,xx/L,yy/L),2);
+		}
+	}
+	resid = std::pow(resid/numpts,0.5);
+	sizeRHS = std::pow(sizeRHS/numpts,0.5);
+	return resid/sizeRHS;
+}
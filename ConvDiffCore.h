@@ -0,0 +1,653 @@
+// Solver core: the IP-DG discretization, its solver and evaluators, and the
+// tracing hooks they report to. Everything here is independent of the UI and
+// of MPI; ConvDiff2d.cpp and the C API in ConvDiffAPI.cpp build on it.
+#ifndef CONVDIFFCORE_H
+#define CONVDIFFCORE_H
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/SparseLU>
+#include <vector>
+#include <cmath>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <map>
+#include <limits>
+#include <complex>
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define CONVDIFF_THREADS
+#include <mutex>
+#endif
+
+const double PI = 3.141592653589793238462;
+
+// Number of heap allocations so far, or -1 if counting is not compiled in.
+long AllocationCount();
+
+typedef Eigen::SparseMatrix<double> SpMat;
+typedef Eigen::SparseMatrix<double,Eigen::RowMajor> RowSpMat;
+typedef Eigen::VectorXd Vec;
+typedef Eigen::Triplet<double> Trip;
+typedef Eigen::MatrixXd Mat;
+typedef Eigen::MatrixXcd CMat;
+
+// Scoped timers and counters for the hot paths. Sections are timed by
+// TRACE_SCOPE and accumulate count/total/max statistics; while tracing is on,
+// each timed scope is also recorded as a Chrome trace event (chrome://tracing,
+// Perfetto). Tracing is off until Tracer::SetEnabled(true), and a disabled
+// scope costs one branch; defining CONVDIFF_NO_TRACE compiles it out entirely.
+// Events go into a buffer reserved when tracing is enabled, so recording
+// does not allocate; once it is full further events are only counted.
+enum TraceSection
+{
+	TRACE_FRAME,
+	TRACE_SOLVE,
+	TRACE_ASSEMBLY,
+	TRACE_PRECOND,
+	TRACE_KRYLOV,
+	TRACE_ERRORESTIMATE,
+	TRACE_EVAL,
+	TRACE_RASTER,
+	TRACE_FACTOR,
+	TRACE_SUBSTITUTION,
+	TRACE_TUNE,
+	TRACE_ADJOINT,
+	TRACE_NUMSECTIONS
+};
+
+enum TraceCounter
+{
+	COUNT_SOLVES,
+	COUNT_KRYLOVITERATIONS,
+	COUNT_FRAMES,
+	COUNT_DROPPEDEVENTS,
+	COUNT_TUNINGS,
+	COUNT_CONTINUATIONSTEPS,
+	COUNT_PRECONDREUSES,
+	COUNT_NUMCOUNTERS
+};
+
+struct TraceEvent
+{
+	int section;
+	int tid;
+	double start;
+	double duration;
+};
+
+class Tracer
+{
+private:
+	// read by every scope on every thread; relaxed loads keep a disabled
+	// scope at one branch
+	std::atomic<bool> enabled;
+	double origin;
+	long counts[TRACE_NUMSECTIONS];
+	double totalMs[TRACE_NUMSECTIONS];
+	double maxMs[TRACE_NUMSECTIONS];
+	long counters[COUNT_NUMCOUNTERS];
+	std::vector<TraceEvent> events;
+	size_t maxEvents;
+	std::string statsJSON;
+#ifdef CONVDIFF_THREADS
+	std::mutex lock;
+#endif
+	static int ThreadId();
+public:
+	static const char *SectionName(int section);
+	static const char *CounterName(int counter);
+	Tracer() : enabled(false), maxEvents(1 << 16) { origin = Now(); Reset(); }
+	static Tracer& Get()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+	static double Now();
+	bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+	void SetEnabled(bool on);
+	void Reset();
+	void Record(int section, double start, double end);
+	void Count(int counter, long n);
+	const char *StatsJSON();
+	bool WriteChromeTrace(const char *fname);
+};
+
+class TraceScope
+{
+private:
+	int section;
+	double start;
+public:
+	TraceScope(int section) : section(section), start(Tracer::Get().Enabled() ? Tracer::Now() : -1.0) {}
+	~TraceScope() { if(start >= 0.0) Tracer::Get().Record(section,start,Tracer::Now()); }
+};
+
+#ifdef CONVDIFF_NO_TRACE
+#define TRACE_SCOPE(section)
+#define TRACE_COUNT(counter,n)
+#else
+#define TRACE_CONCAT2(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT2(a,b)
+#define TRACE_SCOPE(section) TraceScope TRACE_CONCAT(traceScope,__LINE__)(section)
+#define TRACE_COUNT(counter,n) do { if(Tracer::Get().Enabled()) Tracer::Get().Count(counter,n); } while(0)
+#endif
+
+// highest polynomial degree the Legendre tables cover
+const int POLYMAX = 20;
+
+// Gauss-Legendre rules and normalized Legendre tables shared by every
+// ConvDiff. They are built once, on first use, and never change afterwards,
+// so any number of solvers may read them concurrently. weights[K] and
+// coords[K] hold the rule used at degree K: 22 points, the rule this code
+// has always used, or K+12 when that is more.
+class LegendreTables
+{
+private:
+	LegendreTables();
+public:
+	std::vector<double> weights[POLYMAX+1];
+	std::vector<double> coords[POLYMAX+1];
+	double derivProducts[POLYMAX+1][POLYMAX+1];
+	double altProducts[POLYMAX+1][POLYMAX+1];
+	double leftVals[POLYMAX+1];
+	double rightVals[POLYMAX+1];
+	double derivLeftVals[POLYMAX+1];
+	double derivRightVals[POLYMAX+1];
+	static int QuadraturePoints(int K) { return K+12 > 22 ? K+12 : 22; }
+	static const LegendreTables& Get();
+};
+
+// Numberings of the unknowns. ORDER_ELEMENT keeps each element's modes
+// together, elements in row-major order: the original layout. ORDER_MODE
+// stores one mode of every element at a time, lowest degree first, so a
+// p-multigrid level is a leading block. ORDER_MORTON and ORDER_HILBERT are
+// element-major along a Z-order or Hilbert curve over the element grid,
+// which keeps face neighbours closer together in the matrix.
+enum DofOrdering { ORDER_ELEMENT, ORDER_MODE, ORDER_MORTON, ORDER_HILBERT };
+
+const char *OrderingName(DofOrdering ordering);
+
+// output formats for ConvDiff::WriteRaster
+enum RasterFormat { RASTER_RAW, RASTER_VTK };
+
+// Linear solvers for ConvDiff::Solve. SOLVER_AUTO times a set of candidate
+// configurations the first time it meets a grid and Peclet number range and
+// then keeps using the fastest. SOLVER_GCRODR is GMRES that carries a
+// subspace of slowly converging directions over from one solve to the next,
+// for sequences of nearby velocities.
+enum SolverMethod { SOLVER_BICGSTAB, SOLVER_DIRECT, SOLVER_GMRES, SOLVER_IDRS, SOLVER_AUTO, SOLVER_GCRODR };
+enum Preconditioner { PRECOND_ILU0, PRECOND_JACOBI, PRECOND_NONE };
+
+struct SolverConfig
+{
+	SolverMethod method = SOLVER_BICGSTAB;
+	Preconditioner precond = PRECOND_ILU0;
+	int restart = 30;    // GMRES(m) restart length m
+	int shadow = 4;      // IDR(s) shadow space dimension s
+	int recycle = 10;    // GCRO-DR(m,k) recycled dimension k, at most m/2
+	double tol = std::numeric_limits<double>::epsilon();  // relative residual
+};
+
+const char *SolverName(SolverMethod method);
+const char *PreconditionerName(Preconditioner precond);
+
+// The source term: a periodic Gaussian of the given width centred at
+// (x0,y0) minus one centred at (x1,y1), in units of the domain side.
+enum SourceParam { SOURCE_X0, SOURCE_Y0, SOURCE_X1, SOURCE_Y1, SOURCE_WIDTH, SOURCE_NUMPARAMS };
+
+struct SourceParams
+{
+	double x0 = 0.2;
+	double y0 = 0.8;
+	double x1 = 0.8;
+	double y1 = 0.2;
+	double width = 0.15;
+};
+
+// Preallocated storage for Solve(). R holds A+U on the pattern of A, which
+// contains that of the convection operators; posA gives where A's entries
+// land in R's value array, and convOffset where those of the convection
+// blocks of every element do, so a new velocity only rewrites values.
+// LU is an ILU(0) factor on the same pattern and the vectors are the
+// Krylov work space. gather holds the entries of x that one element's rows
+// use, for GatherMatVec(). V, H and the small vectors hold the GMRES basis
+// and Hessenberg matrix, and P, G, U, M the IDR(s) shadow space. GCRO-DR
+// keeps its preconditioned basis in Y and its recycled subspace in the
+// first recycled columns of Zk, with Ck = R Zk orthonormal and Uk = M Zk
+// for the preconditioner M; Gk is its Hessenberg matrix and Tk scratch.
+// Everything is sized in init(), or when the restart length, shadow or
+// recycled dimension changes; a steady-state Solve() makes no heap
+// allocations, except that GCRO-DR picks each new recycled subspace through
+// a small dense eigenproblem. The direct solver works on C, a column-major
+// copy of R whose entries sit at colPos; its COLAMD ordering and symbolic
+// analysis are computed once per pattern, and the numeric factorization is
+// redone only when the velocity changes (which, unlike the iterative path,
+// allocates inside Eigen). luUx and luUy record the velocity LU was
+// computed at and luIter the iterations of the first solve on it, so
+// SolveContinuation() can judge when to keep using it at other velocities.
+struct SolveWorkspace
+{
+	RowSpMat R;
+	RowSpMat LU;
+	std::vector<int> posA;
+	std::vector<int> convOffset;
+	std::vector<int> diagPos;
+	std::vector<int> marker;
+	std::vector<double> gather;
+	Vec r, r0, p, v, s, t, y, z;
+	Mat V, H;
+	Vec cs, sn, g, h;
+	Mat P, G, U, M;
+	Vec f, c;
+	Mat Y, Zk, Ck, Uk, Gk, Tk;
+	int recycled;
+	SpMat C;
+	std::vector<int> colPos;
+	Eigen::SparseLU<SpMat,Eigen::COLAMDOrdering<int> > direct;
+	bool analyzed;
+	bool factored;
+	double factoredUx, factoredUy;
+	bool luValid;
+	double luUx, luUy;
+	int luIter;
+	bool luIterFinal;
+};
+
+// Discretizations ConvDiff::Solve can use. DISCRETIZATION_IPDG is the
+// interior-penalty DG system on all N^2*nb modes. DISCRETIZATION_HDG is its
+// hybridizable counterpart (IP-H: the same penalty, an upwind convective
+// flux) with single-valued degree K traces on the 2N^2 faces; the element
+// modes are eliminated locally and only the 2N^2*(K+1) trace unknowns are
+// solved for, so the global system grows like K rather than K^2.
+enum Discretization { DISCRETIZATION_IPDG, DISCRETIZATION_HDG };
+
+// Storage for the HDG solve. Every element has the same local matrices
+// (uniform grid, constant velocity): A couples its modes, B its modes to
+// its four face traces (west, east, south, north, K+1 modes each), C and D
+// the trace equations to the modes and the traces. W = A^-1 B and
+// Sloc = D - C W is the condensed block each element adds to the trace
+// matrix S at the positions in pos. F, Y and Lam hold the per-element
+// loads, A^-1 F and traces, one column per element. The symbolic analysis
+// of S is done once per grid; S is refactored on every solve, which
+// allocates inside Eigen.
+struct HDGWorkspace
+{
+	Mat A, B, C, D, W, Sloc;
+	Eigen::PartialPivLU<Mat> local;
+	Mat F, Y, Lam;
+	SpMat S;
+	std::vector<int> pos;
+	std::vector<int> row0Pos;
+	Vec g, lambda;
+	Eigen::SparseLU<SpMat,Eigen::COLAMDOrdering<int> > direct;
+	bool ready = false;
+};
+
+// What a SolveContinuation() call did.
+struct ContinuationStats
+{
+	int steps = 0;          // accepted velocity steps
+	int rejected = 0;       // steps retried at half the size
+	int factorizations = 0; // ILU(0) factorizations
+	int reuses = 0;         // steps corrected with another velocity's ILU(0)
+	int iterations = 0;     // Krylov iterations over all steps
+	bool fallback = false;  // finished by the direct solver
+};
+
+// What EstimateSpectrum() found for R = A + U(ux,uy) as Solve() sees it,
+// pinned row included. The singular values come from Lanczos on R^T R and,
+// through the sparse LU, on its inverse; the Ritz values from Arnoldi on
+// R M^-1 with the configured preconditioner M, the operator the Krylov
+// solvers iterate on. Extreme Ritz values converge first.
+struct SpectrumEstimate
+{
+	double sigmaMax = 0.0;
+	double sigmaMin = 0.0;
+	double condition = 0.0;   // sigmaMax/sigmaMin
+	int lanczosSteps = 0;     // over both runs
+	std::vector<std::complex<double> > ritz;
+};
+
+class ConvDiff
+{
+private:
+	int N;
+	int K;
+	int dof;
+	int nb;
+	double L;
+	double epsilon = -1.0;
+	double diffconst = 1.0;
+	double sigma0;
+	double beta0 = 1.0;
+	SpMat A;
+	// The convection operators UXP, UXM (ux > 0, ux < 0) and UYP, UYM, kept
+	// compact. UXP couples each element to itself and its west neighbour,
+	// UXM to itself and its east neighbour; the y operators are the x ones
+	// with the roles of x and y swapped (south for west, north for east).
+	// Every block is a 1d (K+1)^2 table in one direction times the identity
+	// in the other, so only the tables are stored: the volume term the two
+	// signs share, each sign's outflow face term on the diagonal block and
+	// its inflow term on the neighbour block. Entry [p*(K+1)+q] couples 1d
+	// mode p of the column to mode q of the row.
+	std::vector<double> convVol;
+	std::vector<double> convOutP;
+	std::vector<double> convOutM;
+	std::vector<double> convInP;
+	std::vector<double> convInM;
+	Vec rhs;
+	double ux = 0.0;
+	double uy = 0.0;
+	int ex0, ex1, ey0, ey1;
+	// EvalStrip() tables for stripRes: the first column of each element
+	// column (N+1 entries), the basis values of mode px at column j in
+	// [px*res+j], and per-row work space
+	int stripRes = -1;
+	std::vector<int> stripColStart;
+	std::vector<double> stripColVals;
+	std::vector<double> stripRowVals;
+	std::vector<double> stripElemCoeffs;
+	std::vector<double> stripSums;
+	// EvalPoints() work space: bucket starts per element, the queries in
+	// element order, and each query's element and reference coordinates
+	std::vector<int> probeStart;
+	std::vector<int> probeOrder;
+	std::vector<int> probeElem;
+	std::vector<double> probeLocal;
+	DofOrdering ordering = ORDER_ELEMENT;
+	// the ordering SetOrdering() asked for, which init() switches to
+	DofOrdering nextOrdering = ORDER_ELEMENT;
+	// position of element ix*N+iy in the ordering, and its inverse
+	std::vector<int> elemPos;
+	std::vector<int> posElem;
+	SolveWorkspace ws;
+	Discretization discretization = DISCRETIZATION_IPDG;
+	HDGWorkspace hdg;
+	// rhs(0) before the pinning row replaced it
+	double rhsPinned = 0.0;
+	Vec phi;
+	SourceParams source;
+	// adjoint solution of the last Gradient() and d(rhs)/d(source), one
+	// column per SourceParam, built on first use
+	Vec adj;
+	Mat rhsGrad;
+	bool rhsGradValid = false;
+	// continuation state: whether phi is converged at (contUx,contUy), and
+	// the converged solution before it
+	bool contValid = false;
+	bool contHasPrev = false;
+	double contUx, contUy, contPrevUx, contPrevUy;
+	Vec contPrev;
+	Vec contSaved;
+	// views of the shared LegendreTables for the current K
+	int numPoints;
+	const double *weights;
+	const double *coords;
+	const double (*normLegendreDerivProducts)[POLYMAX+1];
+	const double (*normLegendreAltProducts)[POLYMAX+1];
+	const double *normLegendreLeftVals;
+	const double *normLegendreRightVals;
+	const double *normLegendreDerivLeftVals;
+	const double *normLegendreDerivRightVals;
+	void UseTables();
+	void SetupOrdering();
+	void BuildMatA();
+	void BuildConvection();
+	int ConvectionRow(int qx, int qy, double cxp, double cxm, double cyp, double cym, int *nbr, int *mode, double *val);
+	void ApplyConvection(double cxp, double cxm, double cyp, double cym, const Vec& x, Vec& y);
+	void BuildRHS();
+	void BuildRHSGrad();
+	void SetupWorkspace();
+	void FillSystem();
+	void FactorILU0();
+	void ApplyILU0(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x);
+	void SetupPrecond();
+	void ApplyILU0Transposed(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x);
+	void ApplyPrecond(Eigen::Ref<const Vec> b, Eigen::Ref<Vec> x);
+	void MatVec(const Vec& x, Vec& y);
+	int BiCGSTAB(const Vec& b, Vec& x, double tol, int maxIter);
+	int GMRES(const Vec& b, Vec& x, double tol, int maxIter, int m);
+	int IDRS(const Vec& b, Vec& x, double tol, int maxIter, int s);
+	int OrthonormalizeRecycled(int kc);
+	int UpdateRecycled(int kc, int j, int k);
+	int GCRODR(const Vec& b, Vec& x, double tol, int maxIter, int m, int k);
+	void AnalyzeDirect();
+	bool SolveDirect();
+	int Krylov(const SolverConfig& cfg, const Vec& b, Vec& x, double tol, int maxIter);
+	void RunSolver(const SolverConfig& cfg, int maxIter);
+	double PhiResidual();
+	int TraceIndex(int ix, int iy, int face);
+	void SetupHDG();
+	void BuildHDGLocal();
+	double SolveHDG();
+	const SolverConfig& Tune();
+	bool FactorDirect();
+	void NormalProduct(const Vec& x, Vec& y);
+	void InverseNormalProduct(const Vec& x, Vec& y);
+	double LanczosLargest(void (ConvDiff::*op)(const Vec&, Vec&), int maxSteps, int& steps);
+	SolverConfig config;
+	SolverConfig used;
+	Preconditioner precond = PRECOND_ILU0;
+	// the Krylov solvers and preconditioners work on R^T
+	bool transposed = false;
+	// Tune()'s choices by grid and Peclet range, for the current ordering,
+	// penalty and solver settings; cleared when any of those change
+	std::map<long,SolverConfig> tuned;
+public:
+	int iterations = 0;
+	int adjointIterations = 0;
+	ConvDiff(int N,int K,double L) : N(N), K(K), L(L), dof(((N*N*(K+1)*(K+2))/2)), sigma0((K+1)*(K+2)*4+1)
+	{
+		UseTables();
+		SetElementRange(0,N,0,N);
+		SetupOrdering();
+	}
+	// Assemble A, the convection tables and rhs, and, over the full element
+	// range, set up the solve workspace; a partial range (a distributed
+	// rank) only assembles, for AssembleSystem().
+	void init()
+	{
+		A.resize(AssemblySize(),AssemblySize());
+		rhs.resize(AssemblySize());
+		rhsGradValid = false;
+		contValid = false;
+		hdg.ready = false;
+		tuned.clear();
+		stripRes = -1;
+		ApplyOrdering();
+		TRACE_SCOPE(TRACE_ASSEMBLY);
+		BuildMatA();
+		BuildConvection();
+		BuildRHS();
+		if(ex1-ex0 < N || ey1-ey0 < N) return;
+		phi.resize(dof);
+		adj.setZero(dof);
+		contPrev.resize(dof);
+		contSaved.resize(dof);
+		SetupWorkspace();
+	}
+	// Change the grid without assembling it, restoring the default sigma0
+	// of the new degree; the next init() assembles.
+	void SetGrid(int N, int K, double L)
+	{
+		this->N = N;
+		this->K = K;
+		this->L = L;
+		dof = ((N*N*(K+1)*(K+2))/2);
+		sigma0 = (K+1)*(K+2)*4+1;
+		UseTables();
+		SetElementRange(0,N,0,N);
+		SetupOrdering();
+	}
+	void reinit(int N, int K, double L)
+	{
+		SetGrid(N,K,L);
+		init();
+	}
+	// Restrict assembly of A, the convection blocks and rhs to the rows of
+	// elements in [ex0,ex1) x [ey0,ey1). Used by the distributed solver,
+	// where each rank only assembles the elements it owns: on a partial range
+	// A, rhs and AssembleSystem()'s R are numbered locally (LocalIndex()),
+	// rows exist only for the range and its face neighbours, and init()
+	// skips the solve workspace, so a rank's storage follows its share of
+	// the elements.
+	void SetElementRange(int ex0, int ex1, int ey0, int ey1)
+	{
+		this->ex0 = ex0;
+		this->ex1 = ex1;
+		this->ey0 = ey0;
+		this->ey1 = ey1;
+	}
+	// Interior penalty sigma0/h^beta0 and the symmetry of the diffusion
+	// flux: epsilon = -1 symmetric, 0 incomplete, 1 non-symmetric. Take
+	// effect at the next init(); reinit() restores the default sigma0 of
+	// the new degree.
+	void SetPenalty(double sigma0, double beta0, double epsilon)
+	{
+		this->sigma0 = sigma0;
+		this->beta0 = beta0;
+		this->epsilon = epsilon;
+		tuned.clear();
+	}
+	double GetSigma0() { return sigma0; }
+	double GetBeta0() { return beta0; }
+	double GetEpsilon() { return epsilon; }
+	void SetDiscretization(Discretization discretization) { this->discretization = discretization; contValid = false; }
+	Discretization GetDiscretization() { return discretization; }
+	// Takes effect at the next init(); the solution is numbered the same way.
+	// Until then the unknowns keep the ordering GetOrdering() returns.
+	void SetOrdering(DofOrdering ordering) { nextOrdering = ordering; }
+	DofOrdering GetOrdering() { return ordering; }
+	// Switch to the SetOrdering() numbering without assembling, for a solver
+	// that only holds a solution given to SetPhi(); init() calls it.
+	void ApplyOrdering()
+	{
+		ordering = nextOrdering;
+		SetupOrdering();
+	}
+	// Element (ix,iy), at most one period off the grid, in the order of
+	// LocalIndex()
+	inline int localElem(int ix, int iy)
+	{
+		int bx = ex1-ex0, by = ey1-ey0;
+		int dx = ix-ex0, dy = iy-ey0;
+		dx += (dx < 0 ? N : 0) - (dx >= N ? N : 0);
+		dy += (dy < 0 ? N : 0) - (dy >= N ? N : 0);
+		if(dx < bx && dy < by) return dx*by+dy;
+		if(dy < by) return bx*by + (dx == bx ? by : 0) + dy;
+		return bx*by + 2*by + (dy == by ? bx : 0) + dx;
+	}
+	// idx() for assembly, local on a partial range
+	inline int aidx(int ix, int iy, int px, int py)
+	{
+		if(ex1-ex0 == N && ey1-ey0 == N) return idx(ix,iy,px,py);
+		return localElem(ix,iy)*nb + ((px+py)*(px+py+1))/2 + px;
+	}
+	// ix and iy may be at most one period off the grid
+	inline int idx(int ix, int iy, int px, int py)
+	{
+		ix += (ix < 0 ? N : 0) - (ix >= N ? N : 0);
+		iy += (iy < 0 ? N : 0) - (iy >= N ? N : 0);
+		int e = elemPos[ix*N+iy];
+		int m = ((px+py)*(px+py+1))/2 + px;
+		return ordering == ORDER_MODE ? m*N*N + e : e*nb + m;
+	}
+	inline void dofElement(int i, int& ix, int& iy)
+	{
+		int e = posElem[ordering == ORDER_MODE ? i%(N*N) : i/nb];
+		ix = e/N;
+		iy = e%N;
+	}
+	inline int dofMode(int i) { return ordering == ORDER_MODE ? i/(N*N) : i%nb; }
+	// Global unknown i, of an element in the range or a face neighbour of
+	// it, in the local numbering of a partial range: the modes of the owned
+	// elements in row-major order, then those of the neighbours beyond the
+	// west, east, south and north sides. The full range keeps i.
+	inline int LocalIndex(int i)
+	{
+		if(ex1-ex0 == N && ey1-ey0 == N) return i;
+		int ix, iy;
+		dofElement(i,ix,iy);
+		return localElem(ix,iy)*nb + dofMode(i);
+	}
+	// rows of A and rhs: dof, or the local unknowns of a partial range
+	int AssemblySize()
+	{
+		int bx = ex1-ex0, by = ey1-ey0;
+		return (bx == N && by == N) ? dof : (bx*by+2*bx+2*by)*nb;
+	}
+	int GetN() { return N; }
+	int GetK() { return K; }
+	double GetL() { return L; }
+	int GetDof() { return dof; }
+	const Vec& GetRHS() { return rhs; }
+	const Vec& GetPhi() { return phi; }
+	void SetPhi(const Vec& phi) { this->phi = phi; contValid = false; }
+	double Eval(double x, double y);
+	void EvalPoints(int n, const double *x, const double *y, double *val, double *dx = NULL, double *dy = NULL);
+	void EvalStrip(int res, int row0, int rows, float *out);
+	bool WriteRaster(const char *fname, int res, RasterFormat format, int tileRows = 64);
+	bool WriteCoeffs(const char *fname);
+	void SetU(double ux, double uy) { this->ux = ux; this->uy = uy; }
+	double GetUx() { return ux; }
+	double GetUy() { return uy; }
+	void SetSource(const SourceParams& source)
+	{
+		this->source = source;
+		BuildRHS();
+		rhsGradValid = false;
+		contValid = false;
+	}
+	const SourceParams& GetSource() { return source; }
+	// Replace the source by a load vector in BuildRHS()'s scaling (the
+	// integral of f against each basis function on the reference element,
+	// numbered by idx()), e.g. for a manufactured solution. SetSource()
+	// goes back to the Gaussian source.
+	void SetRHS(const Vec& load)
+	{
+		rhs = load;
+		rhsPinned = rhs(0);
+		rhs(0) = 0.0;
+		rhsGradValid = false;
+		contValid = false;
+	}
+	void SetSolver(SolverMethod method) { config.method = method; }
+	void SetSolverConfig(const SolverConfig& config)
+	{
+		// the tuned choices carry the old tolerance and Krylov parameters
+		if(config.tol != this->config.tol || config.restart != this->config.restart ||
+			config.shadow != this->config.shadow || config.recycle != this->config.recycle) tuned.clear();
+		this->config = config;
+	}
+	const SolverConfig& GetSolverConfig() { return config; }
+	// the configuration the last Solve() ran with; differs from
+	// GetSolverConfig() under SOLVER_AUTO
+	const SolverConfig& GetUsedSolverConfig() { return used; }
+	int PecletBucket();
+	long TuneKey();
+	double SolResid();
+	void AssembleSystem(SpMat& R);
+	double Solve();
+	double SolveContinuation(ContinuationStats *stats = NULL);
+	bool Gradient(const Vec& dJdphi, double& dux, double& duy, double *dsource = NULL, double *resid = NULL);
+	// adjoint solution of the last Gradient()
+	const Vec& GetAdjoint() { return adj; }
+	void EstimateSpectrum(int maxSteps, SpectrumEstimate& est);
+	bool SymbolSpectrum(CMat& eig, Mat& sv);
+	// the product the wasm SIMD build's solvers use, callable anywhere so
+	// -check can compare it with R x
+	void GatherMatVec(const Vec& x, Vec& y);
+};
+
+double LegendreEval(int p, double y);
+double LegendreDerivEval(int p, double y);
+double LegendreL2Norm(int p);
+double LegendreEvalNorm(int p, double y);
+double LegendreDerivEvalNorm(int p, double y);
+double PeriodicGaussian(double x, double y, double r);
+double EvalRHS(const SourceParams& src, double x, double y);
+void EvalRHSGrad(const SourceParams& src, double x, double y, double *grad);
+void GaussLegendre(int n, double *coords, double *weights);
+
+#endif